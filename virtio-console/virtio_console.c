@@ -0,0 +1,1283 @@
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/idr.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/jiffies.h>
+#include <linux/virtio.h>
+#include <linux/virtio_config.h>
+#include "virtio_console.h"
+
+static struct class *virtio_console_class;
+static dev_t virtio_console_devt;
+static DEFINE_IDA(virtio_console_ida);
+
+/*minor -> device lookup for open() */
+static struct virtio_console_dev *virtio_console_devs[VIRTIO_CONSOLE_MAX_DEVS];
+static DEFINE_SPINLOCK(virtio_console_devs_lock);
+
+static void virtio_console_port_release(struct kref *kref);
+
+/*port lookup, takes a reference */
+static struct virtio_console_port *virtio_console_get_port(struct virtio_console_dev *vcon_dev, u32 id)
+{
+    struct virtio_console_port *port = NULL;
+    unsigned long flags;
+
+    if(id >= vcon_dev->max_nr_ports)
+        return NULL;
+
+    spin_lock_irqsave(&vcon_dev->ports_lock, flags);
+    port = vcon_dev->ports[id];
+    if(port)
+        kref_get(&port->kref);
+    spin_unlock_irqrestore(&vcon_dev->ports_lock, flags);
+
+    return port;
+}
+
+static void virtio_console_put_port(struct virtio_console_port *port)
+{
+    kref_put(&port->kref, virtio_console_port_release);
+}
+
+static struct virtio_console_port *virtio_console_find_port(dev_t devt)
+{
+    unsigned int minor = MINOR(devt) - MINOR(virtio_console_devt);
+    struct virtio_console_port *port = NULL;
+    struct virtio_console_dev *vcon_dev;
+
+    if(minor >= VIRTIO_CONSOLE_MAX_DEVS * VIRTIO_CONSOLE_MAX_PORTS)
+        return NULL;
+
+    spin_lock_irq(&virtio_console_devs_lock);
+    vcon_dev = virtio_console_devs[minor / VIRTIO_CONSOLE_MAX_PORTS];
+    if(vcon_dev)
+        port = virtio_console_get_port(vcon_dev, minor % VIRTIO_CONSOLE_MAX_PORTS);
+    spin_unlock_irq(&virtio_console_devs_lock);
+
+    return port;
+}
+
+/*control queue */
+
+/*send one control message to the host and wait for it to be consumed */
+static int virtio_console_send_control(struct virtio_console_dev *vcon_dev, u32 id, u16 event, u16 value)
+{
+    struct virtio_device *vdev = &vcon_dev->vpci_dev->virtio_dev;
+    struct virtqueue *vq = vcon_dev->c_ovq;
+    struct scatterlist sg;
+    unsigned long timeout;
+    unsigned int len;
+    int ret;
+
+    if(!vcon_dev->multiport)
+        return 0;
+
+    mutex_lock(&vcon_dev->c_ovq_lock);
+
+    vcon_dev->c_out.id = cpu_to_virtio32(vdev, id);
+    vcon_dev->c_out.event = cpu_to_virtio16(vdev, event);
+    vcon_dev->c_out.value = cpu_to_virtio16(vdev, value);
+
+    sg_init_one(&sg, &vcon_dev->c_out, sizeof(vcon_dev->c_out));
+    ret = virtqueue_add_outbuf(vq, &sg, 1, vcon_dev, GFP_KERNEL);
+    if(ret == 0)
+    {
+        virtqueue_kick(vq);
+        /*a host that never consumes it must not hang open(), release() or rmmod */
+        timeout = jiffies + msecs_to_jiffies(VIRTIO_CONSOLE_CTRL_TIMEOUT_MS);
+        while(!virtqueue_get_buf(vq, &len) && !virtqueue_is_broken(vq))
+        {
+            if(time_after(jiffies, timeout))
+            {
+                dev_warn_ratelimited(&vcon_dev->vpci_dev->pdev->dev,
+                                     "Control message %u not consumed by the host\n", event);
+                ret = -ETIMEDOUT;
+                break;
+            }
+            cpu_relax();
+        }
+    }
+
+    mutex_unlock(&vcon_dev->c_ovq_lock);
+    return ret;
+}
+
+/*TX */
+
+static struct virtio_console_txbuf *virtio_console_alloc_txbuf(void)
+{
+    struct virtio_console_txbuf *txbuf;
+
+    txbuf = kzalloc(sizeof(*txbuf), GFP_KERNEL);
+    if(txbuf)
+        sg_init_table(txbuf->sg, VIRTIO_CONSOLE_TX_SEGS);
+    return txbuf;
+}
+
+static void virtio_console_free_txbuf(struct virtio_console_txbuf *txbuf)
+{
+    unsigned int x;
+
+    /*driver pages and spliced pages both hold exactly one reference of ours */
+    for(x = 0; x < txbuf->nsegs; x++)
+        put_page(sg_page(&txbuf->sg[x]));
+    kfree(txbuf);
+}
+
+/*tx_cur can take more data; splice needs a free segment, write() can
+ * also fill up the tail page */
+static bool virtio_console_tx_room(struct virtio_console_port *port, bool need_seg)
+{
+    struct virtio_console_txbuf *txbuf = READ_ONCE(port->tx_cur);
+
+    if(!txbuf || txbuf->nsegs < port->tx_max_segs)
+        return true;
+    return !need_seg && txbuf->tail_owned && txbuf->sg[txbuf->nsegs - 1].length < PAGE_SIZE;
+}
+
+/*writers may add data: the chain being built has room, or it can go out now */
+static bool virtio_console_tx_writable(struct virtio_console_port *port, bool need_seg)
+{
+    return READ_ONCE(port->dead) || !READ_ONCE(port->tx_inflight) ||
+           virtio_console_tx_room(port, need_seg);
+}
+
+/*free the chain the device has finished with, tx_mutex held */
+static void virtio_console_tx_reclaim(struct virtio_console_port *port)
+{
+    struct virtio_console_txbuf *txbuf;
+    unsigned int len;
+
+    while((txbuf = virtqueue_get_buf(port->out_vq, &len)) != NULL)
+    {
+        if(txbuf == port->tx_inflight)
+            port->tx_inflight = NULL;
+        virtio_console_free_txbuf(txbuf);
+    }
+}
+
+/*hand tx_cur to the device as one descriptor chain. While a chain is in
+ * flight tx_cur keeps collecting writes, tx_work sends it on completion, so
+ * an idle port sends right away and a busy one batches. tx_mutex held */
+static int virtio_console_tx_push(struct virtio_console_port *port)
+{
+    struct virtio_console_txbuf *txbuf = port->tx_cur;
+    int ret;
+
+    if(!txbuf || !txbuf->nsegs || port->tx_inflight || port->dead)
+        return 0;
+
+    /*virtio_ring walks the list up to the end marker */
+    sg_mark_end(&txbuf->sg[txbuf->nsegs - 1]);
+    ret = virtqueue_add_outbuf(port->out_vq, txbuf->sg, txbuf->nsegs, txbuf, GFP_KERNEL);
+    if(ret)
+    {
+        /*tx_cur stays open for more segments, drop the marker again */
+        sg_unmark_end(&txbuf->sg[txbuf->nsegs - 1]);
+        dev_warn_ratelimited(port->dev, "Failed to queue TX chain: %d\n", ret);
+        return ret;
+    }
+
+    port->tx_inflight = txbuf;
+    port->tx_cur = NULL;
+    port->stats.tx_chains++;
+    port->stats.tx_segs += txbuf->nsegs;
+
+    virtqueue_kick(port->out_vq);
+    return 0;
+}
+
+/*make sure tx_cur can take more data, waiting for the in-flight chain when
+ * it is full. Called and returns with tx_mutex held */
+static int virtio_console_tx_reserve(struct virtio_console_port *port, bool need_seg, bool nonblock)
+{
+    int ret;
+
+    for(;;)
+    {
+        if(port->dead)
+            return -ENODEV;
+
+        virtio_console_tx_reclaim(port);
+
+        if(!port->tx_cur)
+        {
+            port->tx_cur = virtio_console_alloc_txbuf();
+            if(!port->tx_cur)
+                return -ENOMEM;
+        }
+
+        if(virtio_console_tx_room(port, need_seg))
+            return 0;
+
+        if(!port->tx_inflight)
+        {
+            ret = virtio_console_tx_push(port);
+            if(ret)
+                return ret;
+            continue;
+        }
+
+        if(nonblock)
+            return -EAGAIN;
+
+        mutex_unlock(&port->tx_mutex);
+        ret = wait_event_interruptible(port->tx_wait, virtio_console_tx_writable(port, need_seg));
+        mutex_lock(&port->tx_mutex);
+        if(ret)
+            return ret;
+    }
+}
+
+/*copy user data into the tail page of tx_cur, starting a new page if needed */
+static ssize_t virtio_console_tx_copy(struct virtio_console_port *port, const char __user *ubuf, size_t count)
+{
+    struct virtio_console_txbuf *txbuf = port->tx_cur;
+    struct scatterlist *sg;
+    size_t n;
+
+    if(txbuf->tail_owned && txbuf->sg[txbuf->nsegs - 1].length < PAGE_SIZE)
+    {
+        sg = &txbuf->sg[txbuf->nsegs - 1];
+    }
+    else
+    {
+        struct page *page = alloc_page(GFP_KERNEL);
+
+        if(!page)
+            return -ENOMEM;
+
+        sg = &txbuf->sg[txbuf->nsegs++];
+        sg_set_page(sg, page, 0, 0);
+        txbuf->tail_owned = true;
+    }
+
+    n = min_t(size_t, count, PAGE_SIZE - sg->length);
+    if(copy_from_user(page_address(sg_page(sg)) + sg->length, ubuf, n))
+    {
+        /*never leave an empty segment in the chain */
+        if(sg->length == 0)
+        {
+            put_page(sg_page(sg));
+            txbuf->nsegs--;
+            txbuf->tail_owned = false;
+        }
+        return -EFAULT;
+    }
+
+    sg->length += n;
+    txbuf->len += n;
+    return n;
+}
+
+static void virtio_console_tx_work(struct work_struct *work)
+{
+    struct virtio_console_port *port = container_of(work, struct virtio_console_port, tx_work);
+
+    mutex_lock(&port->tx_mutex);
+    virtio_console_tx_reclaim(port);
+    virtio_console_tx_push(port);
+    mutex_unlock(&port->tx_mutex);
+
+    wake_up_interruptible(&port->tx_wait);
+}
+
+void virtio_console_out_callback(struct virtqueue *vq)
+{
+    struct virtio_pci_dev *vpci_dev = vq->vdev->priv;
+    struct virtio_console_dev *vcon_dev = vpci_dev->drv_priv;
+    struct virtio_console_port *port;
+    unsigned long flags;
+
+    if(!vcon_dev)
+        return;
+
+    spin_lock_irqsave(&vcon_dev->ports_lock, flags);
+    port = vcon_dev->ports[VIRTIO_CONSOLE_VQ_PORT(vq->index)];
+    if(port)
+        schedule_work(&port->tx_work);
+    spin_unlock_irqrestore(&vcon_dev->ports_lock, flags);
+}
+
+/*RX */
+
+static int virtio_console_add_rx_buf(struct virtio_console_port *port, struct virtio_console_rxbuf *buf, gfp_t gfp)
+{
+    struct scatterlist sg[1];
+
+    sg_init_table(sg, 1);
+    sg_set_page(sg, buf->page, PAGE_SIZE, 0);
+    return virtqueue_add_inbuf(port->in_vq, sg, 1, buf, gfp);
+}
+
+/*post one page per ring slot, called once when the port is added */
+static int virtio_console_fill_rx(struct virtio_console_port *port)
+{
+    unsigned int x;
+    int ret;
+
+    port->rx_pool_size = virtqueue_get_vring_size(port->in_vq);
+    port->rx_pool = kcalloc(port->rx_pool_size, sizeof(*port->rx_pool), GFP_KERNEL);
+    if(!port->rx_pool)
+        return -ENOMEM;
+
+    for(x = 0; x < port->rx_pool_size; x++)
+    {
+        struct virtio_console_rxbuf *buf = &port->rx_pool[x];
+
+        INIT_LIST_HEAD(&buf->list);
+        buf->page = alloc_page(GFP_KERNEL);
+        if(!buf->page)
+            return -ENOMEM;
+
+        ret = virtio_console_add_rx_buf(port, buf, GFP_KERNEL);
+        if(ret)
+            return ret;
+    }
+
+    virtqueue_kick(port->in_vq);
+    return 0;
+}
+
+/*give a drained buffer back to the device. The page is reused unless a
+ * pipe still holds it from splice, then the pool gets a fresh one */
+static bool virtio_console_recycle_rx(struct virtio_console_port *port, struct virtio_console_rxbuf *buf)
+{
+    struct page *page = NULL;
+    bool posted = false;
+
+    if(page_ref_count(buf->page) != 1)
+    {
+        page = alloc_page(GFP_KERNEL);
+        put_page(buf->page);
+        buf->page = page;
+    }
+
+    spin_lock_irq(&port->rx_lock);
+    list_del(&buf->list);
+    if(!buf->page)
+        list_add_tail(&buf->list, &port->rx_empty);
+    else if(!port->dead)
+        posted = virtio_console_add_rx_buf(port, buf, GFP_ATOMIC) == 0;
+    spin_unlock_irq(&port->rx_lock);
+
+    return posted;
+}
+
+/*retry buffers that lost their page to a failed allocation */
+static bool virtio_console_refill_rx(struct virtio_console_port *port)
+{
+    struct virtio_console_rxbuf *buf;
+    bool posted = false;
+
+    while(!list_empty_careful(&port->rx_empty))
+    {
+        struct page *page = alloc_page(GFP_KERNEL);
+
+        if(!page)
+            break;
+
+        spin_lock_irq(&port->rx_lock);
+        buf = list_first_entry_or_null(&port->rx_empty, struct virtio_console_rxbuf, list);
+        if(!buf || port->dead)
+        {
+            spin_unlock_irq(&port->rx_lock);
+            put_page(page);
+            break;
+        }
+        list_del(&buf->list);
+        buf->page = page;
+        posted |= virtio_console_add_rx_buf(port, buf, GFP_ATOMIC) == 0;
+        spin_unlock_irq(&port->rx_lock);
+    }
+
+    return posted;
+}
+
+static void virtio_console_rx_kick(struct virtio_console_port *port)
+{
+    spin_lock_irq(&port->rx_lock);
+    if(!port->dead)
+        virtqueue_kick(port->in_vq);
+    spin_unlock_irq(&port->rx_lock);
+}
+
+static struct virtio_console_rxbuf *virtio_console_rx_peek(struct virtio_console_port *port)
+{
+    struct virtio_console_rxbuf *buf;
+
+    spin_lock_irq(&port->rx_lock);
+    buf = list_first_entry_or_null(&port->rx_ready, struct virtio_console_rxbuf, list);
+    spin_unlock_irq(&port->rx_lock);
+
+    return buf;
+}
+
+/*wait for received data, returns 0 at EOF (host closed the port or it was unplugged) */
+static int virtio_console_rx_wait(struct virtio_console_port *port, bool nonblock)
+{
+    int ret;
+
+    while(list_empty_careful(&port->rx_ready))
+    {
+        if(READ_ONCE(port->dead) || !READ_ONCE(port->host_connected))
+            return 0;
+        if(nonblock)
+            return -EAGAIN;
+
+        ret = wait_event_interruptible(port->rx_wait,
+                                       !list_empty_careful(&port->rx_ready) ||
+                                       READ_ONCE(port->dead) ||
+                                       !READ_ONCE(port->host_connected));
+        if(ret)
+            return ret;
+    }
+    return 1;
+}
+
+void virtio_console_in_callback(struct virtqueue *vq)
+{
+    struct virtio_pci_dev *vpci_dev = vq->vdev->priv;
+    struct virtio_console_dev *vcon_dev = vpci_dev->drv_priv;
+    struct virtio_console_port *port;
+    struct virtio_console_rxbuf *buf;
+    bool reposted = false;
+    unsigned long flags;
+    unsigned int len;
+
+    if(!vcon_dev)
+        return;
+
+    spin_lock_irqsave(&vcon_dev->ports_lock, flags);
+    port = vcon_dev->ports[VIRTIO_CONSOLE_VQ_PORT(vq->index)];
+    if(!port)
+        goto out;
+
+    spin_lock(&port->rx_lock);
+    while((buf = virtqueue_get_buf(vq, &len)) != NULL)
+    {
+        if(len == 0)
+        {
+            reposted |= virtio_console_add_rx_buf(port, buf, GFP_ATOMIC) == 0;
+            continue;
+        }
+
+        buf->offset = 0;
+        buf->len = min_t(unsigned int, len, PAGE_SIZE);
+        list_add_tail(&buf->list, &port->rx_ready);
+    }
+    if(reposted)
+        virtqueue_kick(vq);
+    spin_unlock(&port->rx_lock);
+
+    wake_up_interruptible(&port->rx_wait);
+out:
+    spin_unlock_irqrestore(&vcon_dev->ports_lock, flags);
+}
+
+/*file operations */
+
+static int virtio_console_open(struct inode *inode, struct file *filp)
+{
+    struct virtio_console_port *port;
+    int ret = 0;
+
+    port = virtio_console_find_port(inode->i_rdev);
+    if(!port)
+        return -ENXIO;
+
+    /*one opener per port, like a serial line */
+    spin_lock_irq(&port->rx_lock);
+    if(port->dead)
+        ret = -ENXIO;
+    else if(port->guest_connected)
+        ret = -EBUSY;
+    else
+        port->guest_connected = true;
+    spin_unlock_irq(&port->rx_lock);
+
+    if(ret)
+    {
+        virtio_console_put_port(port);
+        return ret;
+    }
+
+    filp->private_data = port;
+    virtio_console_send_control(port->vcon_dev, port->id, VIRTIO_CONSOLE_PORT_OPEN, 1);
+
+    return stream_open(inode, filp);
+}
+
+static int virtio_console_release(struct inode *inode, struct file *filp)
+{
+    struct virtio_console_port *port = filp->private_data;
+
+    mutex_lock(&port->tx_mutex);
+    virtio_console_tx_push(port);
+    mutex_unlock(&port->tx_mutex);
+
+    spin_lock_irq(&port->rx_lock);
+    port->guest_connected = false;
+    spin_unlock_irq(&port->rx_lock);
+
+    if(!READ_ONCE(port->dead))
+        virtio_console_send_control(port->vcon_dev, port->id, VIRTIO_CONSOLE_PORT_OPEN, 0);
+
+    virtio_console_put_port(port);
+    return 0;
+}
+
+static ssize_t virtio_console_read(struct file *filp, char __user *ubuf, size_t count, loff_t *ppos)
+{
+    struct virtio_console_port *port = filp->private_data;
+    struct virtio_console_rxbuf *buf;
+    bool posted = false;
+    ssize_t done = 0;
+    int ret;
+
+    if(mutex_lock_interruptible(&port->rx_mutex))
+        return -ERESTARTSYS;
+
+    ret = virtio_console_rx_wait(port, filp->f_flags & O_NONBLOCK);
+    if(ret <= 0)
+        goto out;
+
+    while(count && (buf = virtio_console_rx_peek(port)) != NULL)
+    {
+        size_t n = min_t(size_t, count, buf->len - buf->offset);
+
+        if(copy_to_user(ubuf + done, page_address(buf->page) + buf->offset, n))
+        {
+            ret = -EFAULT;
+            break;
+        }
+
+        buf->offset += n;
+        done += n;
+        count -= n;
+
+        if(buf->offset == buf->len)
+            posted |= virtio_console_recycle_rx(port, buf);
+    }
+
+    posted |= virtio_console_refill_rx(port);
+    if(posted)
+        virtio_console_rx_kick(port);
+
+    port->stats.rx_bytes += done;
+out:
+    mutex_unlock(&port->rx_mutex);
+    return done ? done : ret;
+}
+
+/*RX pages go into the pipe by reference, the pool keeps its own */
+static const struct pipe_buf_operations virtio_console_pipe_buf_ops = {
+    .release = generic_pipe_buf_release,
+    .get     = generic_pipe_buf_get,
+};
+
+static ssize_t virtio_console_splice_read(struct file *filp, loff_t *ppos, struct pipe_inode_info *pipe,
+                                          size_t len, unsigned int flags)
+{
+    struct virtio_console_port *port = filp->private_data;
+    bool nonblock = (flags & SPLICE_F_NONBLOCK) || (filp->f_flags & O_NONBLOCK);
+    struct virtio_console_rxbuf *buf;
+    bool posted = false;
+    ssize_t done = 0;
+    ssize_t ret;
+
+    if(mutex_lock_interruptible(&port->rx_mutex))
+        return -ERESTARTSYS;
+
+    ret = virtio_console_rx_wait(port, nonblock);
+    if(ret <= 0)
+        goto out;
+
+    while(len && (buf = virtio_console_rx_peek(port)) != NULL)
+    {
+        struct pipe_buffer pbuf = {
+            .ops    = &virtio_console_pipe_buf_ops,
+            .page   = buf->page,
+            .offset = buf->offset,
+            .len    = min_t(size_t, len, buf->len - buf->offset),
+        };
+
+        get_page(buf->page);
+        ret = add_to_pipe(pipe, &pbuf);
+        if(ret < 0)
+            break;
+
+        buf->offset += ret;
+        done += ret;
+        len -= ret;
+        port->stats.splice_pages++;
+
+        if(buf->offset == buf->len)
+            posted |= virtio_console_recycle_rx(port, buf);
+    }
+
+    posted |= virtio_console_refill_rx(port);
+    if(posted)
+        virtio_console_rx_kick(port);
+
+    port->stats.rx_bytes += done;
+out:
+    mutex_unlock(&port->rx_mutex);
+    return done ? done : ret;
+}
+
+static ssize_t virtio_console_write(struct file *filp, const char __user *ubuf, size_t count, loff_t *ppos)
+{
+    struct virtio_console_port *port = filp->private_data;
+    ssize_t done = 0;
+    ssize_t ret = 0;
+
+    if(!count)
+        return 0;
+
+    if(mutex_lock_interruptible(&port->tx_mutex))
+        return -ERESTARTSYS;
+
+    while(count)
+    {
+        ret = virtio_console_tx_reserve(port, false, filp->f_flags & O_NONBLOCK);
+        if(ret)
+            break;
+
+        ret = virtio_console_tx_copy(port, ubuf + done, count);
+        if(ret < 0)
+            break;
+
+        done += ret;
+        count -= ret;
+    }
+
+    if(done)
+    {
+        port->stats.tx_bytes += done;
+        virtio_console_tx_push(port);
+    }
+
+    mutex_unlock(&port->tx_mutex);
+    return done ? done : ret;
+}
+
+/*append a pipe page to tx_cur by reference, as sendfile() on a socket does */
+static int virtio_console_pipe_to_sg(struct pipe_inode_info *pipe, struct pipe_buffer *buf,
+                                     struct splice_desc *sd)
+{
+    struct virtio_console_port *port = sd->u.data;
+    struct virtio_console_txbuf *txbuf = port->tx_cur;
+    unsigned int len = min_t(size_t, buf->len, sd->len);
+
+    if(txbuf->nsegs == port->tx_max_segs)
+        return 0;
+
+    get_page(buf->page);
+    sg_set_page(&txbuf->sg[txbuf->nsegs++], buf->page, len, buf->offset);
+    txbuf->len += len;
+    txbuf->tail_owned = false;
+    port->stats.splice_pages++;
+
+    return len;
+}
+
+static ssize_t virtio_console_splice_write(struct pipe_inode_info *pipe, struct file *filp, loff_t *ppos,
+                                           size_t len, unsigned int flags)
+{
+    struct virtio_console_port *port = filp->private_data;
+    bool nonblock = (flags & SPLICE_F_NONBLOCK) || (filp->f_flags & O_NONBLOCK);
+    struct splice_desc sd = {
+        .total_len = len,
+        .flags     = flags,
+        .pos       = *ppos,
+        .u.data    = port,
+    };
+    ssize_t ret;
+
+    if(mutex_lock_interruptible(&port->tx_mutex))
+        return -ERESTARTSYS;
+
+    ret = virtio_console_tx_reserve(port, true, nonblock);
+    if(ret)
+        goto out;
+
+    pipe_lock(pipe);
+    ret = 0;
+    if(!pipe_empty(pipe->head, pipe->tail))
+        ret = __splice_from_pipe(pipe, &sd, virtio_console_pipe_to_sg);
+    pipe_unlock(pipe);
+
+    if(ret > 0)
+    {
+        port->stats.tx_bytes += ret;
+        virtio_console_tx_push(port);
+    }
+
+out:
+    mutex_unlock(&port->tx_mutex);
+    return ret;
+}
+
+static __poll_t virtio_console_poll(struct file *filp, poll_table *wait)
+{
+    struct virtio_console_port *port = filp->private_data;
+    __poll_t mask = 0;
+
+    poll_wait(filp, &port->rx_wait, wait);
+    poll_wait(filp, &port->tx_wait, wait);
+
+    if(READ_ONCE(port->dead))
+        return EPOLLHUP;
+
+    if(!list_empty_careful(&port->rx_ready))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if(virtio_console_tx_writable(port, false))
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    if(!READ_ONCE(port->host_connected))
+        mask |= EPOLLHUP;
+
+    return mask;
+}
+
+static const struct file_operations virtio_console_fops = {
+    .owner       = THIS_MODULE,
+    .open        = virtio_console_open,
+    .release     = virtio_console_release,
+    .read        = virtio_console_read,
+    .write       = virtio_console_write,
+    .splice_read = virtio_console_splice_read,
+    .splice_write = virtio_console_splice_write,
+    .poll        = virtio_console_poll,
+};
+
+/*sysfs: udev uses "name" for the /dev/virtio-ports/<name> symlink */
+static ssize_t name_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct virtio_console_port *port = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%s\n", port->name ? port->name : "");
+}
+static DEVICE_ATTR_RO(name);
+
+static struct attribute *virtio_console_port_attrs[] = {
+    &dev_attr_name.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(virtio_console_port);
+
+/*debugfs: <debugfs>/virtio-drivers/<pci name>/console/port<N> */
+static int virtio_console_port_stats_show(struct seq_file *s, void *unused)
+{
+    struct virtio_console_port *port = s->private;
+    struct virtio_console_port_stats *stats = &port->stats;
+
+    seq_printf(s, "rx_bytes:     %llu\n", stats->rx_bytes);
+    seq_printf(s, "tx_bytes:     %llu\n", stats->tx_bytes);
+    seq_printf(s, "tx_chains:    %llu\n", stats->tx_chains);
+    seq_printf(s, "tx_segs:      %llu\n", stats->tx_segs);
+    seq_printf(s, "splice_pages: %llu\n", stats->splice_pages);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(virtio_console_port_stats);
+
+/*ports */
+
+static void virtio_console_free_rx(struct virtio_console_port *port)
+{
+    unsigned int x;
+
+    if(!port->rx_pool)
+        return;
+
+    for(x = 0; x < port->rx_pool_size; x++)
+        if(port->rx_pool[x].page)
+            put_page(port->rx_pool[x].page);
+    kfree(port->rx_pool);
+    port->rx_pool = NULL;
+}
+
+static void virtio_console_port_release(struct kref *kref)
+{
+    struct virtio_console_port *port = container_of(kref, struct virtio_console_port, kref);
+
+    virtio_console_free_rx(port);
+    if(port->tx_cur)
+        virtio_console_free_txbuf(port->tx_cur);
+    kfree(port->name);
+    kfree(port);
+}
+
+static int virtio_console_add_port(struct virtio_console_dev *vcon_dev, u32 id)
+{
+    struct virtio_pci_dev *vpci_dev = vcon_dev->vpci_dev;
+    struct virtio_console_port *port;
+    char name[16];
+    int ret;
+
+    port = kzalloc(sizeof(*port), GFP_KERNEL);
+    if(!port)
+        return -ENOMEM;
+
+    port->vcon_dev = vcon_dev;
+    port->id = id;
+    kref_init(&port->kref);
+    port->in_vq = vpci_dev->vqs[VIRTIO_CONSOLE_RXQ_VQ(id)];
+    port->out_vq = vpci_dev->vqs[VIRTIO_CONSOLE_TXQ_VQ(id)];
+    port->devt = MKDEV(MAJOR(vcon_dev->devt), MINOR(vcon_dev->devt) + id);
+
+    /*without multiport there is no PORT_OPEN, the host end is always there */
+    port->host_connected = !vcon_dev->multiport;
+
+    INIT_LIST_HEAD(&port->rx_ready);
+    INIT_LIST_HEAD(&port->rx_empty);
+    spin_lock_init(&port->rx_lock);
+    mutex_init(&port->rx_mutex);
+    init_waitqueue_head(&port->rx_wait);
+
+    mutex_init(&port->tx_mutex);
+    INIT_WORK(&port->tx_work, virtio_console_tx_work);
+    init_waitqueue_head(&port->tx_wait);
+    port->tx_max_segs = min_t(unsigned int, VIRTIO_CONSOLE_TX_SEGS,
+                              virtqueue_get_vring_size(port->out_vq));
+
+    ret = virtio_console_fill_rx(port);
+    if(ret)
+        goto err_free_rx;
+
+    port->cdev = cdev_alloc();
+    if(!port->cdev)
+    {
+        ret = -ENOMEM;
+        goto err_free_rx;
+    }
+    port->cdev->ops = &virtio_console_fops;
+    port->cdev->owner = THIS_MODULE;
+
+    ret = cdev_add(port->cdev, port->devt, 1);
+    if(ret)
+        goto err_put_cdev;
+
+    port->dev = device_create_with_groups(virtio_console_class, &vpci_dev->pdev->dev, port->devt,
+                                          port, virtio_console_port_groups,
+                                          "vport%dp%u", vcon_dev->index, id);
+    if(IS_ERR(port->dev))
+    {
+        ret = PTR_ERR(port->dev);
+        goto err_del_cdev;
+    }
+
+    snprintf(name, sizeof(name), "port%u", id);
+    port->debugfs = debugfs_create_file(name, 0444, vcon_dev->debugfs_dir, port,
+                                        &virtio_console_port_stats_fops);
+
+    spin_lock_irq(&vcon_dev->ports_lock);
+    vcon_dev->ports[id] = port;
+    spin_unlock_irq(&vcon_dev->ports_lock);
+
+    /*pick up data the device completed before the callback could see the port */
+    virtio_console_in_callback(port->in_vq);
+
+    return 0;
+
+err_del_cdev:
+    cdev_del(port->cdev);
+    goto err_free_rx;
+err_put_cdev:
+    kobject_put(&port->cdev->kobj);
+err_free_rx:
+    while(virtqueue_detach_unused_buf(port->in_vq))
+        ;
+    virtio_console_free_rx(port);
+    kfree(port);
+    return ret;
+}
+
+static void virtio_console_remove_port(struct virtio_console_port *port)
+{
+    struct virtio_console_dev *vcon_dev = port->vcon_dev;
+    struct virtio_console_txbuf *txbuf;
+
+    spin_lock_irq(&vcon_dev->ports_lock);
+    if(vcon_dev->ports[port->id] != port)
+    {
+        spin_unlock_irq(&vcon_dev->ports_lock);
+        return;
+    }
+    vcon_dev->ports[port->id] = NULL;
+    spin_unlock_irq(&vcon_dev->ports_lock);
+
+    spin_lock_irq(&port->rx_lock);
+    port->dead = true;
+    spin_unlock_irq(&port->rx_lock);
+    wake_up_interruptible(&port->rx_wait);
+    wake_up_interruptible(&port->tx_wait);
+
+    debugfs_remove(port->debugfs);
+    device_destroy(virtio_console_class, port->devt);
+    cdev_del(port->cdev);
+    cancel_work_sync(&port->tx_work);
+
+    /*the device is done with this port, every buffer on its queues is ours again */
+    mutex_lock(&port->tx_mutex);
+    virtio_console_tx_reclaim(port);
+    while((txbuf = virtqueue_detach_unused_buf(port->out_vq)) != NULL)
+        virtio_console_free_txbuf(txbuf);
+    port->tx_inflight = NULL;
+    mutex_unlock(&port->tx_mutex);
+
+    spin_lock_irq(&port->rx_lock);
+    while(virtqueue_detach_unused_buf(port->in_vq))
+        ;
+    spin_unlock_irq(&port->rx_lock);
+
+    /*open files keep the port (and its pages) until they are closed */
+    virtio_console_put_port(port);
+}
+
+/*control receive path */
+
+static void virtio_console_handle_control(struct virtio_console_dev *vcon_dev, void *buf, unsigned int len)
+{
+    struct virtio_device *vdev = &vcon_dev->vpci_dev->virtio_dev;
+    struct virtio_console_control *cpkt = buf;
+    struct virtio_console_port *port;
+    u32 id;
+    u16 event, value;
+
+    if(len < sizeof(*cpkt))
+        return;
+
+    id = virtio32_to_cpu(vdev, cpkt->id);
+    event = virtio16_to_cpu(vdev, cpkt->event);
+    value = virtio16_to_cpu(vdev, cpkt->value);
+
+    if(event == VIRTIO_CONSOLE_DEVICE_ADD)
+    {
+        int ret = -EINVAL;
+
+        if(id >= vcon_dev->max_nr_ports)
+        {
+            dev_warn(&vcon_dev->vpci_dev->pdev->dev, "Host added port %u, max is %u\n",
+                     id, vcon_dev->max_nr_ports);
+        }
+        else if((port = virtio_console_get_port(vcon_dev, id)) != NULL)
+        {
+            /*duplicate add, the port is already usable */
+            virtio_console_put_port(port);
+            ret = 0;
+        }
+        else
+        {
+            ret = virtio_console_add_port(vcon_dev, id);
+        }
+
+        virtio_console_send_control(vcon_dev, id, VIRTIO_CONSOLE_PORT_READY, ret == 0);
+        return;
+    }
+
+    port = virtio_console_get_port(vcon_dev, id);
+    if(!port)
+    {
+        dev_dbg(&vcon_dev->vpci_dev->pdev->dev, "Control event %u for unknown port %u\n", event, id);
+        return;
+    }
+
+    switch(event)
+    {
+        case VIRTIO_CONSOLE_DEVICE_REMOVE:
+            virtio_console_remove_port(port);
+            break;
+
+        case VIRTIO_CONSOLE_PORT_OPEN:
+            WRITE_ONCE(port->host_connected, value);
+            wake_up_interruptible(&port->rx_wait);
+            wake_up_interruptible(&port->tx_wait);
+            break;
+
+        case VIRTIO_CONSOLE_PORT_NAME:
+            if(!port->name && len > sizeof(*cpkt))
+            {
+                port->name = kstrndup(buf + sizeof(*cpkt), len - sizeof(*cpkt), GFP_KERNEL);
+                if(port->name)
+                    kobject_uevent(&port->dev->kobj, KOBJ_CHANGE);
+            }
+            break;
+
+        case VIRTIO_CONSOLE_CONSOLE_PORT:
+            /*no hvc backend, console ports are plain char devices too */
+            dev_info(port->dev, "Port %u is a console port\n", id);
+            break;
+
+        default:
+            /*RESIZE and anything newer only matter to hvc */
+            break;
+    }
+
+    virtio_console_put_port(port);
+}
+
+static void virtio_console_control_work(struct work_struct *work)
+{
+    struct virtio_console_dev *vcon_dev = container_of(work, struct virtio_console_dev, control_work);
+    struct virtqueue *vq = vcon_dev->c_ivq;
+    struct scatterlist sg[1];
+    unsigned int len;
+    void *buf;
+
+    if(!READ_ONCE(vcon_dev->control_run))
+        return;
+
+    while((buf = virtqueue_get_buf(vq, &len)) != NULL)
+    {
+        virtio_console_handle_control(vcon_dev, buf, len);
+
+        sg_init_one(sg, buf, VIRTIO_CONSOLE_CTRL_BUF_LEN);
+        virtqueue_add_inbuf(vq, sg, 1, buf, GFP_KERNEL);
+    }
+
+    virtqueue_kick(vq);
+}
+
+void virtio_console_control_callback(struct virtqueue *vq)
+{
+    struct virtio_pci_dev *vpci_dev = vq->vdev->priv;
+    struct virtio_console_dev *vcon_dev = vpci_dev->drv_priv;
+
+    if(vcon_dev)
+        schedule_work(&vcon_dev->control_work);
+}
+
+static int virtio_console_fill_control(struct virtio_console_dev *vcon_dev)
+{
+    struct scatterlist sg[1];
+    unsigned int x;
+    int ret;
+
+    vcon_dev->c_nbufs = virtqueue_get_vring_size(vcon_dev->c_ivq);
+    vcon_dev->c_bufs = kcalloc(vcon_dev->c_nbufs, sizeof(*vcon_dev->c_bufs), GFP_KERNEL);
+    if(!vcon_dev->c_bufs)
+        return -ENOMEM;
+
+    for(x = 0; x < vcon_dev->c_nbufs; x++)
+    {
+        vcon_dev->c_bufs[x] = kmalloc(VIRTIO_CONSOLE_CTRL_BUF_LEN, GFP_KERNEL);
+        if(!vcon_dev->c_bufs[x])
+            return -ENOMEM;
+
+        sg_init_one(sg, vcon_dev->c_bufs[x], VIRTIO_CONSOLE_CTRL_BUF_LEN);
+        ret = virtqueue_add_inbuf(vcon_dev->c_ivq, sg, 1, vcon_dev->c_bufs[x], GFP_KERNEL);
+        if(ret)
+            return ret;
+    }
+
+    virtqueue_kick(vcon_dev->c_ivq);
+    return 0;
+}
+
+static void virtio_console_free_control(struct virtio_console_dev *vcon_dev)
+{
+    unsigned int x;
+
+    if(!vcon_dev->c_bufs)
+        return;
+
+    while(virtqueue_detach_unused_buf(vcon_dev->c_ivq))
+        ;
+    for(x = 0; x < vcon_dev->c_nbufs; x++)
+        kfree(vcon_dev->c_bufs[x]);
+    kfree(vcon_dev->c_bufs);
+    vcon_dev->c_bufs = NULL;
+}
+
+/*transport hooks */
+
+static u32 virtio_console_read_max_ports(struct virtio_pci_dev *vpci_dev)
+{
+    struct virtio_console_config __iomem *cfg = vpci_dev->device_cfg;
+    u32 max_nr_ports;
+
+    if(!(vpci_dev->guest_features & BIT_ULL(VIRTIO_CONSOLE_F_MULTIPORT)))
+        return 1;
+
+    max_nr_ports = le32_to_cpu(ioread32((void __iomem *)&cfg->max_nr_ports));
+    return clamp_t(u32, max_nr_ports, 1, VIRTIO_CONSOLE_MAX_PORTS);
+}
+
+/*number of virtqueues the console needs with the negotiated features */
+int virtio_console_num_queues(struct virtio_pci_dev *vpci_dev)
+{
+    u32 max_nr_ports = virtio_console_read_max_ports(vpci_dev);
+
+    if(!(vpci_dev->guest_features & BIT_ULL(VIRTIO_CONSOLE_F_MULTIPORT)))
+        return 2;
+    return (max_nr_ports + 1) * 2;
+}
+
+void virtio_console_vq_info(unsigned int index, vq_callback_t **callback, const char **name)
+{
+    switch(index)
+    {
+        case VIRTIO_CONSOLE_CTRL_RXQ_VQ:
+            *callback = virtio_console_control_callback;
+            *name = "control-i";
+            break;
+
+        case VIRTIO_CONSOLE_CTRL_TXQ_VQ:
+            /*control messages are sent synchronously, no completion IRQ */
+            *callback = NULL;
+            *name = "control-o";
+            break;
+
+        default:
+            *callback = index & 1 ? virtio_console_out_callback : virtio_console_in_callback;
+            *name = index & 1 ? "output" : "input";
+            break;
+    }
+}
+
+/*initialize virtio-console device */
+int virtio_console_init(struct virtio_pci_dev *vpci_dev)
+{
+    struct virtio_console_dev *vcon_dev;
+    int ret;
+
+    vcon_dev = kzalloc(sizeof(*vcon_dev), GFP_KERNEL);
+    if(!vcon_dev)
+        return -ENOMEM;
+
+    vcon_dev->vpci_dev = vpci_dev;
+    vcon_dev->multiport = vpci_dev->guest_features & BIT_ULL(VIRTIO_CONSOLE_F_MULTIPORT);
+    vcon_dev->max_nr_ports = virtio_console_read_max_ports(vpci_dev);
+    spin_lock_init(&vcon_dev->ports_lock);
+    mutex_init(&vcon_dev->c_ovq_lock);
+    INIT_WORK(&vcon_dev->control_work, virtio_console_control_work);
+
+    vcon_dev->index = ida_alloc_max(&virtio_console_ida, VIRTIO_CONSOLE_MAX_DEVS - 1, GFP_KERNEL);
+    if(vcon_dev->index < 0)
+    {
+        ret = vcon_dev->index;
+        goto err_free_dev;
+    }
+    vcon_dev->devt = MKDEV(MAJOR(virtio_console_devt),
+                           MINOR(virtio_console_devt) + vcon_dev->index * VIRTIO_CONSOLE_MAX_PORTS);
+
+    if(vcon_dev->multiport)
+    {
+        vcon_dev->c_ivq = vpci_dev->vqs[VIRTIO_CONSOLE_CTRL_RXQ_VQ];
+        vcon_dev->c_ovq = vpci_dev->vqs[VIRTIO_CONSOLE_CTRL_TXQ_VQ];
+
+        ret = virtio_console_fill_control(vcon_dev);
+        if(ret)
+        {
+            dev_err(&vpci_dev->pdev->dev, "Failed to fill control queue: %d\n", ret);
+            goto err_free_control;
+        }
+        vcon_dev->control_run = true;
+    }
+
+    vcon_dev->debugfs_dir = debugfs_create_dir("console", vpci_dev->debugfs_dir);
+
+    spin_lock_irq(&virtio_console_devs_lock);
+    virtio_console_devs[vcon_dev->index] = vcon_dev;
+    spin_unlock_irq(&virtio_console_devs_lock);
+
+    vpci_dev->drv_priv = vcon_dev;
+
+    dev_info(&vpci_dev->pdev->dev, "virtio-console initialized, %u port(s)%s\n",
+             vcon_dev->max_nr_ports, vcon_dev->multiport ? ", multiport" : "");
+
+    return 0;
+
+err_free_control:
+    virtio_console_free_control(vcon_dev);
+    ida_free(&virtio_console_ida, vcon_dev->index);
+err_free_dev:
+    kfree(vcon_dev);
+    return ret;
+}
+
+/*called once DRIVER_OK is set: ports only exist after this */
+void virtio_console_ready(struct virtio_console_dev *vcon_dev)
+{
+    int ret;
+
+    if(!vcon_dev->multiport)
+    {
+        ret = virtio_console_add_port(vcon_dev, 0);
+        if(ret)
+            dev_err(&vcon_dev->vpci_dev->pdev->dev, "Failed to add port 0: %d\n", ret);
+        return;
+    }
+
+    /*the host answers with DEVICE_ADD for each of its ports */
+    virtio_console_send_control(vcon_dev, VIRTIO_CONSOLE_BAD_ID, VIRTIO_CONSOLE_DEVICE_READY, 1);
+}
+
+/*cleanup virtio-console device */
+void virtio_console_exit(struct virtio_console_dev *vcon_dev)
+{
+    struct virtio_pci_dev *vpci_dev = vcon_dev->vpci_dev;
+    struct virtio_console_port *port;
+    u32 id;
+
+    spin_lock_irq(&virtio_console_devs_lock);
+    virtio_console_devs[vcon_dev->index] = NULL;
+    spin_unlock_irq(&virtio_console_devs_lock);
+
+    /*let a control message in progress finish while the device still
+     * answers, then reset before reclaiming buffers so the device can't
+     * still be using them. a callback in between only queues a no-op run */
+    WRITE_ONCE(vcon_dev->control_run, false);
+    cancel_work_sync(&vcon_dev->control_work);
+    virtio_pci_reset_device(vpci_dev);
+    cancel_work_sync(&vcon_dev->control_work);
+
+    for(id = 0; id < vcon_dev->max_nr_ports; id++)
+    {
+        port = virtio_console_get_port(vcon_dev, id);
+        if(!port)
+            continue;
+        virtio_console_remove_port(port);
+        virtio_console_put_port(port);
+    }
+
+    virtio_console_free_control(vcon_dev);
+    debugfs_remove_recursive(vcon_dev->debugfs_dir);
+
+    vpci_dev->drv_priv = NULL;
+    ida_free(&virtio_console_ida, vcon_dev->index);
+    kfree(vcon_dev);
+}
+
+/*module-wide char device region and class, shared by every console device */
+int virtio_console_register(void)
+{
+    int ret;
+
+    ret = alloc_chrdev_region(&virtio_console_devt, 0,
+                              VIRTIO_CONSOLE_MAX_DEVS * VIRTIO_CONSOLE_MAX_PORTS, "virtio-ports");
+    if(ret)
+        return ret;
+
+    virtio_console_class = class_create("virtio-ports");
+    if(IS_ERR(virtio_console_class))
+    {
+        unregister_chrdev_region(virtio_console_devt, VIRTIO_CONSOLE_MAX_DEVS * VIRTIO_CONSOLE_MAX_PORTS);
+        return PTR_ERR(virtio_console_class);
+    }
+
+    return 0;
+}
+
+void virtio_console_unregister(void)
+{
+    class_destroy(virtio_console_class);
+    unregister_chrdev_region(virtio_console_devt, VIRTIO_CONSOLE_MAX_DEVS * VIRTIO_CONSOLE_MAX_PORTS);
+}
@@ -0,0 +1,134 @@
+
+#ifndef VIRTIO_CONSOLE_DRIVER_H
+#define VIRTIO_CONSOLE_DRIVER_H
+
+#include <linux/virtio.h>
+#include <linux/virtio_console.h>  // provides struct virtio_console_config, control events, etc.
+#include <linux/cdev.h>
+#include <linux/kref.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/mutex.h>
+#include <linux/scatterlist.h>
+#include "virtio_pci.h"
+
+/* features the virtio-console driver is willing to accept */
+#define VIRTIO_CONSOLE_DRIVER_FEATURES  BIT_ULL(VIRTIO_CONSOLE_F_MULTIPORT)
+
+/* max_nr_ports is clamped to this, minors are handed out per device in
+ * blocks of VIRTIO_CONSOLE_MAX_PORTS */
+#define VIRTIO_CONSOLE_MAX_PORTS        32
+#define VIRTIO_CONSOLE_MAX_DEVS         16
+
+/* virtqueue layout: port0 in/out, control in/out, then in/out of port 1.. */
+#define VIRTIO_CONSOLE_RXQ_VQ(port)     ((port) ? (port) * 2 + 2 : 0)
+#define VIRTIO_CONSOLE_TXQ_VQ(port)     (VIRTIO_CONSOLE_RXQ_VQ(port) + 1)
+#define VIRTIO_CONSOLE_CTRL_RXQ_VQ      2
+#define VIRTIO_CONSOLE_CTRL_TXQ_VQ      3
+#define VIRTIO_CONSOLE_VQ_PORT(index)   ((index) < 2 ? 0 : (index) / 2 - 1)
+
+/* control messages carry the port name after the header */
+#define VIRTIO_CONSOLE_CTRL_BUF_LEN     (sizeof(struct virtio_console_control) + 256)
+
+/* how long to wait for the host to consume a control message */
+#define VIRTIO_CONSOLE_CTRL_TIMEOUT_MS  1000
+
+/* segments per TX chain, also clamped to the ring size */
+#define VIRTIO_CONSOLE_TX_SEGS          64
+
+/* one TX descriptor chain: write() packs data into driver pages, splice
+ * appends pipe pages as they are, the chain goes out with a single kick */
+struct virtio_console_txbuf {
+    unsigned int nsegs;
+    size_t len;
+    bool tail_owned;                   /* last segment is a driver page that can take more */
+    struct scatterlist sg[VIRTIO_CONSOLE_TX_SEGS];
+};
+
+/* page-sized RX buffer, also the in_vq token */
+struct virtio_console_rxbuf {
+    struct list_head list;
+    struct page *page;
+    unsigned int offset;               /* next unread byte */
+    unsigned int len;                  /* bytes written by the device */
+};
+
+struct virtio_console_port_stats {
+    u64 rx_bytes;
+    u64 tx_bytes;
+    u64 tx_chains;                     /* descriptor chains, one kick each */
+    u64 tx_segs;                       /* segments across those chains */
+    u64 splice_pages;                  /* pages moved to/from a pipe without a copy */
+};
+
+struct virtio_console_port {
+    struct virtio_console_dev *vcon_dev;
+    u32 id;
+    struct kref kref;                  /* ports[] and every open file */
+    struct virtqueue *in_vq;
+    struct virtqueue *out_vq;
+
+    dev_t devt;
+    struct cdev *cdev;
+    struct device *dev;
+    struct dentry *debugfs;
+    char *name;                        /* from PORT_NAME, NULL until the host sends it */
+    bool host_connected;
+    bool guest_connected;
+    bool dead;                         /* unplugged, file ops fail */
+
+    /* RX: every pool entry is either posted to in_vq, waiting on rx_ready
+     * or, if no page could be allocated for it, parked on rx_empty */
+    struct virtio_console_rxbuf *rx_pool;
+    unsigned int rx_pool_size;
+    struct list_head rx_ready;
+    struct list_head rx_empty;
+    spinlock_t rx_lock;                /* rx lists, in_vq, dead, guest_connected */
+    struct mutex rx_mutex;             /* serializes readers */
+    wait_queue_head_t rx_wait;
+
+    /* TX: one chain in flight, writers build the next one in tx_cur */
+    struct virtio_console_txbuf *tx_cur;
+    struct virtio_console_txbuf *tx_inflight;
+    unsigned int tx_max_segs;
+    struct mutex tx_mutex;             /* tx_cur, tx_inflight and out_vq */
+    struct work_struct tx_work;
+    wait_queue_head_t tx_wait;
+
+    struct virtio_console_port_stats stats;
+};
+
+struct virtio_console_dev {
+    struct virtio_pci_dev *vpci_dev;
+    int index;                         /* devices show up as vport<index>p<port> */
+    dev_t devt;                        /* first minor of this device's block */
+    u32 max_nr_ports;
+    bool multiport;
+
+    struct virtio_console_port *ports[VIRTIO_CONSOLE_MAX_PORTS];
+    spinlock_t ports_lock;             /* ports[], vq callbacks look ports up */
+
+    /* control queues, multiport only */
+    struct virtqueue *c_ivq;
+    struct virtqueue *c_ovq;
+    void **c_bufs;
+    unsigned int c_nbufs;
+    struct work_struct control_work;
+    bool control_run;
+    struct mutex c_ovq_lock;           /* serializes outgoing control messages */
+    struct virtio_console_control c_out;
+
+    struct dentry *debugfs_dir;
+};
+
+int virtio_console_register(void);
+void virtio_console_unregister(void);
+int virtio_console_num_queues(struct virtio_pci_dev *vpci_dev);
+void virtio_console_vq_info(unsigned int index, vq_callback_t **callback, const char **name);
+int virtio_console_init(struct virtio_pci_dev *vpci_dev);
+void virtio_console_ready(struct virtio_console_dev *vcon_dev);
+void virtio_console_exit(struct virtio_console_dev *vcon_dev);
+void virtio_console_in_callback(struct virtqueue *vq);
+void virtio_console_out_callback(struct virtqueue *vq);
+void virtio_console_control_callback(struct virtqueue *vq);
+#endif /* VIRTIO_CONSOLE_DRIVER_H */
@@ -6,181 +6,2747 @@
 #include <linux/virtio_pci.h> 
 #include <linux/scatterlist.h>
 #include <linux/skbuff.h>
+#include <linux/rtnetlink.h>
+#include <linux/ethtool.h>
+#include <linux/cpumask.h>
+#include <linux/cpuhotplug.h>
+#include <linux/irq.h>
+#include <linux/kthread.h>
+#include <linux/delay.h>
+#include <linux/sched.h>
+#include <linux/timex.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/log2.h>
+#include <linux/dma-mapping.h>
+#include <linux/prefetch.h>
+#include <net/busy_poll.h>
+#include <net/page_pool/helpers.h>
 #include "virtio_net.h"
 
+#define CREATE_TRACE_POINTS
+#include "virtio_net_trace.h"
+
+DEFINE_STATIC_KEY_FALSE(virtio_net_hist_key);
+DEFINE_STATIC_KEY_FALSE(virtio_net_cycles_key);
+
+static bool napi_threaded;
+module_param(napi_threaded, bool, 0444);
+MODULE_PARM_DESC(napi_threaded, "Run RX NAPI in per-queue kthreads pinned to the queue IRQ affinity");
+
+static bool low_mem;
+module_param(low_mem, bool, 0444);
+MODULE_PARM_DESC(low_mem, "Small RX footprint: capped, lazily filled rings on one shared page pool, trimmed when idle");
+
+static bool autoscale;
+module_param(autoscale, bool, 0444);
+MODULE_PARM_DESC(autoscale, "Grow and shrink the active queue pairs with the load instead of using one per CPU");
+
+static unsigned long poll_mask;
+module_param(poll_mask, ulong, 0444);
+MODULE_PARM_DESC(poll_mask, "Queue pairs (bit n = pair n) driven by a pinned polling kthread instead of interrupts");
+
+static unsigned int poll_spin_us = 1000;
+module_param(poll_spin_us, uint, 0644);
+MODULE_PARM_DESC(poll_spin_us, "Poll mode: keep spinning this long after the last completion before backing off");
+
+static unsigned int poll_sleep_us = 50;
+module_param(poll_sleep_us, uint, 0644);
+MODULE_PARM_DESC(poll_sleep_us, "Poll mode: sleep between polls once backed off, 0 never backs off");
+
+/*dynamic hotplug state, every device is an instance of it */
+static enum cpuhp_state virtio_net_online_state;
+
+/*pin a threaded NAPI kthread to the CPUs its queue's IRQ is affine to.
+ * no-op while NAPI runs in softirq context */
+static void virtio_net_pin_napi_thread(struct virtio_net_rq *rq, const struct cpumask *mask)
+{
+    if(!rq->napi.thread || !mask || cpumask_empty(mask))
+        return;
+
+    set_cpus_allowed_ptr(rq->napi.thread, mask);
+}
+
+/*queue pair memory follows the vector to its new node: the page pool in
+ * the next NAPI poll, the TX header arena from rehome_work */
+static void virtio_net_irq_affinity_notify(struct irq_affinity_notify *notify,
+                                           const cpumask_t *mask)
+{
+    struct virtio_net_rq *rq = container_of(notify, struct virtio_net_rq, affinity_notify);
+    struct virtio_net_sq *sq = &rq->vnet_dev->sq[rq->qp];
+    int node;
+
+    virtio_net_pin_napi_thread(rq, mask);
+
+    if(cpumask_empty(mask))
+        return;
+
+    /*TX completions are reaped by the pair's NAPI, the TX vector follows
+     * RX and the CPUs it moved to now transmit on this pair */
+    if(sq->irq >= 0)
+        irq_set_affinity(sq->irq, mask);
+    schedule_work(&rq->vnet_dev->xps_work);
+
+    node = cpu_to_node(cpumask_first(mask));
+    if(node == rq->node)
+        return;
+
+    WRITE_ONCE(rq->node, node);
+    WRITE_ONCE(rq->vnet_dev->sq[rq->qp].node, node);
+    mod_delayed_work(system_wq, &rq->rehome_work, 0);
+}
+
+static void virtio_net_irq_affinity_release(struct kref *ref)
+{
+    /*rq lifetime is tied to the net device, nothing to free */
+}
+
+/*queue pairs the device offers, capped at one per possible CPU: a pair
+ * no CPU maps to would only hold buffers */
+static u16 virtio_net_read_max_pairs(struct virtio_pci_dev *vpci_dev)
+{
+    struct virtio_net_config __iomem *net_cfg = vpci_dev->device_cfg;
+    u16 max_pairs;
+
+    /*MQ without a control queue to select the pairs is a device bug */
+    if(!(vpci_dev->guest_features & BIT_ULL(VIRTIO_NET_F_MQ)) ||
+       !(vpci_dev->guest_features & BIT_ULL(VIRTIO_NET_F_CTRL_VQ)))
+        return 1;
+
+    max_pairs = le16_to_cpu(ioread16(&net_cfg->max_virtqueue_pairs));
+    return clamp_t(u16, max_pairs, VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN,
+                   min_t(unsigned int, nr_cpu_ids, VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MAX));
+}
+
+static bool virtio_net_is_ctrl_vq(struct virtio_pci_dev *vpci_dev, unsigned int index)
+{
+    return (vpci_dev->guest_features & BIT_ULL(VIRTIO_NET_F_CTRL_VQ)) && index == vpci_dev->num_queues - 1;
+}
+
+/*number of virtqueues with the negotiated features: a pair per queue pair
+ * plus the control queue */
+int virtio_net_num_queues(struct virtio_pci_dev *vpci_dev)
+{
+    int num = virtio_net_read_max_pairs(vpci_dev) * 2;
+
+    if(vpci_dev->guest_features & BIT_ULL(VIRTIO_NET_F_CTRL_VQ))
+        num++;
+    return num;
+}
+
+static bool virtio_net_pair_polled(u16 qp)
+{
+    return qp < BITS_PER_LONG && test_bit(qp, &poll_mask);
+}
+
+void virtio_net_vq_info(struct virtio_pci_dev *vpci_dev, unsigned int index,
+                        vq_callback_t **callback, const char **name, bool *ctx)
+{
+    if(virtio_net_is_ctrl_vq(vpci_dev, index))
+    {
+        /*commands are sent synchronously, no completion IRQ */
+        *callback = NULL;
+        *name = "ctrl";
+        *ctx = false;
+        return;
+    }
+
+    /*RX buffers carry their length as the per-buffer context */
+    *callback = index & 1 ? virtio_net_tx_callback : virtio_net_rx_callback;
+    *name = index & 1 ? "tx" : "rx";
+    *ctx = !(index & 1);
+
+    /*no callback: the ring starts with notifications off and virtio-pci
+     * leaves the queue without a vector */
+    if(virtio_net_pair_polled(VIRTIO_NET_VQ_QP(index)))
+        *callback = NULL;
+}
+
+/*CPU a queue's vector starts out on: queue pairs are spread over CPUs
+ * close to the device. virtio-pci creates the ring on that CPU's node and
+ * the queue's buffers and arena are allocated there too. -1 for ctrl */
+int virtio_net_vq_cpu(struct virtio_pci_dev *vpci_dev, unsigned int index)
+{
+    if(virtio_net_is_ctrl_vq(vpci_dev, index))
+        return -1;
+
+    return cpumask_local_spread(VIRTIO_NET_VQ_QP(index), dev_to_node(&vpci_dev->pdev->dev));
+}
+
+/*pin both queue IRQs of a pair to the pair's CPU and start tracking
+ * affinity changes of the RX one made through /proc/irq */
+static void virtio_net_setup_affinity(struct virtio_net_dev *vnet_dev)
+{
+    int x;
+
+    for(x = 0; x < vnet_dev->max_queue_pairs; x++)
+    {
+        struct virtio_net_rq *rq = &vnet_dev->rq[x];
+        struct virtio_net_sq *sq = &vnet_dev->sq[x];
+        const struct cpumask *mask;
+
+        mask = cpumask_of(virtio_net_vq_cpu(vnet_dev->vpci_dev, VIRTIO_NET_RXQ_VQ(x)));
+
+        sq->irq = virtio_pci_vq_irq(vnet_dev->vpci_dev, VIRTIO_NET_TXQ_VQ(x));
+        if(sq->irq >= 0)
+            irq_set_affinity_and_hint(sq->irq, mask);
+
+        rq->irq = virtio_pci_vq_irq(vnet_dev->vpci_dev, VIRTIO_NET_RXQ_VQ(x));
+        if(rq->irq < 0)
+            continue;
+
+        irq_set_affinity_and_hint(rq->irq, mask);
+
+        rq->affinity_notify.notify = virtio_net_irq_affinity_notify;
+        rq->affinity_notify.release = virtio_net_irq_affinity_release;
+        if(irq_set_affinity_notifier(rq->irq, &rq->affinity_notify))
+            dev_warn(&vnet_dev->vpci_dev->pdev->dev,
+                     "Failed to track IRQ affinity for rx queue %d\n", x);
+    }
+}
+
+static void virtio_net_clear_affinity(struct virtio_net_dev *vnet_dev)
+{
+    int x;
+
+    for(x = 0; x < vnet_dev->max_queue_pairs; x++)
+    {
+        struct virtio_net_rq *rq = &vnet_dev->rq[x];
+        struct virtio_net_sq *sq = &vnet_dev->sq[x];
+
+        if(sq->irq >= 0)
+        {
+            irq_set_affinity_and_hint(sq->irq, NULL);
+            sq->irq = -1;
+        }
+
+        if(rq->irq < 0)
+            continue;
+
+        irq_set_affinity_notifier(rq->irq, NULL);
+        cancel_delayed_work_sync(&rq->rehome_work);
+        irq_set_affinity_and_hint(rq->irq, NULL);
+        rq->irq = -1;
+    }
+}
+
+/*pair a CPU transmits on: the one whose RX vector is affine to it. CPUs
+ * no vector points at are spread over the pairs on their own node, or over
+ * all pairs if none is local */
+static u16 virtio_net_cpu_pair(struct virtio_net_dev *vnet_dev, unsigned int cpu)
+{
+    u16 pairs = vnet_dev->curr_queue_pairs;
+    int node = cpu_to_node(cpu);
+    unsigned int local = 0;
+    u16 x;
+
+    for(x = 0; x < pairs; x++)
+    {
+        struct virtio_net_rq *rq = &vnet_dev->rq[x];
+
+        if(rq->polled && cpu == rq->poll_cpu)
+            return x;
+        if(rq->irq >= 0 && cpumask_test_cpu(cpu, irq_get_affinity_mask(rq->irq)))
+            return x;
+    }
+
+    for(x = 0; x < pairs; x++)
+        if(READ_ONCE(vnet_dev->rq[x].node) == node)
+            local++;
+    if(!local)
+        return cpu % pairs;
+
+    local = cpu % local;
+    for(x = 0; x < pairs; x++)
+        if(READ_ONCE(vnet_dev->rq[x].node) == node && !local--)
+            break;
+    return x;
+}
+
+/*install the CPU -> TX queue map: every online CPU transmits on exactly
+ * one pair and completes on the same CPU through that pair's NAPI.
+ * Called with RTNL held */
+static void virtio_net_set_xps(struct virtio_net_dev *vnet_dev)
+{
+    cpumask_var_t mask;
+    unsigned int cpu;
+    int ret;
+    u16 x;
+
+    if(!zalloc_cpumask_var(&mask, GFP_KERNEL))
+        return;
+
+    for_each_online_cpu(cpu)
+        WRITE_ONCE(vnet_dev->cpu_pair[cpu], virtio_net_cpu_pair(vnet_dev, cpu));
+
+    for(x = 0; x < vnet_dev->curr_queue_pairs; x++)
+    {
+        cpumask_clear(mask);
+        for_each_online_cpu(cpu)
+            if(vnet_dev->cpu_pair[cpu] == x)
+                cpumask_set_cpu(cpu, mask);
+
+        ret = netif_set_xps_queue(vnet_dev->netdev, mask, x);
+        if(ret)
+        {
+            dev_warn(&vnet_dev->vpci_dev->pdev->dev, "Failed to set XPS map of tx queue %u: %d\n", x, ret);
+            break;
+        }
+    }
+
+    free_cpumask_var(mask);
+}
+
+static void virtio_net_xps_work(struct work_struct *work)
+{
+    struct virtio_net_dev *vnet_dev = container_of(work, struct virtio_net_dev, xps_work);
+
+    rtnl_lock();
+    virtio_net_set_xps(vnet_dev);
+    rtnl_unlock();
+}
+
+/*CPU came up or is about to go down; the map is rebuilt from the online
+ * mask, a departing CPU left in it for a moment never transmits */
+static int virtio_net_cpu_changed(unsigned int cpu, struct hlist_node *node)
+{
+    struct virtio_net_dev *vnet_dev = hlist_entry_safe(node, struct virtio_net_dev, cpuhp_node);
+
+    schedule_work(&vnet_dev->xps_work);
+    return 0;
+}
+
+int virtio_net_register(void)
+{
+    int ret;
+
+    ret = cpuhp_setup_state_multi(CPUHP_AP_ONLINE_DYN, "net/virtio-drivers:online",
+                                  virtio_net_cpu_changed, virtio_net_cpu_changed);
+    if(ret < 0)
+        return ret;
+
+    virtio_net_online_state = ret;
+    return 0;
+}
+
+void virtio_net_unregister(void)
+{
+    cpuhp_remove_multi_state(virtio_net_online_state);
+}
+
+/*tell the device how many pairs to spread RX over and expose as many TX
+ * queues; the XPS map follows. Called with RTNL held */
+static int virtio_net_set_queues(struct virtio_net_dev *vnet_dev, u16 pairs)
+{
+    struct net_device *netdev = vnet_dev->netdev;
+    struct scatterlist sg;
+    int ret;
+
+    ASSERT_RTNL();
+
+    /*max_queue_pairs is only above 1 with MQ and a control queue */
+    if(vnet_dev->max_queue_pairs > 1)
+    {
+        vnet_dev->ctrl->mq.virtqueue_pairs = cpu_to_virtio16(&vnet_dev->vpci_dev->virtio_dev, pairs);
+        sg_init_one(&sg, &vnet_dev->ctrl->mq, sizeof(vnet_dev->ctrl->mq));
+
+        if(!virtio_net_send_command(vnet_dev, VIRTIO_NET_CTRL_MQ,
+                                    VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET, &sg))
+        {
+            dev_warn(&vnet_dev->vpci_dev->pdev->dev, "Failed to set %u queue pairs\n", pairs);
+            return -EINVAL;
+        }
+    }
+
+    vnet_dev->curr_queue_pairs = pairs;
+
+    ret = netif_set_real_num_tx_queues(netdev, pairs);
+    if(!ret)
+        ret = netif_set_real_num_rx_queues(netdev, pairs);
+    if(ret)
+        return ret;
+
+    virtio_net_set_xps(vnet_dev);
+    return 0;
+}
+
+/*locally generated traffic follows the XPS map, which also keeps a
+ * socket on its queue while it has packets in flight. Without XPS in the
+ * kernel the same per-CPU map is applied here directly */
+static u16 virtio_net_select_queue(struct net_device *dev, struct sk_buff *skb,
+                                   struct net_device *sb_dev)
+{
+    struct virtio_net_dev *vnet_dev = netdev_priv(dev);
+    u16 qp;
+
+    if(IS_ENABLED(CONFIG_XPS))
+        return netdev_pick_tx(dev, skb, sb_dev);
+
+    qp = READ_ONCE(vnet_dev->cpu_pair[raw_smp_processor_id()]);
+    return qp < dev->real_num_tx_queues ? qp : 0;
+}
+
+static void virtio_net_hist_add(struct virtio_net_hist *hist, u64 delta_ns)
+{
+    unsigned int bucket = delta_ns ? ilog2(delta_ns) : 0;
+
+    hist->buckets[min_t(unsigned int, bucket, VIRTIO_NET_HIST_BUCKETS - 1)]++;
+}
+
+/*kick the device if the ring wants it, returns true if a doorbell was written */
+static bool virtio_net_kick(struct virtio_net_dev *vnet_dev, struct virtqueue *vq)
+{
+    if(!virtqueue_kick_prepare(vq))
+        return false;
+
+    trace_virtio_net_kick(vnet_dev->netdev, vq->index);
+    return virtqueue_notify(vq);
+}
+
+/*queues are enabled once at setup and stay enabled until a device or
+ * queue reset (the spec does not allow writing 0 to queue_enable), so
+ * open/stop only start and stop NAPI and the TX queues and never go near
+ * common_cfg */
 int virtio_net_open(struct net_device *dev)
 {
     /*get private data attahced to net_device */
     struct virtio_net_dev *vnet_dev = netdev_priv(dev);
-    struct virtio_pci_dev *vpci_dev = vnet_dev->vpci_dev;
 
-    /*select queue and enable */
-    /*RX queue*/
-    iowrite16(VIRTIO_NET_QUEUE_RX, &vpci_dev->common_cfg->queue_select);
-    iowrite16(VIRTIO_VIRTQUEUE_ENABLE, &vpci_dev->common_cfg->queue_enable);
-   
-    /*TX queue*/
-    iowrite16(VIRTIO_NET_QUEUE_TX, &vpci_dev->common_cfg->queue_select);
-    iowrite16(VIRTIO_VIRTQUEUE_ENABLE, &vpci_dev->common_cfg->queue_enable);
+    for(int x = 0; x < vnet_dev->max_queue_pairs; x++)
+    {
+        napi_enable(&vnet_dev->rq[x].napi);
+        /*threaded mode may have been switched on through sysfs since the last open */
+        if(vnet_dev->rq[x].irq >= 0)
+            virtio_net_pin_napi_thread(&vnet_dev->rq[x], irq_get_affinity_mask(vnet_dev->rq[x].irq));
+        /*pick up anything that arrived while we were down, polled pairs have
+         * no interrupt to account so schedule NAPI directly and wake the
+         * poll thread */
+        if(vnet_dev->rq[x].polled)
+        {
+            napi_schedule(&vnet_dev->rq[x].napi);
+            wake_up(&vnet_dev->rq[x].poll_wq);
+        }
+        else
+        {
+            virtio_net_rx_callback(vnet_dev->rq[x].vq);
+        }
+    }
+
+    netif_tx_start_all_queues(dev);
+    return 0;
+}
+
+int virtio_net_stop(struct net_device *dev)
+{
+    /*get private data attahced to net_device */
+    struct virtio_net_dev *vnet_dev = netdev_priv(dev);
+
+    netif_tx_stop_all_queues(dev);
+
+    /*before napi_disable(), refill_work disables NAPI itself */
+    cancel_delayed_work_sync(&vnet_dev->refill_work);
+
+    for(int x = 0; x < vnet_dev->max_queue_pairs; x++)
+        napi_disable(&vnet_dev->rq[x].napi);
+
+    return 0;
+}
+
+/*TX header arena */
+
+/*one cacheline-aligned header and mapping record per ring entry. Every
+ * packet takes a slot, the header in it is only used when the header
+ * cannot be pushed in front of the data. When the ring uses the DMA API
+ * the arena is coherent memory and the queue switches to premapped mode
+ * (there is no way back), so only payload is mapped per packet */
+static int virtio_net_tx_arena_init(struct virtio_net_sq *sq)
+{
+    struct device *dma_dev = virtqueue_dma_dev(sq->vq);
+    u16 x;
+
+    /*sized for the largest ring, ethtool -G may grow it later */
+    sq->nr_slots = sq->vq->num_max;
+    sq->free_slots = kcalloc_node(sq->nr_slots, sizeof(*sq->free_slots), GFP_KERNEL, sq->node);
+    if(!sq->free_slots)
+        return -ENOMEM;
+
+    if(dma_dev)
+    {
+        sq->hdr_arena = dma_alloc_coherent(dma_dev, sq->nr_slots * sizeof(*sq->hdr_arena),
+                                           &sq->hdr_arena_dma, GFP_KERNEL);
+        sq->tx_map = kcalloc_node(sq->nr_slots, sizeof(*sq->tx_map), GFP_KERNEL, sq->node);
+        if(sq->hdr_arena && sq->tx_map && !virtqueue_set_dma_premapped(sq->vq))
+        {
+            sq->dma_dev = dma_dev;
+            sq->premapped = true;
+        }
+        else
+        {
+            /*refused: the ring keeps mapping every buffer itself */
+            if(sq->hdr_arena)
+                dma_free_coherent(dma_dev, sq->nr_slots * sizeof(*sq->hdr_arena),
+                                  sq->hdr_arena, sq->hdr_arena_dma);
+            kfree(sq->tx_map);
+            sq->hdr_arena = NULL;
+            sq->tx_map = NULL;
+        }
+    }
+
+    /*without the DMA API the ring uses physical addresses, plain memory will do */
+    if(!sq->hdr_arena)
+    {
+        sq->hdr_arena = kcalloc_node(sq->nr_slots, sizeof(*sq->hdr_arena), GFP_KERNEL, sq->node);
+        if(!sq->hdr_arena)
+        {
+            kfree(sq->free_slots);
+            sq->free_slots = NULL;
+            return -ENOMEM;
+        }
+    }
+
+    for(x = 0; x < sq->nr_slots; x++)
+        sq->free_slots[x] = sq->nr_slots - 1 - x;
+    sq->nr_free_slots = sq->nr_slots;
+    return 0;
+}
+
+static void virtio_net_tx_arena_free(struct virtio_net_sq *sq)
+{
+    if(!sq->hdr_arena)
+        return;
+
+    if(sq->premapped)
+        dma_free_coherent(sq->dma_dev, sq->nr_slots * sizeof(*sq->hdr_arena),
+                          sq->hdr_arena, sq->hdr_arena_dma);
+    else
+        kfree(sq->hdr_arena);
+    kfree(sq->tx_map);
+    kfree(sq->free_slots);
+    sq->hdr_arena = NULL;
+    sq->tx_map = NULL;
+    sq->free_slots = NULL;
+    sq->premapped = false;
+}
+
+/*premapped queues: unmap the linear part and the first nr_frags fragments */
+static void virtio_net_tx_unmap(struct virtio_net_sq *sq, struct sk_buff *skb, int nr_frags)
+{
+    struct virtio_net_tx_map *map = &sq->tx_map[VIRTIO_NET_SKB_CB(skb)->slot];
+    int x;
+
+    if(skb_headlen(skb))
+        dma_unmap_single(sq->dma_dev, map->addr[0], skb_headlen(skb), DMA_TO_DEVICE);
+    for(x = 0; x < nr_frags; x++)
+        dma_unmap_page(sq->dma_dev, map->addr[x + 1],
+                       skb_frag_size(&skb_shinfo(skb)->frags[x]), DMA_TO_DEVICE);
+}
+
+/*give back everything virtio_net_tx_sg() took for skb */
+static void virtio_net_tx_release(struct virtio_net_sq *sq, struct sk_buff *skb)
+{
+    if(sq->premapped)
+        virtio_net_tx_unmap(sq, skb, skb_shinfo(skb)->nr_frags);
+    sq->free_slots[sq->nr_free_slots++] = VIRTIO_NET_SKB_CB(skb)->slot;
+}
+
+/*ANY_LAYOUT: the header may share the first descriptor with the data if
+ * the headroom in front of it is ours and suitably aligned */
+static bool virtio_net_tx_can_push(struct virtio_net_sq *sq, struct sk_buff *skb)
+{
+    return virtio_net_has_feature(sq->vnet_dev, VIRTIO_F_ANY_LAYOUT) &&
+           skb_headroom(skb) >= VIRTIO_NET_HDR_LEN &&
+           !skb_header_cloned(skb) &&
+           IS_ALIGNED((unsigned long)skb->data - VIRTIO_NET_HDR_LEN,
+                      __alignof__(struct virtio_net_hdr_mrg_rxbuf));
+}
+
+/*premapped queues: map the linear part and fragments into sg */
+static int virtio_net_tx_map(struct virtio_net_sq *sq, struct sk_buff *skb, struct scatterlist *sg)
+{
+    struct virtio_net_tx_map *map = &sq->tx_map[VIRTIO_NET_SKB_CB(skb)->slot];
+    int nr_frags = skb_shinfo(skb)->nr_frags;
+    struct scatterlist *start = sg;
+    dma_addr_t addr;
+    int x;
+
+    if(skb_headlen(skb))
+    {
+        addr = dma_map_single(sq->dma_dev, skb->data, skb_headlen(skb), DMA_TO_DEVICE);
+        if(dma_mapping_error(sq->dma_dev, addr))
+            return -ENOMEM;
+        map->addr[0] = addr;
+        sg->dma_address = addr;
+        sg->length = skb_headlen(skb);
+        sg++;
+    }
+
+    for(x = 0; x < nr_frags; x++)
+    {
+        skb_frag_t *frag = &skb_shinfo(skb)->frags[x];
+
+        addr = skb_frag_dma_map(sq->dma_dev, frag, 0, skb_frag_size(frag), DMA_TO_DEVICE);
+        if(dma_mapping_error(sq->dma_dev, addr))
+        {
+            virtio_net_tx_unmap(sq, skb, x);
+            return -ENOMEM;
+        }
+        map->addr[x + 1] = addr;
+        sg->dma_address = addr;
+        sg->length = skb_frag_size(frag);
+        sg++;
+    }
+
+    /*sq->sg is initialized for a separate header plus every fragment.
+     * virtqueue_add_outbuf follows the list to the end marker rather than
+     * stopping at the count, so without it a pushed header or an empty
+     * linear part would leave a zeroed entry to be queued as a descriptor */
+    if(sg != start)
+        sg_mark_end(sg - 1);
+
+    return sg - start;
+}
+
+/*build sq->sg for skb, virtio_net_hdr first; returns the sg count */
+static int virtio_net_tx_sg(struct virtio_net_sq *sq, struct sk_buff *skb)
+{
+    struct virtio_net_skb_cb *cb = VIRTIO_NET_SKB_CB(skb);
+    struct virtio_net_hdr_mrg_rxbuf *hdr;
+    struct scatterlist *sg = sq->sg;
+    int num_sg;
+
+    if(unlikely(!sq->nr_free_slots))
+        return -ENOSPC;
+
+    cb->slot = sq->free_slots[--sq->nr_free_slots];
+    sg_init_table(sq->sg, skb_shinfo(skb)->nr_frags + 2);
+
+    if(virtio_net_tx_can_push(sq, skb))
+    {
+        /*header and linear data go out in one descriptor */
+        hdr = skb_push(skb, VIRTIO_NET_HDR_LEN);
+    }
+    else
+    {
+        hdr = &sq->hdr_arena[cb->slot].hdr;
+        if(sq->premapped)
+        {
+            sg->dma_address = sq->hdr_arena_dma + cb->slot * sizeof(*sq->hdr_arena);
+            sg->length = VIRTIO_NET_HDR_LEN;
+        }
+        else
+        {
+            sg_set_buf(sg, hdr, VIRTIO_NET_HDR_LEN);
+        }
+        sg++;
+    }
+
+    /*no offloads negotiated, every packet carries a zeroed header */
+    memset(hdr, 0, VIRTIO_NET_HDR_LEN);
+
+    if(sq->premapped)
+        num_sg = virtio_net_tx_map(sq, skb, sg);
+    else
+        num_sg = skb_to_sgvec(skb, sg, 0, skb->len);
+
+    if(num_sg < 0)
+    {
+        sq->free_slots[sq->nr_free_slots++] = cb->slot;
+        return num_sg;
+    }
+    return num_sg + (sg - sq->sg);
+}
+
+/*reclaim skbs the device has finished sending, at most budget of them.
+ * budget 0 means no limit and not in NAPI, like napi_consume_skb(): from
+ * NAPI the skbs go to the per-CPU skb cache, which frees them in bulk */
+static unsigned int virtio_net_free_old_xmit(struct virtio_net_sq *sq, int budget)
+{
+    struct virtio_net_dev *vnet_dev = sq->vnet_dev;
+    bool hist = virtio_net_hist_on(vnet_dev);
+    u64 now = hist ? ktime_get_ns() : 0;
+    unsigned int packets = 0, bytes = 0;
+    unsigned int count, limit, x;
+    struct sk_buff *skb;
+    unsigned int len;
+
+    /*collect a batch of completions first, so the skbs are being fetched
+     * while the ones before them are released */
+    do {
+        limit = budget ? min_t(unsigned int, VIRTIO_NET_TX_BATCH, budget - packets) : VIRTIO_NET_TX_BATCH;
 
-    /*enable CTRL queue (if it exists)*/
-    if(vpci_dev->vqs[VIRTIO_NET_QUEUE_CTRL])
+        for(count = 0; count < limit; count++)
+        {
+            skb = virtqueue_get_buf(sq->vq, &len);
+            if(!skb)
+                break;
+            prefetchw(skb);
+            sq->reclaim[count] = skb;
+        }
+
+        for(x = 0; x < count; x++)
+        {
+            skb = sq->reclaim[x];
+            bytes += skb->len;
+
+            if(hist && VIRTIO_NET_SKB_CB(skb)->enqueue_ns)
+                virtio_net_hist_add(&sq->completion, now - VIRTIO_NET_SKB_CB(skb)->enqueue_ns);
+
+            virtio_net_tx_release(sq, skb);
+            napi_consume_skb(skb, budget);
+        }
+        packets += count;
+    } while(count == limit && (!budget || packets < budget));
+
+    if(packets)
+        trace_virtio_net_tx_complete(vnet_dev->netdev, sq->qp, packets, bytes);
+    return packets;
+}
+
+/*TX completions from the pair's NAPI poll. xmit holding the queue lock
+ * reclaims on its own and re-arms the callback itself, so just skip.
+ * Returns the number reclaimed, budget if more are waiting */
+static int virtio_net_poll_tx(struct virtio_net_sq *sq, int budget)
+{
+    struct netdev_queue *txq = netdev_get_tx_queue(sq->vnet_dev->netdev, sq->qp);
+    unsigned int done;
+
+    if(!__netif_tx_trylock(txq))
+        return 0;
+
+    virtqueue_disable_cb(sq->vq);
+    done = virtio_net_free_old_xmit(sq, budget);
+
+    if(netif_tx_queue_stopped(txq) && sq->vq->num_free >= MAX_SKB_FRAGS + 2)
+        netif_tx_wake_queue(txq);
+
+    /*callbacks back on, unless completions arrived in the meantime */
+    if(done < budget && !sq->polled && unlikely(!virtqueue_enable_cb_delayed(sq->vq)))
     {
-        iowrite16(VIRTIO_NET_QUEUE_CTRL, &vpci_dev->common_cfg->queue_select);
-        iowrite16(VIRTIO_VIRTQUEUE_ENABLE, &vpci_dev->common_cfg->queue_enable);
+        virtqueue_disable_cb(sq->vq);
+        done = budget;
     }
-    netif_start_queue(dev);
+    __netif_tx_unlock(txq);
+
+    return done;
+}
+
+/*TX virtqueue callback (hard IRQ): completions are reclaimed by the NAPI
+ * instance of the queue pair */
+void virtio_net_tx_callback(struct virtqueue *vq)
+{
+    struct virtio_pci_dev *vpci_dev = vq->vdev->priv;
+    struct virtio_net_dev *vnet_dev = vpci_dev->drv_priv;
+
+    if(!vnet_dev)
+        return;
+
+    trace_virtio_net_interrupt(vnet_dev->netdev, vq->index);
+
+    virtqueue_disable_cb(vq);
+    napi_schedule(&vnet_dev->rq[VIRTIO_NET_VQ_QP(vq->index)].napi);
+}
+
+/*end of an xmit_more batch: notify the device and re-arm the TX callback
+ * (xmit keeps it off while the batch is built). Re-arming does not depend
+ * on the kick, a doorbell suppressed because the device is still busy
+ * must not leave the batch unreclaimed. Returns whether it kicked */
+static bool virtio_net_xmit_flush(struct virtio_net_sq *sq, struct netdev_queue *txq)
+{
+    struct virtio_net_dev *vnet_dev = sq->vnet_dev;
+    bool kicked;
+
+    if(netdev_xmit_more() && !netif_xmit_stopped(txq))
+        return false;
+
+    kicked = virtio_net_kick(vnet_dev, sq->vq);
+
+    /*NAPI reclaims what is left once the device is done with this batch */
+    if(!sq->polled && unlikely(!virtqueue_enable_cb_delayed(sq->vq)))
+    {
+        virtqueue_disable_cb(sq->vq);
+        napi_schedule(&vnet_dev->rq[sq->qp].napi);
+    }
+    return kicked;
+}
+
+netdev_tx_t virtio_net_xmit(struct sk_buff *skb, struct net_device *dev)
+{
+    struct virtio_net_dev *vnet_dev = netdev_priv(dev);
+    u16 qnum = skb_get_queue_mapping(skb);
+    struct virtio_net_sq *sq = &vnet_dev->sq[qnum];
+    struct virtqueue *vq = sq->vq; /*transimit virtqueue */
+    struct netdev_queue *txq = netdev_get_tx_queue(dev, qnum);
+    struct virtio_net_skb_cb *cb = VIRTIO_NET_SKB_CB(skb);
+    unsigned int len = skb->len;
+    cycles_t start = virtio_net_cycles_start();
+    bool kicked = false;
+    int num_sg;
+    int ret;
+
+    /*free up completed buffers before adding new ones */
+    virtqueue_disable_cb(vq);
+    virtio_net_free_old_xmit(sq, 0);
+
+    cb->enqueue_ns = virtio_net_hist_on(vnet_dev) ? ktime_get_ns() : 0;
+
+    num_sg = virtio_net_tx_sg(sq, skb);
+    if(num_sg < 0)
+        goto drop;
+
+    /*add buffer to TX queue */
+    ret = virtqueue_add_outbuf(vq, sq->sg, num_sg, skb, GFP_ATOMIC);
+    if(ret)
+    {
+        virtio_net_tx_release(sq, skb);
+        goto drop;
+    }
+
+    trace_virtio_net_xmit_enqueue(dev, qnum, len, vq->num_free);
+
+    /*stop before the ring is too full for a worst-case skb, the TX
+     * callback wakes us once the device has consumed some buffers */
+    if(vq->num_free < MAX_SKB_FRAGS + 2)
+    {
+        netif_stop_subqueue(dev, qnum);
+        if(unlikely(!virtqueue_enable_cb_delayed(vq)))
+        {
+            virtio_net_free_old_xmit(sq, 0);
+            if(vq->num_free >= MAX_SKB_FRAGS + 2)
+            {
+                netif_start_subqueue(dev, qnum);
+                virtqueue_disable_cb(vq);
+            }
+        }
+    }
+
+    kicked = virtio_net_xmit_flush(sq, txq);
+
+    u64_stats_update_begin(&sq->stats.syncp);
+    u64_stats_inc(&sq->stats.packets);
+    u64_stats_add(&sq->stats.bytes, len);
+    if(kicked)
+        u64_stats_inc(&sq->stats.kicks);
+    if(start)
+        u64_stats_add(&sq->stats.cycles, get_cycles() - start);
+    u64_stats_update_end(&sq->stats.syncp);
+
+    return NETDEV_TX_OK; 
+
+drop:
+    /*skb is consumed here, the stack must not requeue it. Earlier packets
+     * of the batch still need their kick */
+    dev_kfree_skb_any(skb);
+    kicked = virtio_net_xmit_flush(sq, txq);
+    u64_stats_update_begin(&sq->stats.syncp);
+    u64_stats_inc(&sq->stats.drops);
+    if(kicked)
+        u64_stats_inc(&sq->stats.kicks);
+    if(start)
+        u64_stats_add(&sq->stats.cycles, get_cycles() - start);
+    u64_stats_update_end(&sq->stats.syncp);
+    return NETDEV_TX_OK;
+}
+
+static void virtio_net_free_tx(struct virtio_net_sq *sq)
+{
+    struct sk_buff *skb;
+
+    while((skb = virtqueue_detach_unused_buf(sq->vq)) != NULL)
+    {
+        virtio_net_tx_release(sq, skb);
+        dev_kfree_skb(skb);
+    }
+}
+
+/*move the TX header arena of sq to sq->node. Slots are handed out to
+ * in-flight packets, so the swap only happens once the ring has drained;
+ * returns -EBUSY until then. A coherent arena stays where the DMA API put it */
+static int virtio_net_tx_rehome(struct virtio_net_sq *sq)
+{
+    struct netdev_queue *txq = netdev_get_tx_queue(sq->vnet_dev->netdev, sq->qp);
+    int node = READ_ONCE(sq->node);
+    struct virtio_net_tx_hdr *arena;
+    u16 *free_slots;
+    bool swapped = false;
+    u16 x;
+
+    if(sq->premapped || (page_to_nid(virt_to_page(sq->hdr_arena)) == node))
+        return 0;
+
+    arena = kcalloc_node(sq->nr_slots, sizeof(*arena), GFP_KERNEL, node);
+    free_slots = kcalloc_node(sq->nr_slots, sizeof(*free_slots), GFP_KERNEL, node);
+    if(!arena || !free_slots)
+    {
+        kfree(arena);
+        kfree(free_slots);
+        return -ENOMEM;
+    }
+
+    __netif_tx_lock_bh(txq);
+    virtio_net_free_old_xmit(sq, 0);
+    if(sq->nr_free_slots == sq->nr_slots)
+    {
+        for(x = 0; x < sq->nr_slots; x++)
+            free_slots[x] = sq->nr_slots - 1 - x;
+        swap(sq->hdr_arena, arena);
+        swap(sq->free_slots, free_slots);
+        swapped = true;
+    }
+    __netif_tx_unlock_bh(txq);
+
+    /*the old arrays if swapped, the unused new ones otherwise */
+    kfree(arena);
+    kfree(free_slots);
+    return swapped ? 0 : -EBUSY;
+}
+
+static void virtio_net_rehome_work(struct work_struct *work)
+{
+    struct virtio_net_rq *rq = container_of(work, struct virtio_net_rq, rehome_work.work);
+
+    if(virtio_net_tx_rehome(&rq->vnet_dev->sq[rq->qp]))
+        schedule_delayed_work(&rq->rehome_work, msecs_to_jiffies(100));
+}
+
+/*pick the RX buffer layout from the negotiated features and the largest
+ * MTU the device may send us; fixed for the lifetime of the device */
+static enum virtio_net_rx_mode virtio_net_pick_rx_mode(struct virtio_net_dev *vnet_dev)
+{
+    if(virtio_net_has_feature(vnet_dev, VIRTIO_NET_F_MRG_RXBUF))
+        return VIRTIO_NET_RX_MERGEABLE;
+
+    if(virtio_net_has_feature(vnet_dev, VIRTIO_NET_F_GUEST_TSO4) ||
+       virtio_net_has_feature(vnet_dev, VIRTIO_NET_F_GUEST_TSO6) ||
+       VIRTIO_NET_RX_BUF_LEN(vnet_dev->netdev->max_mtu) > VIRTIO_NET_RX_MAX_BUF_LEN)
+        return VIRTIO_NET_RX_BIG;
+
+    return VIRTIO_NET_RX_SMALL;
+}
+
+/*RX buffer size for an MTU. Mergeable buffers stay within a page and the
+ * device spreads larger frames over several; with GUEST_TSO a big mode
+ * chain has to hold a whole GSO frame whatever the MTU */
+static unsigned int virtio_net_rx_buf_len(struct virtio_net_dev *vnet_dev, unsigned int mtu)
+{
+    /*the MTU only limits what this side sends, the peer may still deliver
+     * full Ethernet frames after it is lowered */
+    mtu = max_t(unsigned int, mtu, ETH_DATA_LEN);
+
+    switch(vnet_dev->rx_mode)
+    {
+        case VIRTIO_NET_RX_MERGEABLE:
+            return min_t(unsigned int, VIRTIO_NET_RX_BUF_LEN(mtu), VIRTIO_NET_RX_MAX_BUF_LEN);
+        case VIRTIO_NET_RX_BIG:
+            if(virtio_net_has_feature(vnet_dev, VIRTIO_NET_F_GUEST_TSO4) ||
+               virtio_net_has_feature(vnet_dev, VIRTIO_NET_F_GUEST_TSO6))
+                return VIRTIO_NET_RX_BUF_LEN(VIRTIO_NET_MAX_MTU);
+            return VIRTIO_NET_RX_BUF_LEN(mtu);
+        default:
+            return VIRTIO_NET_RX_BUF_LEN(mtu);
+    }
+}
+
+/*resize RX buffers without a reset: buffers posted from now on use the
+ * new size, the ones already in the ring carry their own length as ctx and
+ * are replaced with new-sized ones as the device uses them */
+static int virtio_net_change_mtu(struct net_device *dev, int new_mtu)
+{
+    struct virtio_net_dev *vnet_dev = netdev_priv(dev);
+    int x;
+
+    /*dev_set_mtu updates dev->mtu once this returns */
+    for(x = 0; x < vnet_dev->max_queue_pairs; x++)
+        WRITE_ONCE(vnet_dev->rq[x].buf_len, virtio_net_rx_buf_len(vnet_dev, new_mtu));
+    return 0;
+}
+
+/*recieve packet */
+
+/*DMA address of a small/mergeable buffer's header, only valid for premapped queues */
+static dma_addr_t virtio_net_rx_dma(void *buf)
+{
+    struct page *page = virt_to_head_page(buf);
+
+    return page_pool_get_dma_addr(page) + (buf - page_address(page)) + VIRTIO_NET_RX_HEADROOM;
+}
+
+/*make what the device wrote to a small/mergeable buffer visible to the CPU */
+static void virtio_net_rx_sync(struct virtio_net_rq *rq, void *buf, unsigned int len)
+{
+    if(rq->premapped)
+        virtqueue_dma_sync_single_range_for_cpu(rq->vq, virtio_net_rx_dma(buf) - VIRTIO_NET_RX_HEADROOM,
+                                                VIRTIO_NET_RX_HEADROOM, len, DMA_FROM_DEVICE);
+}
+
+/*direct recycling is only safe from the NAPI instance owning the pool */
+static void virtio_net_put_rx_buf(struct virtio_net_rq *rq, void *buf, bool napi)
+{
+    page_pool_put_full_page(rq->page_pool, virt_to_head_page(buf), napi && !rq->pool_shared);
+}
+
+/*page_pool allocations are single-consumer, a pool shared by all queues
+ * takes pool_lock around them. offset NULL asks for a whole page */
+static struct page *virtio_net_alloc_rx_page(struct virtio_net_rq *rq, unsigned int *offset,
+                                             unsigned int size, gfp_t gfp)
+{
+    struct page *page;
+
+    if(rq->pool_shared)
+        spin_lock_bh(&rq->vnet_dev->pool_lock);
+
+    if(offset)
+        page = page_pool_alloc_frag(rq->page_pool, offset, size, gfp);
+    else
+        page = page_pool_alloc_pages(rq->page_pool, gfp);
+
+    if(rq->pool_shared)
+        spin_unlock_bh(&rq->vnet_dev->pool_lock);
+    return page;
+}
+
+/*post one small/mergeable buffer (virtio_net_hdr + frame). buf is the
+ * start of its page_pool fragment and doubles as the token, the length
+ * goes along as ctx */
+static int virtio_net_add_rx_frag(struct virtio_net_rq *rq, gfp_t gfp)
+{
+    unsigned int len = READ_ONCE(rq->buf_len);
+    struct scatterlist sg[1];
+    unsigned int offset;
+    struct page *page;
+    void *buf;
+    int ret;
+
+    page = virtio_net_alloc_rx_page(rq, &offset, VIRTIO_NET_RX_TRUESIZE(len), gfp);
+    if(!page)
+        return -ENOMEM;
+
+    buf = page_address(page) + offset;
+    sg_init_one(sg, buf + VIRTIO_NET_RX_HEADROOM, len);
+    if(rq->premapped)
+        sg->dma_address = virtio_net_rx_dma(buf);
+
+    ret = virtqueue_add_inbuf_ctx(rq->vq, sg, 1, buf, (void *)(unsigned long)len, gfp);
+    if(ret)
+        virtio_net_put_rx_buf(rq, buf, false);
+    return ret;
+}
+
+/*return the pages still held by a big mode entry and the entry itself */
+static void virtio_net_put_rx_big(struct virtio_net_rq *rq, struct virtio_net_rx_big *big, bool napi)
+{
+    unsigned int x;
+
+    for(x = 0; x < big->nr_pages; x++)
+    {
+        if(big->pages[x])
+            page_pool_put_full_page(rq->page_pool, big->pages[x], napi && !rq->pool_shared);
+        big->pages[x] = NULL;
+    }
+    big->nr_pages = 0;
+    rq->big_free[rq->nr_big_free++] = big - rq->big;
+}
+
+/*post one chain of whole pages, the header lands at the start of the
+ * first one (VERSION_1 devices do not care about framing) */
+static int virtio_net_add_rx_big(struct virtio_net_rq *rq, unsigned int nr_pages, gfp_t gfp)
+{
+    struct scatterlist sg[VIRTIO_NET_BIG_MAX_PAGES];
+    struct virtio_net_rx_big *big;
+    struct page *page;
+    int ret;
+
+    if(unlikely(!rq->nr_big_free))
+        return -ENOSPC;
+
+    big = &rq->big[rq->big_free[--rq->nr_big_free]];
+    sg_init_table(sg, nr_pages);
+
+    while(big->nr_pages < nr_pages)
+    {
+        page = virtio_net_alloc_rx_page(rq, NULL, PAGE_SIZE, gfp);
+        if(!page)
+        {
+            virtio_net_put_rx_big(rq, big, false);
+            return -ENOMEM;
+        }
+
+        sg_set_page(&sg[big->nr_pages], page, PAGE_SIZE, 0);
+        if(rq->premapped)
+            sg[big->nr_pages].dma_address = page_pool_get_dma_addr(page);
+        big->pages[big->nr_pages++] = page;
+    }
+
+    ret = virtqueue_add_inbuf(rq->vq, sg, nr_pages, big, gfp);
+    if(ret)
+        virtio_net_put_rx_big(rq, big, false);
+    return ret;
+}
+
+/*RX descriptors currently posted */
+static unsigned int virtio_net_rx_posted(struct virtio_net_rq *rq)
+{
+    return virtqueue_get_vring_size(rq->vq) - rq->vq->num_free;
+}
+
+/*post fresh buffers until limit descriptors are posted or the ring is full */
+static int virtio_net_fill_rx_to(struct virtio_net_rq *rq, unsigned int limit, gfp_t gfp)
+{
+    bool big = rq->vnet_dev->rx_mode == VIRTIO_NET_RX_BIG;
+    unsigned int descs = big ? DIV_ROUND_UP(READ_ONCE(rq->buf_len), PAGE_SIZE) : 1;
+    int ret;
+
+    while(rq->vq->num_free >= descs && virtio_net_rx_posted(rq) < limit)
+    {
+        ret = big ? virtio_net_add_rx_big(rq, descs, gfp) : virtio_net_add_rx_frag(rq, gfp);
+        if(ret)
+            return ret;
+    }
+    return 0;
+}
+
+static int virtio_net_fill_rx(struct virtio_net_rq *rq, gfp_t gfp)
+{
+    return virtio_net_fill_rx_to(rq, rq->fill_max, gfp);
+}
+
+/*release a buffer the device never used */
+static void virtio_net_put_unused_rx(struct virtio_net_rq *rq, void *buf)
+{
+    if(rq->vnet_dev->rx_mode == VIRTIO_NET_RX_BIG)
+        virtio_net_put_rx_big(rq, buf, false);
+    else
+        virtio_net_put_rx_buf(rq, buf, false);
+}
+
+static void virtio_net_free_rx(struct virtio_net_rq *rq)
+{
+    void *buf;
+
+    while((buf = virtqueue_detach_unused_buf(rq->vq)) != NULL)
+        virtio_net_put_unused_rx(rq, buf);
+}
+
+/*big mode entries, one per ring entry since every chain takes at least
+ * one descriptor; sized for the largest ring the device allows */
+static int virtio_net_alloc_rx_big(struct virtio_net_rq *rq)
+{
+    u16 size = rq->vq->num_max;
+    u16 x;
+
+    rq->big = kcalloc_node(size, sizeof(*rq->big), GFP_KERNEL, rq->node);
+    rq->big_free = kcalloc_node(size, sizeof(*rq->big_free), GFP_KERNEL, rq->node);
+    if(!rq->big || !rq->big_free)
+    {
+        kfree(rq->big);
+        kfree(rq->big_free);
+        rq->big = NULL;
+        rq->big_free = NULL;
+        return -ENOMEM;
+    }
+
+    for(x = 0; x < size; x++)
+        rq->big_free[x] = size - 1 - x;
+    rq->nr_big_free = size;
+    return 0;
+}
+
+static void virtio_net_free_rx_big(struct virtio_net_rq *rq)
+{
+    kfree(rq->big);
+    kfree(rq->big_free);
+    rq->big = NULL;
+    rq->big_free = NULL;
+}
+
+/*one pool per RX queue. When the ring goes through the DMA API (IOMMU,
+ * ACCESS_PLATFORM) the pool maps each page once and keeps the mapping
+ * across recycling, and the queue is switched to premapped mode so
+ * virtio_ring stops mapping and unmapping every buffer.
+ * With low_mem all queues share the first queue's pool, sized for the
+ * capped fill levels instead of whole rings */
+static int virtio_net_create_page_pool(struct virtio_net_rq *rq)
+{
+    struct virtio_net_dev *vnet_dev = rq->vnet_dev;
+    struct device *dma_dev = virtqueue_dma_dev(rq->vq);
+    struct page_pool_params pp = {
+        .order     = 0,
+        .pool_size = virtqueue_get_vring_size(rq->vq),
+        .nid       = rq->node,
+        .napi      = &rq->napi,
+    };
+
+    if(vnet_dev->shared_pool)
+    {
+        rq->page_pool = vnet_dev->shared_pool;
+        rq->pool_shared = true;
+        rq->premapped = vnet_dev->rq[0].premapped && virtqueue_set_dma_premapped(rq->vq) == 0;
+        return 0;
+    }
+
+    if(vnet_dev->low_mem)
+    {
+        pp.pool_size = VIRTIO_NET_LOWMEM_FILL * vnet_dev->max_queue_pairs;
+        pp.nid = dev_to_node(&vnet_dev->vpci_dev->pdev->dev);
+        pp.napi = NULL;
+    }
+
+#ifdef PP_FLAG_PAGE_FRAG
+    pp.flags |= PP_FLAG_PAGE_FRAG;
+#endif
+
+    if(dma_dev && virtqueue_set_dma_premapped(rq->vq) == 0)
+    {
+        rq->premapped = true;
+        pp.flags |= PP_FLAG_DMA_MAP | PP_FLAG_DMA_SYNC_DEV;
+        pp.dev = dma_dev;
+        pp.dma_dir = DMA_FROM_DEVICE;
+        pp.max_len = PAGE_SIZE;
+        pp.offset = 0;
+    }
+
+    rq->page_pool = page_pool_create(&pp);
+    if(IS_ERR(rq->page_pool))
+    {
+        int ret = PTR_ERR(rq->page_pool);
+
+        rq->page_pool = NULL;
+        return ret;
+    }
+
+    if(vnet_dev->low_mem)
+    {
+        vnet_dev->shared_pool = rq->page_pool;
+        rq->pool_shared = true;
+    }
+    return 0;
+}
+
+/*refill rings that ran dry because GFP_ATOMIC allocations failed in NAPI */
+static void virtio_net_refill_work(struct work_struct *work)
+{
+    struct virtio_net_dev *vnet_dev = container_of(work, struct virtio_net_dev, refill_work.work);
+    bool retry = false;
+    int x;
+
+    /*ndo_stop clears the running bit first and then cancels us */
+    if(!netif_running(vnet_dev->netdev))
+        return;
+
+    for(x = 0; x < vnet_dev->max_queue_pairs; x++)
+    {
+        struct virtio_net_rq *rq = &vnet_dev->rq[x];
+
+        napi_disable(&rq->napi);
+        retry |= virtio_net_fill_rx(rq, GFP_KERNEL) == -ENOMEM;
+        virtqueue_kick(rq->vq);
+        napi_enable(&rq->napi);
+
+        /*pick up anything that completed while NAPI was off */
+        local_bh_disable();
+        napi_schedule(&rq->napi);
+        local_bh_enable();
+    }
+
+    if(retry)
+        schedule_delayed_work(&vnet_dev->refill_work, HZ / 2);
+}
+
+/*wrap a filled RX buffer in an skb without copying, the page goes back
+ * to the pool when the skb is freed */
+static struct sk_buff *virtio_net_build_skb(struct virtio_net_rq *rq, void *buf,
+                                            unsigned int len, unsigned int buf_len)
+{
+    struct sk_buff *skb;
+
+    skb = napi_build_skb(buf, VIRTIO_NET_RX_TRUESIZE(buf_len));
+    if(unlikely(!skb))
+        return NULL;
+
+    skb_mark_for_recycle(skb);
+    skb_reserve(skb, VIRTIO_NET_RX_HEADROOM + VIRTIO_NET_HDR_LEN);
+    skb_put(skb, len - VIRTIO_NET_HDR_LEN);
+    return skb;
+}
+
+/*small mode: one buffer, one frame */
+static struct sk_buff *virtio_net_receive_small(struct virtio_net_rq *rq, void *buf, unsigned int len,
+                                                unsigned int buf_len, struct virtio_net_hdr_mrg_rxbuf *hdr)
+{
+    struct sk_buff *skb;
+
+    if(unlikely(len < VIRTIO_NET_HDR_LEN + ETH_HLEN || len > buf_len))
+        goto err;
+
+    virtio_net_rx_sync(rq, buf, len);
+    memcpy(hdr, buf + VIRTIO_NET_RX_HEADROOM, VIRTIO_NET_HDR_LEN);
+
+    skb = virtio_net_build_skb(rq, buf, len, buf_len);
+    if(unlikely(!skb))
+        goto err;
+    return skb;
+
+err:
+    virtio_net_put_rx_buf(rq, buf, true);
+    return NULL;
+}
+
+/*pull up to nr used entries off the ring and prefetch where the device
+ * wrote the virtio_net_hdr of each, so the misses overlap instead of
+ * stalling one frame at a time */
+static unsigned int virtio_net_rx_harvest(struct virtio_net_rq *rq, unsigned int nr)
+{
+    struct virtio_net_rx_batch *batch = &rq->batch;
+    bool big = rq->vnet_dev->rx_mode == VIRTIO_NET_RX_BIG;
+    unsigned int x;
+
+    for(x = 0; x < nr; x++)
+    {
+        batch->buf[x] = virtqueue_get_buf_ctx(rq->vq, &batch->len[x], &batch->ctx[x]);
+        if(!batch->buf[x])
+            break;
+    }
+
+    for(batch->count = x, x = 0; x < batch->count; x++)
+    {
+        if(big)
+            prefetch(page_address(((struct virtio_net_rx_big *)batch->buf[x])->pages[0]));
+        else
+            prefetch(batch->buf[x] + VIRTIO_NET_RX_HEADROOM);
+    }
+
+    batch->head = 0;
+    return batch->count;
+}
+
+/*next used buffer, from the harvested batch first. Mergeable frames may
+ * continue past the end of the batch, those buffers come off the ring */
+static void *virtio_net_rx_get(struct virtio_net_rq *rq, unsigned int *len, void **ctx)
+{
+    struct virtio_net_rx_batch *batch = &rq->batch;
+    unsigned int x = batch->head;
+
+    if(x == batch->count)
+        return virtqueue_get_buf_ctx(rq->vq, len, ctx);
+
+    batch->head++;
+    *len = batch->len[x];
+    *ctx = batch->ctx[x];
+    return batch->buf[x];
+}
+
+/*drop the buffers left of a mergeable frame we could not assemble */
+static void virtio_net_drop_mergeable(struct virtio_net_rq *rq, int num_buf)
+{
+    unsigned int len;
+    void *buf, *ctx;
+
+    while(num_buf-- > 0 && (buf = virtio_net_rx_get(rq, &len, &ctx)) != NULL)
+        virtio_net_put_rx_buf(rq, buf, true);
+}
+
+/*mergeable mode: the first buffer becomes the skb head and the other
+ * num_buffers - 1 are attached as page fragments. A frame that needs more
+ * than MAX_SKB_FRAGS of them continues in skbs on frag_list */
+static struct sk_buff *virtio_net_receive_mergeable(struct virtio_net_rq *rq, void *buf, unsigned int len,
+                                                    unsigned int buf_len, struct virtio_net_hdr_mrg_rxbuf *hdr)
+{
+    struct sk_buff *head, *curr, *nskb;
+    unsigned int offset, truesize;
+    struct page *page;
+    int num_buf;
+    void *ctx;
+
+    if(unlikely(len < VIRTIO_NET_HDR_LEN + ETH_HLEN || len > buf_len))
+    {
+        virtio_net_put_rx_buf(rq, buf, true);
+        return NULL;
+    }
+
+    virtio_net_rx_sync(rq, buf, len);
+    memcpy(hdr, buf + VIRTIO_NET_RX_HEADROOM, VIRTIO_NET_HDR_LEN);
+    num_buf = __virtio16_to_cpu(true, hdr->num_buffers);
+
+    head = virtio_net_build_skb(rq, buf, len, buf_len);
+    if(unlikely(!head))
+    {
+        virtio_net_put_rx_buf(rq, buf, true);
+        virtio_net_drop_mergeable(rq, num_buf - 1);
+        return NULL;
+    }
+
+    curr = head;
+    while(--num_buf > 0)
+    {
+        buf = virtio_net_rx_get(rq, &len, &ctx);
+        if(unlikely(!buf))
+        {
+            dev_dbg(&rq->vnet_dev->vpci_dev->pdev->dev, "rx: %d buffers missing\n", num_buf);
+            goto err_free;
+        }
+
+        buf_len = (unsigned long)ctx;
+        if(unlikely(len > buf_len))
+        {
+            virtio_net_put_rx_buf(rq, buf, true);
+            virtio_net_drop_mergeable(rq, num_buf - 1);
+            goto err_free;
+        }
+
+        virtio_net_rx_sync(rq, buf, len);
+        page = virt_to_head_page(buf);
+        offset = buf - page_address(page) + VIRTIO_NET_RX_HEADROOM;
+        truesize = VIRTIO_NET_RX_TRUESIZE(buf_len);
+
+        if(unlikely(skb_shinfo(curr)->nr_frags == MAX_SKB_FRAGS))
+        {
+            nskb = napi_alloc_skb(&rq->napi, 0);
+            if(unlikely(!nskb))
+            {
+                virtio_net_put_rx_buf(rq, buf, true);
+                virtio_net_drop_mergeable(rq, num_buf - 1);
+                goto err_free;
+            }
+
+            skb_mark_for_recycle(nskb);
+            if(curr == head)
+                skb_shinfo(curr)->frag_list = nskb;
+            else
+                curr->next = nskb;
+            curr = nskb;
+            head->truesize += nskb->truesize;
+        }
+
+        /*skb_add_rx_frag() only accounts on curr */
+        if(curr != head)
+        {
+            head->data_len += len;
+            head->len += len;
+            head->truesize += truesize;
+        }
+        skb_add_rx_frag(curr, skb_shinfo(curr)->nr_frags, page, offset, len, truesize);
+    }
+    return head;
+
+err_free:
+    dev_kfree_skb(head);
+    return NULL;
+}
+
+/*big mode: copy the start of the frame into the skb head, the rest of the
+ * chain becomes page fragments. Pages the frame did not reach go back to
+ * the pool together with the entry */
+static struct sk_buff *virtio_net_receive_big(struct virtio_net_rq *rq, struct virtio_net_rx_big *big,
+                                              unsigned int len, struct virtio_net_hdr_mrg_rxbuf *hdr)
+{
+    unsigned int offset = VIRTIO_NET_HDR_LEN;
+    struct sk_buff *skb = NULL;
+    unsigned int copy, chunk, x;
+    void *p;
+
+    if(unlikely(len < VIRTIO_NET_HDR_LEN + ETH_HLEN || len > big->nr_pages * PAGE_SIZE))
+        goto out;
+
+    if(rq->premapped)
+    {
+        for(x = 0; x * PAGE_SIZE < len; x++)
+            virtqueue_dma_sync_single_range_for_cpu(rq->vq, page_pool_get_dma_addr(big->pages[x]), 0,
+                                                    min_t(unsigned int, len - x * PAGE_SIZE, PAGE_SIZE),
+                                                    DMA_FROM_DEVICE);
+    }
+
+    p = page_address(big->pages[0]);
+    memcpy(hdr, p, VIRTIO_NET_HDR_LEN);
+    len -= VIRTIO_NET_HDR_LEN;
+
+    copy = min_t(unsigned int, len, VIRTIO_NET_RX_COPY_LEN);
+    skb = napi_alloc_skb(&rq->napi, copy);
+    if(unlikely(!skb))
+        goto out;
+
+    skb_mark_for_recycle(skb);
+    skb_put_data(skb, p + offset, copy);
+    len -= copy;
+    offset += copy;
+
+    for(x = 0; len; x++)
+    {
+        chunk = min_t(unsigned int, len, PAGE_SIZE - offset);
+        skb_add_rx_frag(skb, skb_shinfo(skb)->nr_frags, big->pages[x], offset, chunk, PAGE_SIZE);
+        big->pages[x] = NULL;
+        len -= chunk;
+        offset = 0;
+    }
+
+out:
+    virtio_net_put_rx_big(rq, big, true);
+    return skb;
+}
+
+/*harvest up to budget used RX buffers in batches and hand them up as
+ * skbs, then refill the ring from the page pool; one kick covers the whole
+ * poll. skbs come from the per-CPU NAPI cache (napi_build_skb), which
+ * allocates in bulk. With GRO off each batch goes up as one list, with GRO
+ * on napi_gro_receive() already batches delivery on napi->rx_list */
+static int virtio_net_receive(struct virtio_net_rq *rq, int budget)
+{
+    struct virtio_net_dev *vnet_dev = rq->vnet_dev;
+    struct net_device *netdev = vnet_dev->netdev;
+    bool gro = netdev->features & NETIF_F_GRO;
+    struct virtio_net_hdr_mrg_rxbuf hdr;
+    struct sk_buff *skb;
+    LIST_HEAD(rx_list);
+    u64 bytes = 0, drops = 0;
+    int received = 0;
+    unsigned int num_free;
+    unsigned int reposted;
+    void *buf, *ctx;
+    unsigned len;
+
+    /*a batch holds at most budget - received frame heads, so the budget holds */
+    while(received < budget && virtio_net_rx_harvest(rq, min_t(int, budget - received, VIRTIO_NET_RX_BATCH)))
+    {
+        while(rq->batch.head < rq->batch.count)
+        {
+            buf = virtio_net_rx_get(rq, &len, &ctx);
+            received++;
+
+            switch(vnet_dev->rx_mode)
+            {
+                case VIRTIO_NET_RX_BIG:
+                    skb = virtio_net_receive_big(rq, buf, len, &hdr);
+                    break;
+                case VIRTIO_NET_RX_MERGEABLE:
+                    skb = virtio_net_receive_mergeable(rq, buf, len, (unsigned long)ctx, &hdr);
+                    break;
+                default:
+                    skb = virtio_net_receive_small(rq, buf, len, (unsigned long)ctx, &hdr);
+                    break;
+            }
+
+            if(unlikely(!skb))
+            {
+                drops++;
+                continue;
+            }
+
+            /*checksum state and GSO metadata, only set with GUEST_CSUM/GUEST_TSO */
+            if(hdr.hdr.flags & VIRTIO_NET_HDR_F_DATA_VALID)
+                skb->ip_summed = CHECKSUM_UNNECESSARY;
+            if(unlikely(virtio_net_hdr_to_skb(skb, &hdr.hdr, true)))
+            {
+                drops++;
+                dev_kfree_skb(skb);
+                continue;
+            }
+
+            bytes += skb->len;
+            skb->protocol = eth_type_trans(skb, netdev);
+            /*both paths stamp the napi id for busy polling sockets */
+            if(gro)
+            {
+                napi_gro_receive(&rq->napi, skb);
+            }
+            else
+            {
+                skb_mark_napi_id(skb, &rq->napi);
+                list_add_tail(&skb->list, &rx_list);
+            }
+        }
+
+        if(!list_empty(&rx_list))
+        {
+            netif_receive_skb_list(&rx_list);
+            INIT_LIST_HEAD(&rx_list);
+        }
+    }
+    rq->batch.count = 0;
+
+    /*with low_mem the ring is only topped up once it drops below fill_low */
+    num_free = rq->vq->num_free;
+    if(virtio_net_rx_posted(rq) < rq->fill_low && virtio_net_fill_rx(rq, GFP_ATOMIC) == -ENOMEM)
+        schedule_delayed_work(&vnet_dev->refill_work, 0);
+    reposted = num_free - rq->vq->num_free;
+
+    if(reposted)
+        trace_virtio_net_rx_refill(netdev, rq->qp, reposted, rq->vq->num_free);
+
+    u64_stats_update_begin(&rq->stats.syncp);
+    u64_stats_add(&rq->stats.packets, received - drops);
+    u64_stats_add(&rq->stats.bytes, bytes);
+    u64_stats_add(&rq->stats.drops, drops);
+    if(reposted && virtio_net_kick(vnet_dev, rq->vq))
+        u64_stats_inc(&rq->stats.kicks);
+    u64_stats_update_end(&rq->stats.syncp);
+
+    return received;
+}
+
+/*one NAPI instance per queue pair. TX completions are reclaimed first and
+ * share the budget with RX, a completion costing half a received frame */
+static int virtio_net_poll(struct napi_struct *napi, int budget)
+{
+    struct virtio_net_rq *rq = container_of(napi, struct virtio_net_rq, napi);
+    struct virtio_net_sq *sq = &rq->vnet_dev->sq[rq->qp];
+    bool busy_poll = test_bit(NAPI_STATE_IN_BUSY_POLL, &napi->state);
+    cycles_t start = virtio_net_cycles_start();
+    int tx_done, received, work;
+
+    trace_virtio_net_poll_start(rq->vnet_dev->netdev, rq->qp, budget);
+
+    if(virtio_net_hist_on(rq->vnet_dev) && rq->irq_ns)
+    {
+        virtio_net_hist_add(&rq->irq_to_poll, ktime_get_ns() - rq->irq_ns);
+        rq->irq_ns = 0;
+    }
+
+    /*budget 0 is netpoll: TX only, and not as NAPI */
+    tx_done = virtio_net_poll_tx(sq, budget);
+    if(!budget)
+        return 0;
+
+    /*after an affinity change the pool starts handing out pages from the
+     * new node; it may only be touched from its own NAPI context */
+    if(!rq->pool_shared)
+        page_pool_nid_changed(rq->page_pool, READ_ONCE(rq->node));
+
+    received = virtio_net_receive(rq, budget - tx_done / 2);
+    /*TX still behind keeps the poll going */
+    work = tx_done == budget ? budget : received + tx_done / 2;
+
+    u64_stats_update_begin(&rq->stats.syncp);
+    if(start)
+        u64_stats_add(&rq->stats.cycles, get_cycles() - start);
+    if(busy_poll)
+    {
+        u64_stats_inc(&rq->stats.busy_polls);
+        if(received)
+            u64_stats_inc(&rq->stats.busy_poll_hits);
+    }
+    u64_stats_update_end(&rq->stats.syncp);
+
+    if(rq->polled)
+        WRITE_ONCE(rq->poll_work, rq->poll_work + received + tx_done);
+
+    if(work < budget)
+    {
+        /*napi_complete_done() returns false while a socket is busy polling
+         * this napi, leave device notifications off until it lets go.
+         * Polled pairs keep them off for good */
+        if(napi_complete_done(napi, work) && !rq->polled)
+        {
+            unsigned opaque = virtqueue_enable_cb_prepare(rq->vq);
+            if(unlikely(virtqueue_poll(rq->vq, opaque)) && napi_schedule_prep(napi))
+            {
+                virtqueue_disable_cb(rq->vq);
+                __napi_schedule(napi);
+            }
+        }
+    }
+
+    trace_virtio_net_poll_end(rq->vnet_dev->netdev, rq->qp, received);
+
+    return work;
+}
+
+/*poll mode: the thread stands in for the missing interrupt and schedules
+ * the pair's NAPI on its own CPU; the poll runs as softirq when BHs are
+ * enabled again. While the interface is down it sleeps until ndo_open
+ * wakes it, with the carrier off it backs off right away */
+static int virtio_net_poll_thread(void *data)
+{
+    struct virtio_net_rq *rq = data;
+    struct net_device *netdev = rq->vnet_dev->netdev;
+    u64 busy_ns = ktime_get_ns();
+
+    while(!kthread_should_stop())
+    {
+        unsigned int sleep_us = READ_ONCE(poll_sleep_us);
+
+        if(!netif_running(netdev))
+        {
+            wait_event_interruptible(rq->poll_wq, netif_running(netdev) || kthread_should_stop());
+            busy_ns = ktime_get_ns();
+            continue;
+        }
+
+        local_bh_disable();
+        napi_schedule(&rq->napi);
+        local_bh_enable();
+
+        if(xchg(&rq->poll_work, 0))
+            busy_ns = ktime_get_ns();
+        else if(sleep_us && (!netif_carrier_ok(netdev) ||
+                ktime_get_ns() - busy_ns > (u64)READ_ONCE(poll_spin_us) * NSEC_PER_USEC))
+        {
+            usleep_range(sleep_us, 2 * sleep_us);
+            continue;
+        }
+
+        cond_resched();
+    }
+
+    return 0;
+}
+
+static void virtio_net_poll_start(struct virtio_net_dev *vnet_dev)
+{
+    int x;
+
+    for(x = 0; x < vnet_dev->max_queue_pairs; x++)
+    {
+        struct virtio_net_rq *rq = &vnet_dev->rq[x];
+        struct task_struct *thread;
+
+        if(!rq->polled)
+            continue;
+
+        thread = kthread_create_on_node(virtio_net_poll_thread, rq, cpu_to_node(rq->poll_cpu),
+                                        "%s-poll%d", vnet_dev->netdev->name, x);
+        if(IS_ERR(thread))
+        {
+            dev_err(&vnet_dev->vpci_dev->pdev->dev,
+                    "Failed to start poll thread for queue pair %d: %ld\n", x, PTR_ERR(thread));
+            continue;
+        }
+
+        set_cpus_allowed_ptr(thread, cpumask_of(rq->poll_cpu));
+        rq->poll_thread = thread;
+        wake_up_process(thread);
+    }
+}
+
+static void virtio_net_poll_stop(struct virtio_net_dev *vnet_dev)
+{
+    int x;
+
+    for(x = 0; x < vnet_dev->max_queue_pairs; x++)
+    {
+        struct virtio_net_rq *rq = &vnet_dev->rq[x];
+
+        if(!rq->poll_thread)
+            continue;
+
+        kthread_stop(rq->poll_thread);
+        rq->poll_thread = NULL;
+    }
+}
+
+/*RX virtqueue callback (hard IRQ): mask further notifications and defer to NAPI */
+void virtio_net_rx_callback(struct virtqueue *vq)
+{
+    struct virtio_pci_dev *vpci_dev = vq->vdev->priv;
+    struct virtio_net_dev *vnet_dev = vpci_dev->drv_priv;
+    struct virtio_net_rq *rq;
+
+    if(!vnet_dev)
+        return;
+
+    rq = &vnet_dev->rq[VIRTIO_NET_VQ_QP(vq->index)];
+
+    trace_virtio_net_interrupt(vnet_dev->netdev, vq->index);
+    if(virtio_net_hist_on(vnet_dev))
+        rq->irq_ns = ktime_get_ns();
+
+    u64_stats_update_begin(&rq->stats.syncp);
+    u64_stats_inc(&rq->stats.interrupts);
+    u64_stats_update_end(&rq->stats.syncp);
+
+    if(napi_schedule_prep(&rq->napi))
+    {
+        virtqueue_disable_cb(vq);
+        __napi_schedule(&rq->napi);
+    }
+}
+
+/*ethtool */
+
+struct virtio_net_stat_desc {
+    char desc[ETH_GSTRING_LEN];
+    size_t offset;
+};
+
+#define VIRTIO_NET_RQ_STAT(m)   offsetof(struct virtio_net_rq_stats, m)
+#define VIRTIO_NET_SQ_STAT(m)   offsetof(struct virtio_net_sq_stats, m)
+
+/*kicks, interrupts and cycles divided by packets give the per-packet
+ * costs used to compare builds under the same load generator. cycles only
+ * count while autoscale or a benchmark run needs them */
+static const struct virtio_net_stat_desc virtio_net_rq_stats_desc[] = {
+    { "packets",        VIRTIO_NET_RQ_STAT(packets) },
+    { "bytes",          VIRTIO_NET_RQ_STAT(bytes) },
+    { "drops",          VIRTIO_NET_RQ_STAT(drops) },
+    { "kicks",          VIRTIO_NET_RQ_STAT(kicks) },
+    { "interrupts",     VIRTIO_NET_RQ_STAT(interrupts) },
+    { "cycles",         VIRTIO_NET_RQ_STAT(cycles) },
+    { "busy_polls",     VIRTIO_NET_RQ_STAT(busy_polls) },
+    { "busy_poll_hits", VIRTIO_NET_RQ_STAT(busy_poll_hits) },
+};
+
+static const struct virtio_net_stat_desc virtio_net_sq_stats_desc[] = {
+    { "packets",        VIRTIO_NET_SQ_STAT(packets) },
+    { "bytes",          VIRTIO_NET_SQ_STAT(bytes) },
+    { "drops",          VIRTIO_NET_SQ_STAT(drops) },
+    { "kicks",          VIRTIO_NET_SQ_STAT(kicks) },
+    { "cycles",         VIRTIO_NET_SQ_STAT(cycles) },
+};
+
+#define VIRTIO_NET_RQ_STATS_LEN ARRAY_SIZE(virtio_net_rq_stats_desc)
+#define VIRTIO_NET_SQ_STATS_LEN ARRAY_SIZE(virtio_net_sq_stats_desc)
+
+static void virtio_net_get_drvinfo(struct net_device *dev, struct ethtool_drvinfo *info)
+{
+    struct virtio_net_dev *vnet_dev = netdev_priv(dev);
+
+    strscpy(info->driver, KBUILD_MODNAME, sizeof(info->driver));
+    strscpy(info->bus_info, pci_name(vnet_dev->vpci_dev->pdev), sizeof(info->bus_info));
+}
+
+static int virtio_net_get_sset_count(struct net_device *dev, int sset)
+{
+    struct virtio_net_dev *vnet_dev = netdev_priv(dev);
+
+    switch(sset)
+    {
+        case ETH_SS_STATS:
+            return vnet_dev->max_queue_pairs * (VIRTIO_NET_RQ_STATS_LEN + VIRTIO_NET_SQ_STATS_LEN);
+        default:
+            return -EOPNOTSUPP;
+    }
+}
+
+static void virtio_net_get_strings(struct net_device *dev, u32 sset, u8 *data)
+{
+    struct virtio_net_dev *vnet_dev = netdev_priv(dev);
+    int x, y;
+
+    if(sset != ETH_SS_STATS)
+        return;
+
+    for(x = 0; x < vnet_dev->max_queue_pairs; x++)
+        for(y = 0; y < VIRTIO_NET_RQ_STATS_LEN; y++)
+            ethtool_sprintf(&data, "rx_queue_%u_%s", x, virtio_net_rq_stats_desc[y].desc);
+
+    for(x = 0; x < vnet_dev->max_queue_pairs; x++)
+        for(y = 0; y < VIRTIO_NET_SQ_STATS_LEN; y++)
+            ethtool_sprintf(&data, "tx_queue_%u_%s", x, virtio_net_sq_stats_desc[y].desc);
+}
+
+static void virtio_net_get_ethtool_stats(struct net_device *dev,
+                                         struct ethtool_stats *stats, u64 *data)
+{
+    struct virtio_net_dev *vnet_dev = netdev_priv(dev);
+    unsigned int idx = 0, start;
+    int x, y;
+
+    for(x = 0; x < vnet_dev->max_queue_pairs; x++)
+    {
+        struct virtio_net_rq_stats *rq_stats = &vnet_dev->rq[x].stats;
+        const void *base = rq_stats;
+
+        do {
+            start = u64_stats_fetch_begin(&rq_stats->syncp);
+            for(y = 0; y < VIRTIO_NET_RQ_STATS_LEN; y++)
+                data[idx + y] = u64_stats_read((const u64_stats_t *)
+                                               (base + virtio_net_rq_stats_desc[y].offset));
+        } while(u64_stats_fetch_retry(&rq_stats->syncp, start));
+
+        idx += VIRTIO_NET_RQ_STATS_LEN;
+    }
+
+    for(x = 0; x < vnet_dev->max_queue_pairs; x++)
+    {
+        struct virtio_net_sq_stats *sq_stats = &vnet_dev->sq[x].stats;
+        const void *base = sq_stats;
+
+        do {
+            start = u64_stats_fetch_begin(&sq_stats->syncp);
+            for(y = 0; y < VIRTIO_NET_SQ_STATS_LEN; y++)
+                data[idx + y] = u64_stats_read((const u64_stats_t *)
+                                               (base + virtio_net_sq_stats_desc[y].offset));
+        } while(u64_stats_fetch_retry(&sq_stats->syncp, start));
+
+        idx += VIRTIO_NET_SQ_STATS_LEN;
+    }
+}
+
+/*ring resize (VIRTIO_F_RING_RESET): virtqueue_resize() resets just the
+ * one queue, hands every posted buffer back through the recycle callback
+ * and brings the queue up again on a new ring. The link and the other
+ * queues keep running. Called under RTNL */
+
+static void virtio_net_rx_recycle(struct virtqueue *vq, void *buf)
+{
+    struct virtio_pci_dev *vpci_dev = vq->vdev->priv;
+    struct virtio_net_dev *vnet_dev = vpci_dev->drv_priv;
+
+    virtio_net_put_unused_rx(&vnet_dev->rq[VIRTIO_NET_VQ_QP(vq->index)], buf);
+}
+
+static void virtio_net_tx_recycle(struct virtqueue *vq, void *buf)
+{
+    struct virtio_pci_dev *vpci_dev = vq->vdev->priv;
+    struct virtio_net_dev *vnet_dev = vpci_dev->drv_priv;
+    struct sk_buff *skb = buf;
+
+    virtio_net_tx_release(&vnet_dev->sq[VIRTIO_NET_VQ_QP(vq->index)], skb);
+    dev_kfree_skb(skb);
+}
+
+/*give rq a fresh ring: resized to num entries or, with num 0, just reset.
+ * Whatever ring it ends up with gets up to limit buffers posted */
+static int virtio_net_rx_reset(struct virtio_net_rq *rq, u32 num, unsigned int limit)
+{
+    struct virtio_net_dev *vnet_dev = rq->vnet_dev;
+    bool running = netif_running(vnet_dev->netdev);
+    int ret;
+
+    if(running)
+        napi_disable(&rq->napi);
+
+    if(num)
+        ret = virtqueue_resize(rq->vq, num, virtio_net_rx_recycle);
+    else
+        ret = virtqueue_reset(rq->vq, virtio_net_rx_recycle);
+    if(ret)
+        netdev_err(vnet_dev->netdev, "Failed to reset rx queue %u: %d\n", rq->qp, ret);
+
+    /*new ring, or the old one if the reset failed; either way it needs buffers */
+    if(virtio_net_fill_rx_to(rq, limit, GFP_KERNEL) == -ENOMEM)
+        schedule_delayed_work(&vnet_dev->refill_work, 0);
+    virtqueue_kick(rq->vq);
+
+    if(running)
+    {
+        napi_enable(&rq->napi);
+        local_bh_disable();
+        napi_schedule(&rq->napi);
+        local_bh_enable();
+    }
+    return ret;
+}
+
+static int virtio_net_tx_resize(struct virtio_net_sq *sq, u32 num)
+{
+    struct net_device *netdev = sq->vnet_dev->netdev;
+    struct netdev_queue *txq = netdev_get_tx_queue(netdev, sq->qp);
+    struct napi_struct *napi = &sq->vnet_dev->rq[sq->qp].napi;
+    bool running = netif_running(netdev);
+    int ret;
+
+    /*wait out a running xmit and keep the stack off the queue; NAPI of the
+     * pair reclaims TX completions and has to be stopped as well */
+    __netif_tx_lock_bh(txq);
+    netif_tx_stop_queue(txq);
+    __netif_tx_unlock_bh(txq);
+    if(running)
+        napi_disable(napi);
+
+    ret = virtqueue_resize(sq->vq, num, virtio_net_tx_recycle);
+    if(ret)
+        netdev_err(netdev, "Failed to resize tx queue %u: %d\n", sq->qp, ret);
+
+    if(running)
+        napi_enable(napi);
+    __netif_tx_lock_bh(txq);
+    if(running)
+        netif_tx_wake_queue(txq);
+    __netif_tx_unlock_bh(txq);
+    return ret;
+}
+
+static void virtio_net_get_channels(struct net_device *dev, struct ethtool_channels *channels)
+{
+    struct virtio_net_dev *vnet_dev = netdev_priv(dev);
+
+    channels->max_combined = vnet_dev->max_queue_pairs;
+    channels->combined_count = vnet_dev->curr_queue_pairs;
+}
+
+/*RX and TX queues only come in pairs */
+static int virtio_net_set_channels(struct net_device *dev, struct ethtool_channels *channels)
+{
+    struct virtio_net_dev *vnet_dev = netdev_priv(dev);
+    u16 pairs = channels->combined_count;
+
+    if(channels->rx_count || channels->tx_count || channels->other_count)
+        return -EINVAL;
+
+    if(!pairs || pairs > vnet_dev->max_queue_pairs)
+        return -EINVAL;
+
+    /*with autoscale the count becomes the ceiling to scale under */
+    vnet_dev->scale_max = pairs;
+    if(vnet_dev->autoscale && pairs > vnet_dev->curr_queue_pairs)
+        return 0;
+
+    if(pairs == vnet_dev->curr_queue_pairs)
+        return 0;
+
+    return virtio_net_set_queues(vnet_dev, pairs);
+}
+
+static void virtio_net_get_ringparam(struct net_device *dev, struct ethtool_ringparam *ring,
+                                     struct kernel_ethtool_ringparam *kernel_ring,
+                                     struct netlink_ext_ack *extack)
+{
+    struct virtio_net_dev *vnet_dev = netdev_priv(dev);
+
+    ring->rx_max_pending = vnet_dev->rq[0].vq->num_max;
+    ring->tx_max_pending = vnet_dev->sq[0].vq->num_max;
+    ring->rx_pending = virtqueue_get_vring_size(vnet_dev->rq[0].vq);
+    ring->tx_pending = virtqueue_get_vring_size(vnet_dev->sq[0].vq);
+}
+
+static int virtio_net_set_ringparam(struct net_device *dev, struct ethtool_ringparam *ring,
+                                    struct kernel_ethtool_ringparam *kernel_ring,
+                                    struct netlink_ext_ack *extack)
+{
+    struct virtio_net_dev *vnet_dev = netdev_priv(dev);
+    int ret;
+    int x;
+
+    if(!virtio_net_has_feature(vnet_dev, VIRTIO_F_RING_RESET))
+    {
+        NL_SET_ERR_MSG_MOD(extack, "Device does not support ring reset");
+        return -EOPNOTSUPP;
+    }
+
+    if(ring->rx_mini_pending || ring->rx_jumbo_pending)
+        return -EINVAL;
+
+    /*split rings are powers of two; TX must fit a worst-case skb and a big
+     * mode RX ring at least one page chain */
+    if(!is_power_of_2(ring->rx_pending) || !is_power_of_2(ring->tx_pending) ||
+       ring->tx_pending < MAX_SKB_FRAGS + 2 ||
+       (vnet_dev->rx_mode == VIRTIO_NET_RX_BIG &&
+        ring->rx_pending < DIV_ROUND_UP(vnet_dev->rq[0].buf_len, PAGE_SIZE)))
+    {
+        NL_SET_ERR_MSG_MOD(extack, "Ring sizes must be powers of two large enough for one packet");
+        return -EINVAL;
+    }
+
+    if(ring->rx_pending > vnet_dev->rq[0].vq->num_max ||
+       ring->tx_pending > vnet_dev->sq[0].vq->num_max)
+        return -EINVAL;
+
+    for(x = 0; x < vnet_dev->max_queue_pairs; x++)
+    {
+        if(ring->rx_pending != virtqueue_get_vring_size(vnet_dev->rq[x].vq))
+        {
+            ret = virtio_net_rx_reset(&vnet_dev->rq[x], ring->rx_pending, vnet_dev->rq[x].fill_max);
+            if(ret)
+                return ret;
+        }
+
+        if(ring->tx_pending != virtqueue_get_vring_size(vnet_dev->sq[x].vq))
+        {
+            ret = virtio_net_tx_resize(&vnet_dev->sq[x], ring->tx_pending);
+            if(ret)
+                return ret;
+        }
+    }
+    return 0;
+}
+
+/*low_mem: RX queues that saw no packets for a whole period give their
+ * buffers back. Posted buffers can only be reclaimed by resetting the
+ * queue, so this needs VIRTIO_F_RING_RESET. The queue restarts at its low
+ * watermark and grows again with traffic */
+static void virtio_net_idle_work(struct work_struct *work)
+{
+    struct virtio_net_dev *vnet_dev = container_of(work, struct virtio_net_dev, idle_work.work);
+    int x;
+
+    rtnl_lock();
+    for(x = 0; x < vnet_dev->max_queue_pairs; x++)
+    {
+        struct virtio_net_rq *rq = &vnet_dev->rq[x];
+        u64 packets = u64_stats_read(&rq->stats.packets);
+
+        if(packets == rq->idle_packets && virtio_net_rx_posted(rq) > rq->fill_low)
+            virtio_net_rx_reset(rq, 0, rq->fill_low);
+        rq->idle_packets = packets;
+    }
+    rtnl_unlock();
+
+    schedule_delayed_work(&vnet_dev->idle_work, msecs_to_jiffies(VIRTIO_NET_LOWMEM_IDLE_MS));
+}
+
+static void virtio_net_scale_read(struct virtio_net_dev *vnet_dev, u16 qp, u64 *packets, u64 *cycles)
+{
+    struct virtio_net_rq *rq = &vnet_dev->rq[qp];
+    struct virtio_net_sq *sq = &vnet_dev->sq[qp];
+
+    *packets = u64_stats_read(&rq->stats.packets) + u64_stats_read(&sq->stats.packets);
+    *cycles = u64_stats_read(&rq->stats.cycles) + u64_stats_read(&sq->stats.cycles);
+}
+
+/*take the first sample and start scaling from it */
+static void virtio_net_scale_start(struct virtio_net_dev *vnet_dev)
+{
+    u16 x;
+
+    if(!vnet_dev->autoscale)
+        return;
+
+    for(x = 0; x < vnet_dev->max_queue_pairs; x++)
+        virtio_net_scale_read(vnet_dev, x, &vnet_dev->rq[x].scale_packets, &vnet_dev->rq[x].scale_cycles);
+    vnet_dev->scale_jiffies = jiffies;
+    vnet_dev->scale_cycles = get_cycles();
+    vnet_dev->scale_calm = 0;
+
+    schedule_delayed_work(&vnet_dev->scale_work, msecs_to_jiffies(VIRTIO_NET_SCALE_MS));
+}
+
+/*pairs that stop being used drop out of XPS and the device's steering, so
+ * their vectors go quiet; their rings stay posted for the next burst */
+static void virtio_net_scale_work(struct work_struct *work)
+{
+    struct virtio_net_dev *vnet_dev = container_of(work, struct virtio_net_dev, scale_work.work);
+    unsigned int ms = max(jiffies_to_msecs(jiffies - vnet_dev->scale_jiffies), 1U);
+    u64 elapsed = get_cycles() - vnet_dev->scale_cycles;
+    u64 total_pps = 0, total_pct = 0;
+    u16 curr, target, need;
+    bool hot = false;
+    u16 x;
+
+    rtnl_lock();
+    curr = vnet_dev->curr_queue_pairs;
+    target = curr;
+
+    /*inactive pairs are counted too, they may still be draining */
+    for(x = 0; x < vnet_dev->max_queue_pairs; x++)
+    {
+        struct virtio_net_rq *rq = &vnet_dev->rq[x];
+        u64 packets, cycles, pps, pct = 0;
+
+        virtio_net_scale_read(vnet_dev, x, &packets, &cycles);
+        pps = div_u64((packets - rq->scale_packets) * MSEC_PER_SEC, ms);
+        /*get_cycles() is 0 on some architectures, rates alone decide there */
+        if(elapsed)
+            pct = div64_u64((cycles - rq->scale_cycles) * 100, elapsed);
+        rq->scale_packets = packets;
+        rq->scale_cycles = cycles;
+
+        total_pps += pps;
+        total_pct += pct;
+        if(x < curr && (pps > VIRTIO_NET_SCALE_UP_PPS || pct > VIRTIO_NET_SCALE_UP_PCT))
+            hot = true;
+    }
+    vnet_dev->scale_jiffies += msecs_to_jiffies(ms);
+    vnet_dev->scale_cycles += elapsed;
+
+    need = min_t(u64, max(DIV_ROUND_UP_ULL(total_pct, VIRTIO_NET_SCALE_UP_PCT),
+                          DIV_ROUND_UP_ULL(total_pps, VIRTIO_NET_SCALE_UP_PPS)), U16_MAX);
+
+    if(hot && curr < vnet_dev->scale_max)
+    {
+        /*bursts: go straight to what the load needs, at least one more */
+        target = clamp_t(u16, need, curr + 1, vnet_dev->scale_max);
+        vnet_dev->scale_calm = 0;
+    }
+    else if(curr > 1 && total_pct <= VIRTIO_NET_SCALE_DOWN_PCT * (curr - 1) &&
+            total_pps <= VIRTIO_NET_SCALE_DOWN_PPS * (curr - 1))
+    {
+        if(++vnet_dev->scale_calm >= VIRTIO_NET_SCALE_CALM)
+        {
+            target = curr - 1;
+            vnet_dev->scale_calm = 0;
+        }
+    }
+    else
+        vnet_dev->scale_calm = 0;
+
+    if(target != curr)
+        virtio_net_set_queues(vnet_dev, target);
+    rtnl_unlock();
+
+    schedule_delayed_work(&vnet_dev->scale_work, msecs_to_jiffies(VIRTIO_NET_SCALE_MS));
+}
+
+static const struct ethtool_ops virtio_net_ethtool_ops = {
+    .get_drvinfo = virtio_net_get_drvinfo,
+    .get_ringparam = virtio_net_get_ringparam,
+    .set_ringparam = virtio_net_set_ringparam,
+    .get_channels = virtio_net_get_channels,
+    .set_channels = virtio_net_set_channels,
+    .get_link = ethtool_op_get_link,
+    .get_sset_count = virtio_net_get_sset_count,
+    .get_strings = virtio_net_get_strings,
+    .get_ethtool_stats = virtio_net_get_ethtool_stats,
+};
+
+/*send a command on the control virtqueue and wait for the device to ack it.
+ * out may be NULL for commands without a payload */
+bool virtio_net_send_command(struct virtio_net_dev *vnet_dev, u8 class, u8 cmd,
+                             struct scatterlist *out)
+{
+    struct virtio_net_ctrl *ctrl = vnet_dev->ctrl;
+    struct scatterlist hdr, stat, *sgs[3];
+    unsigned int out_num = 0;
+    unsigned int tmp;
+    bool ok;
+    int ret;
+
+    if(!vnet_dev->cvq)
+        return false;
+
+    mutex_lock(&vnet_dev->cvq_lock);
+
+    ctrl->status = ~0;
+    ctrl->hdr.class = class;
+    ctrl->hdr.cmd = cmd;
+
+    sg_init_one(&hdr, &ctrl->hdr, sizeof(ctrl->hdr));
+    sgs[out_num++] = &hdr;
+    if(out)
+        sgs[out_num++] = out;
+
+    sg_init_one(&stat, &ctrl->status, sizeof(ctrl->status));
+    sgs[out_num] = &stat;
+
+    ret = virtqueue_add_sgs(vnet_dev->cvq, sgs, out_num, 1, vnet_dev, GFP_ATOMIC);
+    if(ret < 0)
+    {
+        dev_warn(&vnet_dev->vpci_dev->pdev->dev,
+                 "Failed to add ctrl command %u.%u: %d\n", class, cmd, ret);
+        mutex_unlock(&vnet_dev->cvq_lock);
+        return false;
+    }
+
+    if(unlikely(!virtqueue_kick(vnet_dev->cvq)))
+        goto out;
+
+    /*the device processes control commands synchronously, spin for the ack */
+    while(!virtqueue_get_buf(vnet_dev->cvq, &tmp) && !virtqueue_is_broken(vnet_dev->cvq))
+        cpu_relax();
+
+out:
+    ok = ctrl->status == VIRTIO_NET_OK;
+    mutex_unlock(&vnet_dev->cvq_lock);
+    return ok;
+}
+
+/*push promisc/allmulti and the complete unicast and multicast tables.
+ * ndo_set_rx_mode only schedules this, so a burst of address changes ends
+ * up as a single MAC_TABLE_SET carrying both tables */
+static void virtio_net_rx_mode_work(struct work_struct *work)
+{
+    struct virtio_net_dev *vnet_dev = container_of(work, struct virtio_net_dev, rx_mode_work);
+    struct virtio_net_ctrl *ctrl = vnet_dev->ctrl;
+    struct net_device *netdev = vnet_dev->netdev;
+    struct virtio_device *vdev = &vnet_dev->vpci_dev->virtio_dev;
+    struct virtio_net_ctrl_mac *uc_data, *mc_data;
+    struct netdev_hw_addr *ha;
+    struct scatterlist sg[2];
+    unsigned int uc_count, mc_count, x;
+    u8 promisc, allmulti;
+    void *buf;
+
+    rtnl_lock();
+    if(!vnet_dev->filters_enabled)
+        goto out;
+
+    netif_addr_lock_bh(netdev);
+    promisc = !!(netdev->flags & IFF_PROMISC);
+    allmulti = !!(netdev->flags & IFF_ALLMULTI);
+    uc_count = netdev_uc_count(netdev);
+    mc_count = netdev_mc_count(netdev);
+
+    /*both tables in one DMA-able buffer, copied while the lists are stable */
+    buf = kzalloc(2 * sizeof(*uc_data) + (uc_count + mc_count) * ETH_ALEN, GFP_ATOMIC);
+    if(buf)
+    {
+        uc_data = buf;
+        uc_data->entries = cpu_to_virtio32(vdev, uc_count);
+        x = 0;
+        netdev_for_each_uc_addr(ha, netdev)
+            memcpy(uc_data->macs[x++], ha->addr, ETH_ALEN);
+
+        mc_data = buf + sizeof(*uc_data) + uc_count * ETH_ALEN;
+        mc_data->entries = cpu_to_virtio32(vdev, mc_count);
+        x = 0;
+        netdev_for_each_mc_addr(ha, netdev)
+            memcpy(mc_data->macs[x++], ha->addr, ETH_ALEN);
+    }
+    netif_addr_unlock_bh(netdev);
+
+    if(!vnet_dev->rx_flags_valid || ctrl->promisc != promisc || ctrl->allmulti != allmulti)
+    {
+        vnet_dev->rx_flags_valid = true;
+
+        ctrl->promisc = promisc;
+        sg_init_one(sg, &ctrl->promisc, sizeof(ctrl->promisc));
+        if(!virtio_net_send_command(vnet_dev, VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_RX_PROMISC, sg))
+        {
+            dev_warn(&vnet_dev->vpci_dev->pdev->dev, "Failed to %sable promisc mode\n", promisc ? "en" : "dis");
+            vnet_dev->rx_flags_valid = false;
+        }
+
+        ctrl->allmulti = allmulti;
+        sg_init_one(sg, &ctrl->allmulti, sizeof(ctrl->allmulti));
+        if(!virtio_net_send_command(vnet_dev, VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_RX_ALLMULTI, sg))
+        {
+            dev_warn(&vnet_dev->vpci_dev->pdev->dev, "Failed to %sable allmulti mode\n", allmulti ? "en" : "dis");
+            vnet_dev->rx_flags_valid = false;
+        }
+    }
+
+    if(!buf)
+    {
+        dev_warn(&vnet_dev->vpci_dev->pdev->dev, "No memory for the MAC filter tables\n");
+        goto out;
+    }
+
+    sg_init_table(sg, 2);
+    sg_set_buf(&sg[0], uc_data, sizeof(*uc_data) + uc_count * ETH_ALEN);
+    sg_set_buf(&sg[1], mc_data, sizeof(*mc_data) + mc_count * ETH_ALEN);
+    if(!virtio_net_send_command(vnet_dev, VIRTIO_NET_CTRL_MAC, VIRTIO_NET_CTRL_MAC_TABLE_SET, sg))
+        dev_warn(&vnet_dev->vpci_dev->pdev->dev, "Failed to set MAC filter (%u unicast, %u multicast)\n",
+                 uc_count, mc_count);
+
+    kfree(buf);
+out:
+    rtnl_unlock();
+}
+
+/*called with the address list lock held, no sleeping */
+static void virtio_net_set_rx_mode(struct net_device *dev)
+{
+    struct virtio_net_dev *vnet_dev = netdev_priv(dev);
+
+    if(virtio_net_has_feature(vnet_dev, VIRTIO_NET_F_CTRL_RX))
+        schedule_work(&vnet_dev->rx_mode_work);
+}
+
+static int virtio_net_push_vlan(struct virtio_net_dev *vnet_dev, u8 cmd, u16 vid)
+{
+    struct scatterlist sg;
+
+    vnet_dev->ctrl->vid = cpu_to_virtio16(&vnet_dev->vpci_dev->virtio_dev, vid);
+    sg_init_one(&sg, &vnet_dev->ctrl->vid, sizeof(vnet_dev->ctrl->vid));
+
+    if(!virtio_net_send_command(vnet_dev, VIRTIO_NET_CTRL_VLAN, cmd, &sg))
+    {
+        dev_warn(&vnet_dev->vpci_dev->pdev->dev, "Failed to %s VLAN %u\n",
+                 cmd == VIRTIO_NET_CTRL_VLAN_ADD ? "add" : "remove", vid);
+        return -EIO;
+    }
+    return 0;
+}
+
+/*the VLAN bitmap is the driver's copy of the device's filter table */
+static int virtio_net_vlan_rx_add_vid(struct net_device *dev, __be16 proto, u16 vid)
+{
+    struct virtio_net_dev *vnet_dev = netdev_priv(dev);
+    int ret;
+
+    if(vnet_dev->filters_enabled)
+    {
+        ret = virtio_net_push_vlan(vnet_dev, VIRTIO_NET_CTRL_VLAN_ADD, vid);
+        if(ret)
+            return ret;
+    }
+
+    set_bit(vid, vnet_dev->vlans);
+    return 0;
+}
+
+static int virtio_net_vlan_rx_kill_vid(struct net_device *dev, __be16 proto, u16 vid)
+{
+    struct virtio_net_dev *vnet_dev = netdev_priv(dev);
+
+    /*a stale entry only lets frames through that the stack then drops */
+    clear_bit(vid, vnet_dev->vlans);
+    if(vnet_dev->filters_enabled)
+        virtio_net_push_vlan(vnet_dev, VIRTIO_NET_CTRL_VLAN_DEL, vid);
     return 0;
 }
 
-int virtio_net_stop(struct net_device *dev)
+static int virtio_net_push_mac(struct virtio_net_dev *vnet_dev, const u8 *addr)
 {
-    /*get private data attahced to net_device */
-    struct virtio_net_dev *vnet_dev = netdev_priv(dev);
-    struct virtio_pci_dev *vpci_dev = vnet_dev->vpci_dev;
+    struct scatterlist sg;
 
-    /*select queue and enable */
-    /*RX queue*/
-    iowrite16(VIRTIO_NET_QUEUE_RX, &vpci_dev->common_cfg->queue_select);
-    iowrite16(VIRTIO_VIRTQUEUE_DISABLE, &vpci_dev->common_cfg->queue_enable);
-   
-    /*TX queue*/
-    iowrite16(VIRTIO_NET_QUEUE_TX, &vpci_dev->common_cfg->queue_select);
-    iowrite16(VIRTIO_VIRTQUEUE_DISABLE, &vpci_dev->common_cfg->queue_enable);
+    memcpy(vnet_dev->ctrl->mac, addr, ETH_ALEN);
+    sg_init_one(&sg, vnet_dev->ctrl->mac, ETH_ALEN);
 
-    /*enable CTRL queue (if it exists)*/
-    if(vpci_dev->vqs[VIRTIO_NET_QUEUE_CTRL])
+    if(!virtio_net_send_command(vnet_dev, VIRTIO_NET_CTRL_MAC, VIRTIO_NET_CTRL_MAC_ADDR_SET, &sg))
     {
-        iowrite16(VIRTIO_NET_QUEUE_CTRL, &vpci_dev->common_cfg->queue_select);
-        iowrite16(VIRTIO_VIRTQUEUE_DISABLE, &vpci_dev->common_cfg->queue_enable);
+        dev_warn(&vnet_dev->vpci_dev->pdev->dev, "Failed to set MAC address %pM\n", addr);
+        return -EIO;
     }
-    netif_stop_queue(dev);
     return 0;
 }
 
-netdev_tx_t virtio_net_xmit(struct sk_buff *skb, struct net_device *dev)
+/*the config space MAC is read-only with VERSION_1, CTRL_MAC_ADDR is the
+ * only way to change the device's primary address */
+static int virtio_net_set_mac_address(struct net_device *dev, void *p)
 {
     struct virtio_net_dev *vnet_dev = netdev_priv(dev);
-    struct virtio_pci_dev *vpci_dev = vnet_dev->vpci_dev;
-    struct virtqueue *vq = vpci_dev->vqs[VIRTIO_NET_QUEUE_TX]; /*transimit virtqueue */
-    struct scatterlist sg[1];
+    struct sockaddr *addr = p;
     int ret;
 
-    sg_init_one(sg, skb->data, skb->len); 
+    if(!virtio_net_has_feature(vnet_dev, VIRTIO_NET_F_CTRL_MAC_ADDR))
+        return -EOPNOTSUPP;
 
-    /*add buffer to TX queue */
-    ret = virtqueue_add_outbuf(vq, sg, 1, skb, GFP_ATOMIC);
+    ret = eth_prepare_mac_addr_change(dev, p);
     if(ret)
+        return ret;
+
+    if(vnet_dev->filters_enabled)
     {
-        dev_kfree_skb(skb);
-        dev->stats.tx_dropped++;
-        /*inform newrking stack that device is temporary full or unavailable
-         * networking stack stops sending packets*/
-        return NETDEV_TX_BUSY; /* Fixed typo: NETDEV_TX_BUSY */
+        ret = virtio_net_push_mac(vnet_dev, addr->sa_data);
+        if(ret)
+            return ret;
     }
 
-    /*notify device */
-    iowrite16(VIRTIO_NET_QUEUE_TX, &vpci_dev->common_cfg->queue_select);
+    eth_commit_mac_addr_change(dev, p);
+    return 0;
+}
 
-    /*read device notification offset in . BAR + notify_off */
-    u16 notify_off = le16_to_cpu(ioread16(&vpci_dev->common_cfg->queue_notify_off));
-    u32 multiplier = le32_to_cpu(ioread32(&vpci_dev->notify_cap->notify_off_multiplier)); 
+/*after DRIVER_OK, at probe and on resume: the device starts out with its
+ * own defaults, give it the primary MAC, every VLAN and the RX mode. RTNL */
+static void virtio_net_sync_filters(struct virtio_net_dev *vnet_dev)
+{
+    u16 vid;
 
-    void __iomem *notify_addr = (void __iomem *)(vpci_dev->notify_cap->cap.offset + notify_off * multiplier); 
+    ASSERT_RTNL();
 
-    /*write queue index to notification address */
-    iowrite16(VIRTIO_NET_QUEUE_TX, notify_addr);
-   
-    dev_kfree_skb(skb);
-    dev->stats.tx_packets++;
-    dev->stats.tx_bytes += skb->len;
+    vnet_dev->filters_enabled = true;
+    vnet_dev->rx_flags_valid = false;
 
-    return NETDEV_TX_OK; 
+    if(virtio_net_has_feature(vnet_dev, VIRTIO_NET_F_CTRL_MAC_ADDR))
+        virtio_net_push_mac(vnet_dev, vnet_dev->netdev->dev_addr);
+
+    if(virtio_net_has_feature(vnet_dev, VIRTIO_NET_F_CTRL_VLAN))
+        for_each_set_bit(vid, vnet_dev->vlans, VLAN_N_VID)
+            virtio_net_push_vlan(vnet_dev, VIRTIO_NET_CTRL_VLAN_ADD, vid);
+
+    if(virtio_net_has_feature(vnet_dev, VIRTIO_NET_F_CTRL_RX))
+        schedule_work(&vnet_dev->rx_mode_work);
+}
+
+/*stop pushing filters: the device is being reset or removed. Called
+ * without RTNL, rx_mode_work takes it */
+static void virtio_net_disable_filters(struct virtio_net_dev *vnet_dev)
+{
+    rtnl_lock();
+    vnet_dev->filters_enabled = false;
+    rtnl_unlock();
+    cancel_work_sync(&vnet_dev->rx_mode_work);
 }
 
 static const struct net_device_ops virtio_netdev_ops = {
     .ndo_open = virtio_net_open,
     .ndo_stop = virtio_net_stop,
     .ndo_start_xmit = virtio_net_xmit,
+    .ndo_select_queue = virtio_net_select_queue,
+    .ndo_change_mtu = virtio_net_change_mtu,
+    .ndo_set_rx_mode = virtio_net_set_rx_mode,
+    .ndo_set_mac_address = virtio_net_set_mac_address,
+    .ndo_validate_addr = eth_validate_addr,
+    .ndo_vlan_rx_add_vid = virtio_net_vlan_rx_add_vid,
+    .ndo_vlan_rx_kill_vid = virtio_net_vlan_rx_kill_vid,
 };
 
-/*recieve packet */
-
-void virtio_net_receive(struct virtqueue *vq)
+/*re-read the config space fields we cache. retried until config_generation
+ * is stable so status and mtu come from the same snapshot */
+static void virtio_net_read_config(struct virtio_net_dev *vnet_dev, u16 *status, u16 *mtu)
 {
-    struct virtio_net_dev *vnet_dev = vq->vdev->priv;  // get your net device
     struct virtio_pci_dev *vpci_dev = vnet_dev->vpci_dev;
-    struct sk_buff *skb;
-    void *buf;
-    unsigned len;
+    struct virtio_net_config __iomem *net_cfg = vpci_dev->device_cfg;
+    u8 gen;
+
+    do {
+        gen = ioread8(&vpci_dev->common_cfg->config_generation);
+
+        *status = VIRTIO_NET_S_LINK_UP;
+        if(virtio_net_has_feature(vnet_dev, VIRTIO_NET_F_STATUS))
+            *status = le16_to_cpu(ioread16(&net_cfg->status));
+
+        *mtu = 0;
+        if(virtio_net_has_feature(vnet_dev, VIRTIO_NET_F_MTU))
+            *mtu = le16_to_cpu(ioread16(&net_cfg->mtu));
+    } while(gen != ioread8(&vpci_dev->common_cfg->config_generation));
+}
+
+static void virtio_net_config_work(struct work_struct *work)
+{
+    struct virtio_net_dev *vnet_dev = container_of(work, struct virtio_net_dev, config_work);
+    struct net_device *netdev = vnet_dev->netdev;
+    u16 status, mtu;
+
+    virtio_net_read_config(vnet_dev, &status, &mtu);
+
+    rtnl_lock();
+
+    /*small buffers were sized at init, they cannot follow a raise */
+    if(vnet_dev->rx_mode == VIRTIO_NET_RX_SMALL)
+        mtu = min_t(u16, mtu, VIRTIO_NET_RX_MAX_BUF_LEN - VIRTIO_NET_RX_BUF_LEN(0));
+
+    /*host changed the maximum mtu, clamp ours to follow it */
+    if(mtu >= ETH_MIN_MTU && mtu != netdev->max_mtu)
+    {
+        netdev->max_mtu = mtu;
+        if(netdev->mtu > mtu)
+            dev_set_mtu(netdev, mtu);
+    }
+
+    /*host asks us to announce ourselves after migration/failover:
+     * send gratuitous ARP / unsolicited NA, then ack through the ctrl queue */
+    if(status & VIRTIO_NET_S_ANNOUNCE)
+    {
+        __netdev_notify_peers(netdev);
+        if(!virtio_net_send_command(vnet_dev, VIRTIO_NET_CTRL_ANNOUNCE,
+                                    VIRTIO_NET_CTRL_ANNOUNCE_ACK, NULL))
+            dev_warn(&vnet_dev->vpci_dev->pdev->dev, "Failed to ack link announce\n");
+    }
 
-    while ((buf = virtqueue_get_buf(vq, &len)) != NULL)
+    status &= VIRTIO_NET_S_LINK_UP;
+    if(vnet_dev->status != status)
     {
-        skb = netdev_alloc_skb(vnet_dev->netdev, len);
-        if (!skb)
+        vnet_dev->status = status;
+        if(status & VIRTIO_NET_S_LINK_UP)
         {
-            vnet_dev->netdev->stats.rx_dropped++;
-            continue;
+            netif_carrier_on(netdev);
+            netif_tx_wake_all_queues(netdev);
+        }
+        else
+        {
+            netif_carrier_off(netdev);
+            netif_tx_stop_all_queues(netdev);
         }
+    }
+
+    rtnl_unlock();
+}
 
-        void *dst_addr = skb_put(skb, len);
-        memcpy(dst_addr, buf, len);
+/*called from the transport's hard IRQ on a config change interrupt,
+ * only defers the actual work */
+void virtio_net_config_changed(struct virtio_pci_dev *vpci_dev)
+{
+    struct virtio_net_dev *vnet_dev = vpci_dev->drv_priv;
+    unsigned long flags;
+
+    if(!vnet_dev)
+        return;
+
+    spin_lock_irqsave(&vnet_dev->config_lock, flags);
+    if(vnet_dev->config_enabled)
+        schedule_work(&vnet_dev->config_work);
+    spin_unlock_irqrestore(&vnet_dev->config_lock, flags);
+}
+
+static void virtio_net_config_disable(struct virtio_net_dev *vnet_dev)
+{
+    spin_lock_irq(&vnet_dev->config_lock);
+    vnet_dev->config_enabled = false;
+    spin_unlock_irq(&vnet_dev->config_lock);
+
+    cancel_work_sync(&vnet_dev->config_work);
+}
 
-        skb->protocol = eth_type_trans(skb, vnet_dev->netdev);
-        netif_rx(skb);
+/*debugfs: <debugfs>/virtio-drivers/<pci name>/net/latency_hist
+ * write 1/0 to start/stop sampling, read to dump the per-queue histograms */
 
-        struct scatterlist sg[1];
-        sg_init_one(sg, buf, len);
-        virtqueue_add_inbuf(vq, sg, 1, buf, GFP_ATOMIC);
+static void virtio_net_hist_show(struct seq_file *m, const char *name, u16 qp,
+                                 const struct virtio_net_hist *hist)
+{
+    int x;
+
+    seq_printf(m, "%s%u:\n", name, qp);
+    for(x = 0; x < VIRTIO_NET_HIST_BUCKETS; x++)
+    {
+        if(!hist->buckets[x])
+            continue;
+        seq_printf(m, "  %12llu ns: %llu\n", 1ULL << x, hist->buckets[x]);
     }
 }
 
-/*
-void virtio_net_receive(struct virtio_net_dev *vnet_dev) 
+static int virtio_net_latency_hist_show(struct seq_file *m, void *unused)
 {
-    struct virtio_pci_dev *vpci_dev = vnet_dev->vpci_dev;
-    struct virtqueue *vq = vpci_dev->vqs[VIRTIO_NET_QUEUE_RX];
-    struct sk_buff *skb;
-    void *buf;
-    unsigned len;
+    struct virtio_net_dev *vnet_dev = m->private;
+    int x;
 
-    //vq : virtqueue we are chcking 
-    //&len : ptr to len of data written 
-    while((buf = virtqueue_get_buf(vq, &len)) != NULL)
+    seq_printf(m, "enabled: %d\n", READ_ONCE(vnet_dev->hist_enabled));
+    for(x = 0; x < vnet_dev->max_queue_pairs; x++)
+        virtio_net_hist_show(m, "tx_enqueue_to_completion_", x, &vnet_dev->sq[x].completion);
+    for(x = 0; x < vnet_dev->max_queue_pairs; x++)
+        virtio_net_hist_show(m, "rx_irq_to_poll_", x, &vnet_dev->rq[x].irq_to_poll);
+
+    return 0;
+}
+
+static int virtio_net_latency_hist_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, virtio_net_latency_hist_show, inode->i_private);
+}
+
+static void virtio_net_hist_enable(struct virtio_net_dev *vnet_dev, bool enable)
+{
+    if(vnet_dev->hist_enabled == enable)
+        return;
+
+    if(enable)
     {
-        /*allocate new socket buffer 
-        skb = netdev_alloc_skb(vnet_dev->netdev, len);
-        if(!skb)
+        int x;
+
+        /*start from a clean slate */
+        for(x = 0; x < vnet_dev->max_queue_pairs; x++)
         {
-            vnet_dev->netdev->stats.rx_dropped++;
-            continue;
+            memset(&vnet_dev->sq[x].completion, 0, sizeof(vnet_dev->sq[x].completion));
+            memset(&vnet_dev->rq[x].irq_to_poll, 0, sizeof(vnet_dev->rq[x].irq_to_poll));
+            vnet_dev->rq[x].irq_ns = 0;
         }
+        static_branch_inc(&virtio_net_hist_key);
+    }
+
+    WRITE_ONCE(vnet_dev->hist_enabled, enable);
+
+    if(!enable)
+        static_branch_dec(&virtio_net_hist_key);
+}
+
+static ssize_t virtio_net_latency_hist_write(struct file *file, const char __user *ubuf,
+                                             size_t count, loff_t *ppos)
+{
+    struct virtio_net_dev *vnet_dev = file_inode(file)->i_private;
+    bool enable;
+    int ret;
+
+    ret = kstrtobool_from_user(ubuf, count, &enable);
+    if(ret)
+        return ret;
+
+    rtnl_lock();
+    virtio_net_hist_enable(vnet_dev, enable);
+    rtnl_unlock();
+
+    return count;
+}
+
+static const struct file_operations virtio_net_latency_hist_fops = {
+    .owner = THIS_MODULE,
+    .open = virtio_net_latency_hist_open,
+    .read = seq_read,
+    .write = virtio_net_latency_hist_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static void virtio_net_debugfs_init(struct virtio_net_dev *vnet_dev)
+{
+    vnet_dev->debugfs_dir = debugfs_create_dir("net", vnet_dev->vpci_dev->debugfs_dir);
+    debugfs_create_file("latency_hist", 0600, vnet_dev->debugfs_dir, vnet_dev,
+                        &virtio_net_latency_hist_fops);
+}
+
+static void virtio_net_debugfs_exit(struct virtio_net_dev *vnet_dev)
+{
+    debugfs_remove_recursive(vnet_dev->debugfs_dir);
+    vnet_dev->debugfs_dir = NULL;
+
+    rtnl_lock();
+    virtio_net_hist_enable(vnet_dev, false);
+    rtnl_unlock();
+}
+
+/*memory footprint in /sys/class/net/<dev>/virtio_mem/, all in bytes and
+ * approximate: RX buffers are counted by posted descriptors, pages parked in
+ * the page_pool caches are not */
+static unsigned long virtio_net_rx_buffer_bytes(struct virtio_net_dev *vnet_dev)
+{
+    unsigned long bytes = 0;
+    int x;
+
+    for(x = 0; x < vnet_dev->max_queue_pairs; x++)
+    {
+        struct virtio_net_rq *rq = &vnet_dev->rq[x];
+        unsigned int posted = virtio_net_rx_posted(rq);
 
-        void *dst_addr = skb_put(skb, len); 
-        memcpy(dst_addr, buf, len);
+        if(vnet_dev->rx_mode == VIRTIO_NET_RX_BIG)
+            bytes += (unsigned long)posted * PAGE_SIZE +
+                     rq->vq->num_max * (sizeof(*rq->big) + sizeof(*rq->big_free));
+        else
+            bytes += (unsigned long)posted * VIRTIO_NET_RX_TRUESIZE(READ_ONCE(rq->buf_len));
+    }
+    return bytes;
+}
 
-        skb->protocol = eth_type_trans(skb, vnet_dev->netdev);
+static unsigned long virtio_net_tx_arena_bytes(struct virtio_net_dev *vnet_dev)
+{
+    unsigned long bytes = 0;
+    int x;
 
-        /*hand over to kernel network stack 
-        netif_rx(skb);
+    for(x = 0; x < vnet_dev->max_queue_pairs; x++)
+    {
+        struct virtio_net_sq *sq = &vnet_dev->sq[x];
 
-        /*re-add buffer to RX queue 
-        struct scatterlist sg[1];
-        sg_init_one(sg, buf, len);
-        virtqueue_add_inbuf(vq, sg, 1, buf, GFP_ATOMIC); 
+        bytes += sq->nr_slots * (sizeof(*sq->hdr_arena) + sizeof(*sq->free_slots));
+        if(sq->tx_map)
+            bytes += sq->nr_slots * sizeof(*sq->tx_map);
     }
+    return bytes;
+}
+
+static ssize_t ring_bytes_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct virtio_net_dev *vnet_dev = netdev_priv(to_net_dev(dev));
+
+    return sysfs_emit(buf, "%lu\n", virtio_pci_ring_bytes(vnet_dev->vpci_dev));
+}
+static DEVICE_ATTR_RO(ring_bytes);
+
+static ssize_t rx_buffer_bytes_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct virtio_net_dev *vnet_dev = netdev_priv(to_net_dev(dev));
+
+    return sysfs_emit(buf, "%lu\n", virtio_net_rx_buffer_bytes(vnet_dev));
+}
+static DEVICE_ATTR_RO(rx_buffer_bytes);
+
+static ssize_t tx_arena_bytes_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct virtio_net_dev *vnet_dev = netdev_priv(to_net_dev(dev));
+
+    return sysfs_emit(buf, "%lu\n", virtio_net_tx_arena_bytes(vnet_dev));
+}
+static DEVICE_ATTR_RO(tx_arena_bytes);
+
+static ssize_t total_bytes_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct virtio_net_dev *vnet_dev = netdev_priv(to_net_dev(dev));
+
+    return sysfs_emit(buf, "%lu\n", virtio_pci_ring_bytes(vnet_dev->vpci_dev) +
+                      virtio_net_rx_buffer_bytes(vnet_dev) + virtio_net_tx_arena_bytes(vnet_dev));
 }
-*/ 
+static DEVICE_ATTR_RO(total_bytes);
+
+static struct attribute *virtio_net_mem_attrs[] = {
+    &dev_attr_ring_bytes.attr,
+    &dev_attr_rx_buffer_bytes.attr,
+    &dev_attr_tx_arena_bytes.attr,
+    &dev_attr_total_bytes.attr,
+    NULL,
+};
+
+static const struct attribute_group virtio_net_mem_group = {
+    .name = "virtio_mem",
+    .attrs = virtio_net_mem_attrs,
+};
+
 /*initialize virtio-net device */
 int virtio_net_init(struct virtio_pci_dev *vpci_dev)
 {
     struct virtio_net_dev *vnet_dev;
     struct net_device *netdev;
     struct virtio_net_config *net_cfg = (struct virtio_net_config*)vpci_dev->device_cfg;
+    u16 max_queue_pairs = virtio_net_read_max_pairs(vpci_dev);
     int ret;
+    int x;
 
-    /*allocate network device */
-    netdev = alloc_etherdev(sizeof(struct virtio_net_dev));
+    /*allocate network device, one TX/RX queue per queue pair */
+    netdev = alloc_etherdev_mq(sizeof(struct virtio_net_dev), max_queue_pairs);
     if(!netdev)
     {
         dev_err(&vpci_dev->pdev->dev, "Failed to allocate net device\n");
@@ -191,83 +2757,446 @@ int virtio_net_init(struct virtio_pci_dev *vpci_dev)
     vnet_dev = netdev_priv(netdev); 
     vnet_dev->vpci_dev = vpci_dev;
     vnet_dev->netdev = netdev;
+    vnet_dev->max_queue_pairs = max_queue_pairs;
+
+    /*the device starts out on the first pair only, virtio_net_ready
+     * spreads traffic once the control queue may be used */
+    vnet_dev->curr_queue_pairs = 1;
+    vnet_dev->autoscale = autoscale && max_queue_pairs > 1;
+    netif_set_real_num_tx_queues(netdev, 1);
+    netif_set_real_num_rx_queues(netdev, 1);
+
+    INIT_WORK(&vnet_dev->config_work, virtio_net_config_work);
+    INIT_WORK(&vnet_dev->xps_work, virtio_net_xps_work);
+    INIT_DELAYED_WORK(&vnet_dev->scale_work, virtio_net_scale_work);
+    INIT_WORK(&vnet_dev->rx_mode_work, virtio_net_rx_mode_work);
+    INIT_DELAYED_WORK(&vnet_dev->refill_work, virtio_net_refill_work);
+    INIT_DELAYED_WORK(&vnet_dev->idle_work, virtio_net_idle_work);
+    spin_lock_init(&vnet_dev->config_lock);
+    spin_lock_init(&vnet_dev->pool_lock);
+    mutex_init(&vnet_dev->cvq_lock);
+
+    /*control queue (if negotiated)*/
+    if(virtio_net_has_feature(vnet_dev, VIRTIO_NET_F_CTRL_VQ))
+    {
+        vnet_dev->cvq = vpci_dev->vqs[VIRTIO_NET_CTRL_VQ(max_queue_pairs)];
+        vnet_dev->ctrl = kzalloc(sizeof(*vnet_dev->ctrl), GFP_KERNEL);
+        if(!vnet_dev->ctrl)
+        {
+            ret = -ENOMEM;
+            goto err_free_netdev;
+        }
+    }
+
+    vnet_dev->cpu_pair = kcalloc(nr_cpu_ids, sizeof(*vnet_dev->cpu_pair), GFP_KERNEL);
+    if(!vnet_dev->cpu_pair)
+    {
+        ret = -ENOMEM;
+        goto err_free_ctrl;
+    }
+
+    /*per RX queue state, one NAPI instance (and napi id) per queue */
+    vnet_dev->rq = kcalloc(vnet_dev->max_queue_pairs, sizeof(*vnet_dev->rq), GFP_KERNEL);
+    if(!vnet_dev->rq)
+    {
+        ret = -ENOMEM;
+        goto err_free_cpu_pair;
+    }
+
+    /*per TX queue state */
+    vnet_dev->sq = kcalloc(vnet_dev->max_queue_pairs, sizeof(*vnet_dev->sq), GFP_KERNEL);
+    if(!vnet_dev->sq)
+    {
+        ret = -ENOMEM;
+        goto err_free_rq;
+    }
+
+    for(x = 0; x < vnet_dev->max_queue_pairs; x++)
+    {
+        struct virtio_net_rq *rq = &vnet_dev->rq[x];
+
+        rq->vq = vpci_dev->vqs[VIRTIO_NET_RXQ_VQ(x)];
+        rq->vnet_dev = vnet_dev;
+        rq->qp = x;
+        rq->node = cpu_to_node(virtio_net_vq_cpu(vpci_dev, VIRTIO_NET_RXQ_VQ(x)));
+        rq->irq = -1;
+        rq->polled = virtio_net_pair_polled(x);
+        rq->poll_cpu = virtio_net_vq_cpu(vpci_dev, VIRTIO_NET_RXQ_VQ(x));
+        init_waitqueue_head(&rq->poll_wq);
+        INIT_DELAYED_WORK(&rq->rehome_work, virtio_net_rehome_work);
+        u64_stats_init(&rq->stats.syncp);
+        netif_napi_add(netdev, &rq->napi, virtio_net_poll);
+    }
+
+    for(x = 0; x < vnet_dev->max_queue_pairs; x++)
+    {
+        vnet_dev->sq[x].vq = vpci_dev->vqs[VIRTIO_NET_TXQ_VQ(x)];
+        vnet_dev->sq[x].vnet_dev = vnet_dev;
+        vnet_dev->sq[x].qp = x;
+        vnet_dev->sq[x].node = vnet_dev->rq[x].node;
+        vnet_dev->sq[x].irq = -1;
+        vnet_dev->sq[x].polled = vnet_dev->rq[x].polled;
+        u64_stats_init(&vnet_dev->sq[x].stats.syncp);
+    }
 
     /*set network device ops*/
     netdev->netdev_ops = &virtio_netdev_ops;
+    netdev->ethtool_ops = &virtio_net_ethtool_ops;
+
+    /*room to push the virtio_net_hdr in front of the frame (ANY_LAYOUT) */
+    if(virtio_net_has_feature(vnet_dev, VIRTIO_F_ANY_LAYOUT))
+        netdev->needed_headroom = VIRTIO_NET_HDR_LEN;
 
     /*set mac*/
     memcpy(netdev->dev_addr, net_cfg->mac, ETH_ALEN);
     netdev->addr_len = ETH_ALEN;
 
-    /*set mtu (if supported)*/
+    /*set mtu (if supported), jumbo frames up to 64KB otherwise */
+    netdev->max_mtu = VIRTIO_NET_MAX_MTU;
     if(vpci_dev->guest_features & (1ULL << VIRTIO_NET_F_MTU))
     {
         u16 mtu = le16_to_cpu(ioread16(&net_cfg->mtu));
         if(mtu)
+        {
             netdev->mtu = mtu;
+            netdev->max_mtu = mtu;
+        }
     }
 
-    /*register network device */
-    ret = register_netdev(netdev);
-    if(ret)
+    /*RX buffer layout depends on max_mtu */
+    vnet_dev->rx_mode = virtio_net_pick_rx_mode(vnet_dev);
+    for(x = 0; x < vnet_dev->max_queue_pairs; x++)
+        vnet_dev->rq[x].buf_len = virtio_net_rx_buf_len(vnet_dev, netdev->mtu);
+
+    /*low_mem caps how much of each ring is ever filled and only starts at
+     * the low watermark, the rest is allocated as traffic shows up */
+    vnet_dev->low_mem = low_mem;
+    for(x = 0; x < vnet_dev->max_queue_pairs; x++)
     {
-        dev_err(&vpci_dev->pdev->dev, "Failed to register network device: %d\n", ret); 
-        free_netdev(netdev);
-        return ret;
+        vnet_dev->rq[x].fill_max = low_mem ? VIRTIO_NET_LOWMEM_FILL : UINT_MAX;
+        vnet_dev->rq[x].fill_low = low_mem ? VIRTIO_NET_LOWMEM_FILL_LOW : UINT_MAX;
+    }
+
+    if(virtio_net_has_feature(vnet_dev, VIRTIO_NET_F_GUEST_CSUM))
+        netdev->features |= NETIF_F_RXCSUM;
+
+    /*the device drops frames of VLANs the stack never added */
+    if(virtio_net_has_feature(vnet_dev, VIRTIO_NET_F_CTRL_VLAN))
+        netdev->features |= NETIF_F_HW_VLAN_CTAG_FILTER;
+
+    if(virtio_net_has_feature(vnet_dev, VIRTIO_NET_F_CTRL_MAC_ADDR))
+        netdev->priv_flags |= IFF_LIVE_ADDR_CHANGE;
+
+    /*secondary unicast addresses go to the device's table instead of
+     * turning on promisc mode */
+    if(virtio_net_has_feature(vnet_dev, VIRTIO_NET_F_CTRL_RX))
+        netdev->priv_flags |= IFF_UNICAST_FLT;
+
+    /*link state is only known with VIRTIO_NET_F_STATUS, assume up otherwise.
+     * the initial config_work run below picks up the real state */
+    if(virtio_net_has_feature(vnet_dev, VIRTIO_NET_F_STATUS))
+        netif_carrier_off(netdev);
+    else
+    {
+        vnet_dev->status = VIRTIO_NET_S_LINK_UP;
+        netif_carrier_on(netdev);
     }
 
-    /*pre-allocate RX buffer*/
-    struct virtqueue *rx_vq = vpci_dev->vqs[VIRTIO_NET_QUEUE_RX]; 
+    /*TX header arenas, before anything is queued on the TX rings */
+    for(x = 0; x < vnet_dev->max_queue_pairs; x++)
+    {
+        ret = virtio_net_tx_arena_init(&vnet_dev->sq[x]);
+        if(ret)
+        {
+            dev_err(&vpci_dev->pdev->dev, "Failed to allocate TX header arena: %d\n", ret);
+            goto err_free_buffers;
+        }
+    }
 
-    for(int x = 0; x < virtqueue_get_vring_size(rx_vq); ++x)
+    /*pre-allocate RX buffers*/
+    for(x = 0; x < vnet_dev->max_queue_pairs; x++)
     {
-        struct scatterlist sg[1];
-        void *buf = kmalloc(ETH_FRAME_LEN, GFP_KERNEL);
-        if(!buf)
+        ret = virtio_net_create_page_pool(&vnet_dev->rq[x]);
+        if(ret)
         {
-            ret = -ENOMEM;
-            goto err_unregister_netdev;
+            dev_err(&vpci_dev->pdev->dev, "Failed to create RX page pool: %d\n", ret);
+            goto err_free_buffers;
+        }
+
+        if(vnet_dev->rx_mode == VIRTIO_NET_RX_BIG)
+        {
+            ret = virtio_net_alloc_rx_big(&vnet_dev->rq[x]);
+            if(ret)
+                goto err_free_buffers;
         }
-        sg_init_one(sg, buf, ETH_FRAME_LEN);
-        ret = virtqueue_add_inbuf(rx_vq, sg, 1, buf, GFP_KERNEL);
+
+        ret = virtio_net_fill_rx_to(&vnet_dev->rq[x], vnet_dev->rq[x].fill_low, GFP_KERNEL);
         if(ret)
         {
-            kfree(buf);
             dev_err(&vpci_dev->pdev->dev, "Failed to add RX buffer: %d\n", ret); 
             goto err_free_buffers;
         }
     }
 
+    vpci_dev->drv_priv = vnet_dev;
+
+    netdev->sysfs_groups[0] = &virtio_net_mem_group;
+
+    /*register network device */
+    ret = register_netdev(netdev);
+    if(ret)
+    {
+        dev_err(&vpci_dev->pdev->dev, "Failed to register network device: %d\n", ret); 
+        goto err_clear_priv;
+    }
+
+    virtio_net_setup_affinity(vnet_dev);
+
+    virtio_net_poll_start(vnet_dev);
+
+    ret = cpuhp_state_add_instance_nocalls(virtio_net_online_state, &vnet_dev->cpuhp_node);
+    if(ret)
+        dev_warn(&vpci_dev->pdev->dev, "XPS map will not follow CPU hotplug: %d\n", ret);
+
+    /*threaded NAPI can also be toggled later through /sys/class/net/<dev>/threaded */
+    if(napi_threaded)
+    {
+        rtnl_lock();
+        ret = dev_set_threaded(netdev, true);
+        rtnl_unlock();
+        if(ret)
+            dev_warn(&vpci_dev->pdev->dev, "Failed to enable threaded NAPI: %d\n", ret);
+        for(x = 0; x < vnet_dev->max_queue_pairs; x++)
+            if(vnet_dev->rq[x].irq >= 0)
+                virtio_net_pin_napi_thread(&vnet_dev->rq[x], irq_get_affinity_mask(vnet_dev->rq[x].irq));
+    }
+
+    virtio_net_debugfs_init(vnet_dev);
+
+    if(vnet_dev->low_mem && virtio_net_has_feature(vnet_dev, VIRTIO_F_RING_RESET))
+        schedule_delayed_work(&vnet_dev->idle_work, msecs_to_jiffies(VIRTIO_NET_LOWMEM_IDLE_MS));
+
+    /*start handling config change interrupts and read initial link state */
+    vnet_dev->config_enabled = true;
+    if(virtio_net_has_feature(vnet_dev, VIRTIO_NET_F_STATUS))
+        schedule_work(&vnet_dev->config_work);
+
+    /*autoscale weighs pairs by the cycles they spend */
+    if(vnet_dev->autoscale)
+        static_branch_inc(&virtio_net_cycles_key);
+
+    virtio_net_bench_init(vnet_dev);
+
     dev_info(&vpci_dev->pdev->dev, "virtio-net initialized, MAC: %pM\n", netdev->dev_addr);
 
     return 0;
 
+err_clear_priv:
+    vpci_dev->drv_priv = NULL;
 err_free_buffers:
+    for(x = 0; x < vnet_dev->max_queue_pairs; x++)
     {
-        void *buf; 
-        while((buf = virtqueue_get_buf(rx_vq, NULL)) != NULL)
-            kfree(buf);
+        if(vnet_dev->rq[x].page_pool)
+        {
+            virtio_net_free_rx(&vnet_dev->rq[x]);
+            virtio_net_free_rx_big(&vnet_dev->rq[x]);
+            if(!vnet_dev->rq[x].pool_shared)
+                page_pool_destroy(vnet_dev->rq[x].page_pool);
+        }
+        netif_napi_del(&vnet_dev->rq[x].napi);
+        virtio_net_tx_arena_free(&vnet_dev->sq[x]);
     }
-err_unregister_netdev:
-    unregister_netdev(netdev);
+    if(vnet_dev->shared_pool)
+        page_pool_destroy(vnet_dev->shared_pool);
+    kfree(vnet_dev->sq);
+err_free_rq:
+    kfree(vnet_dev->rq);
+err_free_cpu_pair:
+    kfree(vnet_dev->cpu_pair);
+err_free_ctrl:
+    kfree(vnet_dev->ctrl);
+err_free_netdev:
     free_netdev(netdev);
     return ret;
 }
 
+/*called by virtio-pci once DRIVER_OK is set: one pair per online CPU,
+ * as far as the device has them. With autoscale that is only the ceiling,
+ * the device starts on a single pair and grows with the load */
+void virtio_net_ready(struct virtio_net_dev *vnet_dev)
+{
+    u16 pairs;
+
+    if(!vnet_dev)
+        return;
+
+    rtnl_lock();
+    if(vnet_dev->cvq)
+        virtio_net_sync_filters(vnet_dev);
+
+    vnet_dev->scale_max = min_t(u16, vnet_dev->max_queue_pairs, num_online_cpus());
+    pairs = vnet_dev->autoscale ? 1 : vnet_dev->scale_max;
+    if(virtio_net_set_queues(vnet_dev, pairs))
+        virtio_net_set_xps(vnet_dev);
+    rtnl_unlock();
+
+    virtio_net_scale_start(vnet_dev);
+}
+
 /*cleanup viriot-net device */
 void virtio_net_exit(struct virtio_net_dev *vnet_dev)
 {
     struct virtio_pci_dev *vpci_dev = vnet_dev->vpci_dev;
-    struct virtqueue *rx_vq = vpci_dev->vqs[VIRTIO_NET_QUEUE_RX];
-    void *buf;
-
-    /*stop network device */
-    netif_stop_queue(vnet_dev->netdev);
+    int x;
 
-    /*free RX buffers */
-    while((buf = virtqueue_get_buf(rx_vq, NULL)) != NULL)
-        kfree(buf);
+    /*no more config work once we start tearing down */
+    virtio_net_config_disable(vnet_dev);
+    virtio_net_debugfs_exit(vnet_dev);
+    cancel_delayed_work_sync(&vnet_dev->idle_work);
+    cancel_delayed_work_sync(&vnet_dev->scale_work);
+    cpuhp_state_remove_instance_nocalls(virtio_net_online_state, &vnet_dev->cpuhp_node);
+    virtio_net_poll_stop(vnet_dev);
+    virtio_net_disable_filters(vnet_dev);
 
+    /*stop network device, this also disables NAPI through ndo_stop */
     unregister_netdev(vnet_dev->netdev);
+    virtio_net_bench_exit(vnet_dev);
+    if(vnet_dev->autoscale)
+        static_branch_dec(&virtio_net_cycles_key);
+
+    /*no affinity notifier is left to schedule xps_work after this */
+    virtio_net_clear_affinity(vnet_dev);
+    cancel_work_sync(&vnet_dev->xps_work);
+    /*closing the device on unregister may have scheduled it once more */
+    cancel_work_sync(&vnet_dev->rx_mode_work);
+
+    vpci_dev->drv_priv = NULL;
+
+    /*reset before reclaiming buffers so the device can't still DMA into them */
+    virtio_pci_reset_device(vpci_dev);
+
+    /*free RX buffers and any skbs still queued for TX */
+    for(x = 0; x < vnet_dev->max_queue_pairs; x++)
+    {
+        virtio_net_free_tx(&vnet_dev->sq[x]);
+        virtio_net_tx_arena_free(&vnet_dev->sq[x]);
+        virtio_net_free_rx(&vnet_dev->rq[x]);
+        virtio_net_free_rx_big(&vnet_dev->rq[x]);
+        netif_napi_del(&vnet_dev->rq[x].napi);
+        if(!vnet_dev->rq[x].pool_shared)
+            page_pool_destroy(vnet_dev->rq[x].page_pool);
+    }
+    if(vnet_dev->shared_pool)
+        page_pool_destroy(vnet_dev->shared_pool);
+
+    kfree(vnet_dev->sq);
+    kfree(vnet_dev->rq);
+    kfree(vnet_dev->cpu_pair);
+    kfree(vnet_dev->ctrl);
     free_netdev(vnet_dev->netdev);
 }
+
+/*PM: the netdev, page pools, TX arenas and rings all survive a freeze.
+ * virtio-pci resets the device status after virtio_net_freeze, renegotiates
+ * the same features and calls virtio_net_restore, which reinitializes the
+ * rings in place and refills RX from the pools; virtio_net_resume brings
+ * the interface back once DRIVER_OK is set */
+
+/*ctrl buffers live in vnet_dev->ctrl and are never left on the ring */
+static void virtio_net_ctrl_recycle(struct virtqueue *vq, void *buf)
+{
+}
+
+void virtio_net_freeze(struct virtio_net_dev *vnet_dev)
+{
+    struct net_device *netdev = vnet_dev->netdev;
+
+    virtio_net_config_disable(vnet_dev);
+    cancel_delayed_work_sync(&vnet_dev->idle_work);
+    cancel_delayed_work_sync(&vnet_dev->scale_work);
+    virtio_net_poll_stop(vnet_dev);
+    virtio_net_disable_filters(vnet_dev);
+
+    rtnl_lock();
+    netif_tx_lock_bh(netdev);
+    netif_device_detach(netdev);
+    netif_tx_unlock_bh(netdev);
+    if(netif_running(netdev))
+        virtio_net_stop(netdev);
+    rtnl_unlock();
+
+    cancel_delayed_work_sync(&vnet_dev->refill_work);
+}
+
+/*called with the device reset and the features renegotiated, before
+ * DRIVER_OK. Whatever was still posted goes back to the pools (RX) or is
+ * dropped (TX), the rings restart empty on the same memory */
+int virtio_net_restore(struct virtio_net_dev *vnet_dev)
+{
+    int ret;
+    int x;
+
+    for(x = 0; x < vnet_dev->max_queue_pairs; x++)
+    {
+        struct virtio_net_rq *rq = &vnet_dev->rq[x];
+
+        ret = virtqueue_reset(vnet_dev->sq[x].vq, virtio_net_tx_recycle);
+        if(ret)
+            return ret;
+
+        ret = virtqueue_reset(rq->vq, virtio_net_rx_recycle);
+        if(ret)
+            return ret;
+
+        /*page_pool hands back the pages it just got, nothing is reallocated */
+        ret = virtio_net_fill_rx_to(rq, rq->fill_low, GFP_KERNEL);
+        if(ret)
+            return ret;
+        rq->idle_packets = u64_stats_read(&rq->stats.packets);
+    }
+
+    if(vnet_dev->cvq)
+    {
+        ret = virtqueue_reset(vnet_dev->cvq, virtio_net_ctrl_recycle);
+        if(ret)
+            return ret;
+    }
+    return 0;
+}
+
+/*after DRIVER_OK: reopen, reattach and recheck the link */
+void virtio_net_resume(struct virtio_net_dev *vnet_dev)
+{
+    struct net_device *netdev = vnet_dev->netdev;
+    int x;
+
+    rtnl_lock();
+    if(vnet_dev->cvq)
+        virtio_net_sync_filters(vnet_dev);
+
+    /*the reset put the device back on a single pair */
+    if(vnet_dev->curr_queue_pairs > 1 && virtio_net_set_queues(vnet_dev, vnet_dev->curr_queue_pairs))
+        virtio_net_set_queues(vnet_dev, 1);
+    if(netif_running(netdev))
+        virtio_net_open(netdev);
+    netif_tx_lock_bh(netdev);
+    netif_device_attach(netdev);
+    netif_tx_unlock_bh(netdev);
+    rtnl_unlock();
+
+    /*RX buffers are posted but the device only looks after a kick */
+    for(x = 0; x < vnet_dev->max_queue_pairs; x++)
+        virtqueue_kick(vnet_dev->rq[x].vq);
+
+    spin_lock_irq(&vnet_dev->config_lock);
+    vnet_dev->config_enabled = true;
+    spin_unlock_irq(&vnet_dev->config_lock);
+    if(virtio_net_has_feature(vnet_dev, VIRTIO_NET_F_STATUS))
+        schedule_work(&vnet_dev->config_work);
+
+    if(vnet_dev->low_mem && virtio_net_has_feature(vnet_dev, VIRTIO_F_RING_RESET))
+        schedule_delayed_work(&vnet_dev->idle_work, msecs_to_jiffies(VIRTIO_NET_LOWMEM_IDLE_MS));
+
+    virtio_net_scale_start(vnet_dev);
+    virtio_net_poll_start(vnet_dev);
+}
@@ -5,21 +5,386 @@
 #include <linux/virtio.h>
 #include <linux/virtio_net.h>      // provides struct virtio_net_config, feature bits, etc.
 #include <linux/netdevice.h>
+#include <linux/if_vlan.h>
+#include <linux/workqueue.h>
+#include <linux/mutex.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/interrupt.h>
+#include <linux/jump_label.h>
+#include <linux/timex.h>
+#include <net/page_pool/types.h>
 #include "virtio_pci.h"            // your wrapper for PCI-specific structures
 
+/* features the virtio-net driver is willing to accept */
+#define VIRTIO_NET_DRIVER_FEATURES  (BIT_ULL(VIRTIO_NET_F_MAC) | \
+                                     BIT_ULL(VIRTIO_NET_F_MTU) | \
+                                     BIT_ULL(VIRTIO_NET_F_STATUS) | \
+                                     BIT_ULL(VIRTIO_NET_F_CTRL_VQ) | \
+                                     BIT_ULL(VIRTIO_NET_F_MQ) | \
+                                     BIT_ULL(VIRTIO_NET_F_CTRL_RX) | \
+                                     BIT_ULL(VIRTIO_NET_F_CTRL_VLAN) | \
+                                     BIT_ULL(VIRTIO_NET_F_CTRL_MAC_ADDR) | \
+                                     BIT_ULL(VIRTIO_NET_F_GUEST_ANNOUNCE) | \
+                                     BIT_ULL(VIRTIO_NET_F_MRG_RXBUF) | \
+                                     BIT_ULL(VIRTIO_NET_F_GUEST_CSUM) | \
+                                     BIT_ULL(VIRTIO_NET_F_GUEST_TSO4) | \
+                                     BIT_ULL(VIRTIO_NET_F_GUEST_TSO6) | \
+                                     BIT_ULL(VIRTIO_NET_F_GUEST_ECN) | \
+                                     BIT_ULL(VIRTIO_F_ANY_LAYOUT))
+
+/* control virtqueue command/ack buffers, kept out of the netdev
+ * private area so they are always DMA-able */
+struct virtio_net_ctrl {
+    struct virtio_net_ctrl_hdr hdr;
+    virtio_net_ctrl_ack status;
+    struct virtio_net_ctrl_mq mq;
+    u8 promisc;
+    u8 allmulti;
+    __virtio16 vid;
+    u8 mac[ETH_ALEN];
+};
+
+/* VERSION_1 devices always use the mergeable header layout */
+#define VIRTIO_NET_HDR_LEN          sizeof(struct virtio_net_hdr_mrg_rxbuf)
+
+/* largest MTU we can receive, in big mode also the size of a GSO frame */
+#define VIRTIO_NET_MAX_MTU          65535
+
+/* bytes of an RX buffer the device may write for a given MTU */
+#define VIRTIO_NET_RX_BUF_LEN(mtu)  (VIRTIO_NET_HDR_LEN + ETH_HLEN + VLAN_HLEN + (mtu))
+
+/* small/mergeable RX buffers are page_pool fragments laid out for build_skb():
+ * headroom | virtio_net_hdr + frame | skb_shared_info */
+#define VIRTIO_NET_RX_HEADROOM      NET_SKB_PAD
+#define VIRTIO_NET_RX_TRUESIZE(len) (SKB_DATA_ALIGN(VIRTIO_NET_RX_HEADROOM + (len)) + \
+                                     SKB_DATA_ALIGN(sizeof(struct skb_shared_info)))
+/* ... and never larger than a page */
+#define VIRTIO_NET_RX_MAX_BUF_LEN   (SKB_WITH_OVERHEAD(PAGE_SIZE) - VIRTIO_NET_RX_HEADROOM)
+
+/* big mode: one buffer is a chain of whole pages holding a 64KB frame */
+#define VIRTIO_NET_BIG_MAX_PAGES    DIV_ROUND_UP(VIRTIO_NET_RX_BUF_LEN(VIRTIO_NET_MAX_MTU), PAGE_SIZE)
+
+/* big mode copies this much of the frame into the skb head, the rest
+ * stays in the pages as fragments */
+#define VIRTIO_NET_RX_COPY_LEN      128
+
+/* low_mem profile: each RX queue keeps at most FILL descriptors posted,
+ * tops up only once fewer than FILL_LOW are left and is trimmed back to
+ * FILL_LOW after IDLE_MS without traffic */
+#define VIRTIO_NET_LOWMEM_FILL      64
+#define VIRTIO_NET_LOWMEM_FILL_LOW  16
+#define VIRTIO_NET_LOWMEM_IDLE_MS   10000
+
+/* autoscale: every SCALE_MS the active pair count is re-evaluated from the
+ * packet rate and the share of cycles spent in NAPI poll and xmit per pair.
+ * A pair above either UP threshold grows the count at once, to what the
+ * total load needs; it only shrinks, one pair at a time, after SCALE_CALM
+ * samples in a row in which the load fits under the DOWN thresholds with a
+ * pair less */
+#define VIRTIO_NET_SCALE_MS         1000
+#define VIRTIO_NET_SCALE_UP_PCT     50
+#define VIRTIO_NET_SCALE_UP_PPS     100000
+#define VIRTIO_NET_SCALE_DOWN_PCT   20
+#define VIRTIO_NET_SCALE_DOWN_PPS   25000
+#define VIRTIO_NET_SCALE_CALM       10
+
+/* RX buffer layout, picked once at init from the negotiated features and
+ * the largest MTU the device allows */
+enum virtio_net_rx_mode {
+    VIRTIO_NET_RX_SMALL,               /* one fragment per frame */
+    VIRTIO_NET_RX_MERGEABLE,           /* MRG_RXBUF: frame spread over num_buffers fragments */
+    VIRTIO_NET_RX_BIG,                 /* page chains, GUEST_TSO or jumbo MTU without MRG_RXBUF */
+};
+
+/* used RX entries pulled off the ring per harvest, prefetched as a group
+ * before any of them is turned into an skb; completed TX skbs collected
+ * per reclaim pass the same way */
+#define VIRTIO_NET_RX_BATCH         16
+#define VIRTIO_NET_TX_BATCH         64
+
+struct virtio_net_rx_batch {
+    unsigned int head;                 /* next entry to hand out */
+    unsigned int count;
+    void *buf[VIRTIO_NET_RX_BATCH];
+    void *ctx[VIRTIO_NET_RX_BATCH];
+    unsigned int len[VIRTIO_NET_RX_BATCH];
+};
+
+/* big mode RX buffer, also the token; one per ring entry */
+struct virtio_net_rx_big {
+    unsigned int nr_pages;
+    struct page *pages[VIRTIO_NET_BIG_MAX_PAGES];
+};
+
+/* virtqueue index <-> queue pair mapping: rx0, tx0, rx1, tx1, ..., ctrl */
+#define VIRTIO_NET_RXQ_VQ(qp)       ((qp) * 2)
+#define VIRTIO_NET_TXQ_VQ(qp)       ((qp) * 2 + 1)
+#define VIRTIO_NET_VQ_QP(index)     ((index) / 2)
+#define VIRTIO_NET_CTRL_VQ(max_qp)  ((max_qp) * 2)
+
+/* log2(ns) latency histogram, bucket n counts samples in [2^n, 2^(n+1)) ns */
+#define VIRTIO_NET_HIST_BUCKETS     32
+
+struct virtio_net_hist {
+    u64 buckets[VIRTIO_NET_HIST_BUCKETS];
+};
+
+/* TX bookkeeping kept in skb->cb while the skb sits in the ring */
+struct virtio_net_skb_cb {
+    u64 enqueue_ns;                    /* only set while histograms are on */
+    u16 slot;                          /* header arena slot */
+};
+
+/* header arena entry, one per TX ring slot; cacheline-sized so headers of
+ * neighbouring packets never share a line the device is reading */
+struct virtio_net_tx_hdr {
+    struct virtio_net_hdr_mrg_rxbuf hdr;
+} ____cacheline_aligned;
+
+/* premapped TX: payload mappings of the packet in a header arena slot,
+ * [0] is the linear part, [1 + n] fragment n */
+struct virtio_net_tx_map {
+    dma_addr_t addr[MAX_SKB_FRAGS + 1];
+};
+
+#define VIRTIO_NET_SKB_CB(skb)      ((struct virtio_net_skb_cb *)(skb)->cb)
+
+struct virtio_net_rq_stats {
+    struct u64_stats_sync syncp;
+    u64_stats_t packets;
+    u64_stats_t bytes;
+    u64_stats_t drops;
+    u64_stats_t kicks;
+    u64_stats_t interrupts;            /* vq callbacks taken */
+    u64_stats_t cycles;                /* get_cycles() spent in NAPI poll */
+    u64_stats_t busy_polls;            /* polls run from napi_busy_loop */
+    u64_stats_t busy_poll_hits;        /* ... that found at least one packet */
+};
+
+struct virtio_net_sq_stats {
+    struct u64_stats_sync syncp;
+    u64_stats_t packets;
+    u64_stats_t bytes;
+    u64_stats_t drops;
+    u64_stats_t kicks;
+    u64_stats_t cycles;                /* get_cycles() spent in ndo_start_xmit */
+};
+
+/* per RX queue state */
+struct virtio_net_rq {
+    struct virtqueue *vq;
+    struct napi_struct napi;
+    struct virtio_net_dev *vnet_dev;
+    u16 qp;
+    int node;                          /* of the CPU the queue's vector is affine to */
+    struct virtio_net_rq_stats stats;
+
+    /* pages are DMA-mapped once by the pool; with premapped set the ring
+     * takes those addresses as-is instead of mapping every buffer */
+    struct page_pool *page_pool;
+    bool premapped;
+    bool pool_shared;                  /* low_mem: one pool for all queues, no direct recycling */
+
+    /* posted descriptors: refill once below fill_low, up to fill_max
+     * (both UINT_MAX, i.e. the ring size, unless low_mem is set) */
+    unsigned int fill_max;
+    unsigned int fill_low;
+    u64 idle_packets;                  /* low_mem: packet count at the last idle check */
+
+    /* autoscale: RX + TX packets and cycles of the pair at the last sample */
+    u64 scale_packets;
+    u64 scale_cycles;
+
+    /* bytes the device may write per buffer, follows the MTU. Small and
+     * mergeable buffers carry their own length as ctx, so changing this
+     * only affects buffers posted from then on */
+    unsigned int buf_len;
+
+    /* only non-empty inside NAPI poll */
+    struct virtio_net_rx_batch batch;
+
+    /* big mode: page chains, one per ring entry */
+    struct virtio_net_rx_big *big;
+    u16 *big_free;                     /* stack of unused entries */
+    u16 nr_big_free;
+
+    u64 irq_ns;                        /* last callback, for irq_to_poll */
+    struct virtio_net_hist irq_to_poll;
+
+    /* MSI-X vector of the queue (-1 on a shared vector); the threaded
+     * NAPI kthread follows its affinity through affinity_notify */
+    int irq;
+    struct irq_affinity_notify affinity_notify;
+    struct delayed_work rehome_work;   /* follows node after an affinity change */
+
+    /* poll mode: the pair has no callbacks and therefore no vectors, a
+     * kthread pinned to poll_cpu schedules its NAPI instead */
+    bool polled;
+    int poll_cpu;
+    struct task_struct *poll_thread;
+    wait_queue_head_t poll_wq;         /* the thread waits here while the interface is down */
+    unsigned long poll_work;           /* RX + TX done since the thread last looked */
+} ____cacheline_aligned_in_smp;
+
+/* per TX queue state */
+struct virtio_net_sq {
+    struct virtqueue *vq;
+    struct virtio_net_dev *vnet_dev;
+    u16 qp;
+    int node;                          /* same as the RX queue of the pair */
+    int irq;                           /* MSI-X vector, kept on the RX vector's CPU */
+    bool polled;                       /* same as the RX queue of the pair */
+    struct virtio_net_sq_stats stats;
+    struct scatterlist sg[MAX_SKB_FRAGS + 2];
+
+    /* every packet in the ring owns an arena slot; its header is used when
+     * the header cannot be pushed into the skb headroom (ANY_LAYOUT). In
+     * premapped mode (ring uses the DMA API) the arena is coherent and only
+     * payload is mapped per packet */
+    bool premapped;
+    struct device *dma_dev;
+    struct virtio_net_tx_hdr *hdr_arena;
+    dma_addr_t hdr_arena_dma;          /* premapped only */
+    struct virtio_net_tx_map *tx_map;  /* per slot, premapped only */
+    u16 *free_slots;                   /* stack of unused slots */
+    u16 nr_free_slots;
+    u16 nr_slots;
+
+    /* completed skbs pulled off the ring before any is released */
+    struct sk_buff *reclaim[VIRTIO_NET_TX_BATCH];
+
+    struct virtio_net_hist completion;  /* enqueue -> reclaimed */
+} ____cacheline_aligned_in_smp;
+
+/* loopback benchmark (virtio_net_bench.c): counters of the benchmarked
+ * pair before and after the last run */
+struct virtio_net_bench_sample {
+    u64 tx_packets;
+    u64 tx_cycles;
+    u64 tx_kicks;
+    u64 tx_interrupts;
+    u64 rx_packets;
+    u64 rx_cycles;
+    u64 rx_kicks;
+    u64 rx_interrupts;
+};
+
+struct virtio_net_bench {
+    struct dentry *dir;
+    struct mutex lock;                 /* one run at a time, guards the result */
+    unsigned int len;                  /* frame length, or GSO packet payload */
+    unsigned int frames;               /* frames per packet, 1 unless GSO */
+    u16 qp;
+    int ret;
+    u64 packets;                       /* packets handed to the driver */
+    u64 tx_ns;
+    struct virtio_net_bench_sample start;
+    struct virtio_net_bench_sample end;
+};
+
 /* Wrapper struct for your virtio-net device */
 struct virtio_net_dev {
     struct virtio_pci_dev *vpci_dev;   /* PCI device */
     struct net_device *netdev;         /* Linux net_device */
+
+    struct virtio_net_rq *rq;          /* max_queue_pairs entries */
+    enum virtio_net_rx_mode rx_mode;
+    struct virtio_net_sq *sq;          /* max_queue_pairs entries */
+    u16 max_queue_pairs;
+    u16 curr_queue_pairs;              /* pairs the device steers traffic to (MQ) */
+
+    /* XPS: each CPU transmits on the pair whose vectors are affine to it.
+     * Recomputed on affinity changes, CPU hotplug and queue count changes */
+    struct work_struct xps_work;
+    struct hlist_node cpuhp_node;
+    u16 *cpu_pair;                     /* nr_cpu_ids entries, pair of each online CPU */
+
+    /* autoscale: curr_queue_pairs moves between 1 and scale_max, which is
+     * one pair per CPU or what ethtool -L last asked for */
+    bool autoscale;
+    u16 scale_max;
+    unsigned int scale_calm;           /* samples in a row that would allow a shrink */
+    unsigned long scale_jiffies;       /* time of the last sample ... */
+    cycles_t scale_cycles;             /* ... and the same in cycles */
+    struct delayed_work scale_work;
+
+    struct virtqueue *cvq;             /* control queue (NULL without CTRL_VQ) */
+    struct virtio_net_ctrl *ctrl;
+    struct mutex cvq_lock;             /* serializes control commands */
+
+    /* RX filters kept in the device (CTRL_RX, CTRL_VLAN, CTRL_MAC_ADDR).
+     * Only pushed while filters_enabled (after DRIVER_OK, not frozen),
+     * virtio_net_sync_filters replays them when it gets set. RTNL */
+    bool filters_enabled;
+    bool rx_flags_valid;               /* ctrl->promisc/allmulti match the device */
+    unsigned long vlans[BITS_TO_LONGS(VLAN_N_VID)];
+    struct work_struct rx_mode_work;   /* ndo_set_rx_mode runs atomic, defers here */
+
+    /* config change handling; the IRQ only schedules config_work */
+    struct work_struct config_work;
+    spinlock_t config_lock;
+    bool config_enabled;
+
+    u16 status;                        /* cached virtio_net_config.status */
+
+    /* RX refill after GFP_ATOMIC failures in NAPI */
+    struct delayed_work refill_work;
+
+    /* low_mem profile */
+    bool low_mem;
+    struct page_pool *shared_pool;
+    spinlock_t pool_lock;              /* allocations from shared_pool */
+    struct delayed_work idle_work;     /* trims RX queues that went quiet */
+
+    struct dentry *debugfs_dir;
+    bool hist_enabled;                 /* holds a virtio_net_hist_key reference */
+
+    struct virtio_net_bench bench;
 };
 
+DECLARE_STATIC_KEY_FALSE(virtio_net_hist_key);
+DECLARE_STATIC_KEY_FALSE(virtio_net_cycles_key);
+
+/* latency histograms are off unless enabled through debugfs */
+static inline bool virtio_net_hist_on(struct virtio_net_dev *vnet_dev)
+{
+    return static_branch_unlikely(&virtio_net_hist_key) && READ_ONCE(vnet_dev->hist_enabled);
+}
+
+/* per-queue cycle accounting in xmit and poll costs two get_cycles() per
+ * call, only paid while autoscale or a benchmark run holds the key. 0
+ * means not counting */
+static inline cycles_t virtio_net_cycles_start(void)
+{
+    return static_branch_unlikely(&virtio_net_cycles_key) ? get_cycles() : 0;
+}
+
+static inline bool virtio_net_has_feature(struct virtio_net_dev *vnet_dev, unsigned int fbit)
+{
+    return vnet_dev->vpci_dev->guest_features & BIT_ULL(fbit);
+}
+
 /* Driver init and exit functions */
+int virtio_net_register(void);
+void virtio_net_unregister(void);
+int virtio_net_num_queues(struct virtio_pci_dev *vpci_dev);
+void virtio_net_vq_info(struct virtio_pci_dev *vpci_dev, unsigned int index,
+                        vq_callback_t **callback, const char **name, bool *ctx);
 int virtio_net_init(struct virtio_pci_dev *vpci_dev);
+void virtio_net_ready(struct virtio_net_dev *vnet_dev);
 void virtio_net_exit(struct virtio_net_dev *vnet_dev);
-int virtio_net_init(struct virtio_pci_dev *vpci_dev);
-void virtio_net_exit(struct virtio_net_dev *vnet_dev);
+int virtio_net_vq_cpu(struct virtio_pci_dev *vpci_dev, unsigned int index);
+void virtio_net_freeze(struct virtio_net_dev *vnet_dev);
+int virtio_net_restore(struct virtio_net_dev *vnet_dev);
+void virtio_net_resume(struct virtio_net_dev *vnet_dev);
 int virtio_net_open(struct net_device *dev);
 int virtio_net_stop(struct net_device *dev);
 netdev_tx_t virtio_net_xmit(struct sk_buff *skb, struct net_device *dev);
-void virtio_net_receive(struct virtqueue *vq);
+void virtio_net_rx_callback(struct virtqueue *vq);
+void virtio_net_tx_callback(struct virtqueue *vq);
+void virtio_net_config_changed(struct virtio_pci_dev *vpci_dev);
+bool virtio_net_send_command(struct virtio_net_dev *vnet_dev, u8 class, u8 cmd,
+                             struct scatterlist *out);
+void virtio_net_bench_init(struct virtio_net_dev *vnet_dev);
+void virtio_net_bench_exit(struct virtio_net_dev *vnet_dev);
 #endif /* VIRTIO_NET_DRIVER_H */
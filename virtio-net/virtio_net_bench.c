@@ -0,0 +1,334 @@
+#include <linux/module.h>
+#include <linux/netdevice.h>
+#include <linux/etherdevice.h>
+#include <linux/skbuff.h>
+#include <linux/ktime.h>
+#include <linux/delay.h>
+#include <linux/sched/signal.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include "virtio_net.h"
+
+/*loopback benchmark of the data path, <debugfs>/virtio-net-bench.<pci name>/bench.
+ *
+ * Writing "<len> <packets> [pair]" builds the frames in the kernel and hands
+ * them straight to virtio_net_xmit in xmit_more bursts, the way the qdisc
+ * layer would, with no socket or qdisc cost in between. The frames are
+ * addressed to the interface itself, so with a backend that loops them
+ * back (e.g. QEMU -netdev socket,udp=127.0.0.1:P,localaddr=127.0.0.1:P)
+ * they come in again through the RX interrupt and NAPI poll.
+ *
+ * <len> is the frame length handed to the driver. The driver offers no
+ * HOST_TSO, so a GSO packet reaches it already segmented by the stack;
+ * lengths above the MTU stand for that: the payload is cut into one burst
+ * of MTU-sized frames, counted as one packet. No GSO metadata is involved,
+ * the numbers are those of the software-segmented packet, e.g.
+ *
+ *   echo "64 1000000" > bench; echo "1500 1000000" > bench; echo "65536 20000" > bench
+ *
+ * Reading the file shows the last run: packets per second and the cycles,
+ * kicks and interrupts per packet of each direction, from the same
+ * counters ethtool -S and the virtio-pci vq_state files show. Results are only comparable between runs on
+ * the same host and backend. */
+
+/*frames per xmit_more burst for packets that fit the MTU */
+#define VIRTIO_NET_BENCH_BURST      32
+
+/*how long RX may stay quiet before the looped back frames count as done */
+#define VIRTIO_NET_BENCH_QUIET_MS   20
+#define VIRTIO_NET_BENCH_DRAIN_MS   1000
+
+static void virtio_net_bench_read(struct virtio_net_dev *vnet_dev, u16 qp,
+                                  struct virtio_net_bench_sample *s)
+{
+    struct virtio_net_sq *sq = &vnet_dev->sq[qp];
+    struct virtio_net_rq *rq = &vnet_dev->rq[qp];
+    struct virtio_pci_vq_info *tx_info = sq->vq->priv;
+
+    s->tx_packets = u64_stats_read(&sq->stats.packets);
+    s->tx_cycles = u64_stats_read(&sq->stats.cycles);
+    s->tx_kicks = u64_stats_read(&sq->stats.kicks);
+    /*TX completions are reclaimed from NAPI, the callback is only counted
+     * by the transport */
+    s->tx_interrupts = READ_ONCE(tx_info->interrupts);
+    s->rx_packets = u64_stats_read(&rq->stats.packets);
+    s->rx_cycles = u64_stats_read(&rq->stats.cycles);
+    s->rx_kicks = u64_stats_read(&rq->stats.kicks);
+    s->rx_interrupts = u64_stats_read(&rq->stats.interrupts);
+}
+
+static struct sk_buff *virtio_net_bench_alloc(struct net_device *dev, unsigned int len, u16 qp)
+{
+    struct sk_buff *skb;
+    struct ethhdr *eth;
+
+    skb = netdev_alloc_skb(dev, len);
+    if(!skb)
+        return NULL;
+
+    eth = skb_put_zero(skb, len);
+    ether_addr_copy(eth->h_dest, dev->dev_addr);
+    ether_addr_copy(eth->h_source, dev->dev_addr);
+    /*local experimental ethertype, the stack drops it right after the driver */
+    eth->h_proto = htons(ETH_P_802_EX1);
+
+    skb->protocol = eth->h_proto;
+    skb_set_queue_mapping(skb, qp);
+    return skb;
+}
+
+/*hand one burst to the driver, only the last frame goes without xmit_more.
+ * Waits whenever the queue is stopped or the driver pushes back, an skb it
+ * returned busy is still ours and is offered again */
+static int virtio_net_bench_xmit(struct net_device *dev, struct netdev_queue *txq,
+                                 struct sk_buff **skbs, unsigned int n)
+{
+    unsigned int sent = 0;
+
+    while(sent < n)
+    {
+        local_bh_disable();
+        __netif_tx_lock(txq, smp_processor_id());
+        while(sent < n && !netif_xmit_frozen_or_drv_stopped(txq))
+        {
+            if(!dev_xmit_complete(netdev_start_xmit(skbs[sent], dev, txq, sent + 1 < n)))
+                break;
+            sent++;
+        }
+        __netif_tx_unlock(txq);
+        local_bh_enable();
+
+        if(sent == n)
+            break;
+
+        if(!netif_running(dev) || fatal_signal_pending(current))
+        {
+            while(sent < n)
+                kfree_skb(skbs[sent++]);
+            return netif_running(dev) ? -EINTR : -ENETDOWN;
+        }
+        cond_resched();
+    }
+
+    return 0;
+}
+
+/*wait for the looped back frames, until RX has been quiet for a while */
+static void virtio_net_bench_drain(struct virtio_net_dev *vnet_dev, u16 qp)
+{
+    struct virtio_net_rq *rq = &vnet_dev->rq[qp];
+    unsigned long deadline = jiffies + msecs_to_jiffies(VIRTIO_NET_BENCH_DRAIN_MS);
+    u64 last = u64_stats_read(&rq->stats.packets);
+
+    while(time_before(jiffies, deadline))
+    {
+        u64 now;
+
+        msleep(VIRTIO_NET_BENCH_QUIET_MS);
+        now = u64_stats_read(&rq->stats.packets);
+        if(now == last)
+            break;
+        last = now;
+    }
+}
+
+static int virtio_net_bench_run(struct virtio_net_dev *vnet_dev, unsigned int len, u64 packets, u16 qp)
+{
+    struct virtio_net_bench *bench = &vnet_dev->bench;
+    struct net_device *dev = vnet_dev->netdev;
+    struct netdev_queue *txq = netdev_get_tx_queue(dev, qp);
+    unsigned int frame_len = len;
+    unsigned int frames = VIRTIO_NET_BENCH_BURST;
+    unsigned int last_len = len;
+    struct sk_buff **skbs;
+    u64 done = 0;
+    u64 start_ns;
+    int ret = 0;
+
+    /*software-segmented GSO packet: payload cut into MTU-sized frames,
+     * one burst per packet */
+    if(len > dev->mtu + ETH_HLEN)
+    {
+        frame_len = dev->mtu + ETH_HLEN;
+        frames = DIV_ROUND_UP(len, dev->mtu);
+        last_len = max_t(unsigned int, len - (frames - 1) * dev->mtu + ETH_HLEN, ETH_ZLEN);
+    }
+
+    skbs = kcalloc(frames, sizeof(*skbs), GFP_KERNEL);
+    if(!skbs)
+        return -ENOMEM;
+
+    /*xmit and poll only count cycles while the key is held */
+    static_branch_inc(&virtio_net_cycles_key);
+
+    virtio_net_bench_read(vnet_dev, qp, &bench->start);
+    start_ns = ktime_get_ns();
+
+    while(done < packets)
+    {
+        unsigned int n = frames;
+        unsigned int x;
+
+        if(fatal_signal_pending(current))
+        {
+            ret = -EINTR;
+            break;
+        }
+
+        /*plain frames go VIRTIO_NET_BENCH_BURST packets at a time */
+        if(len == frame_len)
+            n = min_t(u64, frames, packets - done);
+
+        for(x = 0; x < n; x++)
+        {
+            skbs[x] = virtio_net_bench_alloc(dev, x + 1 < n ? frame_len : last_len, qp);
+            if(!skbs[x])
+                break;
+        }
+        if(x < n)
+        {
+            while(x)
+                kfree_skb(skbs[--x]);
+            ret = -ENOMEM;
+            break;
+        }
+
+        ret = virtio_net_bench_xmit(dev, txq, skbs, n);
+        if(ret)
+            break;
+
+        done += len == frame_len ? n : 1;
+        cond_resched();
+    }
+
+    bench->tx_ns = ktime_get_ns() - start_ns;
+    virtio_net_bench_drain(vnet_dev, qp);
+    virtio_net_bench_read(vnet_dev, qp, &bench->end);
+    static_branch_dec(&virtio_net_cycles_key);
+
+    bench->len = len;
+    bench->frames = len == frame_len ? 1 : frames;
+    bench->packets = done;
+    bench->qp = qp;
+    bench->ret = ret;
+
+    kfree(skbs);
+    return ret;
+}
+
+/*x / packets with three decimals */
+static void virtio_net_bench_show_ratio(struct seq_file *m, const char *name, u64 x, u64 packets)
+{
+    u64 milli = packets ? div64_u64(x * 1000, packets) : 0;
+    u32 frac;
+    u64 whole = div_u64_rem(milli, 1000, &frac);
+
+    seq_printf(m, "%-26s %llu.%03u\n", name, whole, frac);
+}
+
+static int virtio_net_bench_show(struct seq_file *m, void *unused)
+{
+    struct virtio_net_dev *vnet_dev = m->private;
+    struct virtio_net_bench *bench = &vnet_dev->bench;
+    struct virtio_net_bench_sample *s = &bench->start;
+    struct virtio_net_bench_sample *e = &bench->end;
+    u64 rx_packets;
+
+    mutex_lock(&bench->lock);
+    if(!bench->packets && !bench->ret)
+    {
+        seq_puts(m, "no run yet, write \"<len> <packets> [pair]\"\n");
+        goto out;
+    }
+
+    /*a received frame is one segment of a sent packet */
+    rx_packets = div_u64(e->rx_packets - s->rx_packets, bench->frames);
+
+    seq_printf(m, "%-26s %u\n", "len:", bench->len);
+    if(bench->frames > 1)
+        seq_printf(m, "%-26s %u MTU-sized frames, segmented in software\n", "gso:", bench->frames);
+    seq_printf(m, "%-26s %u\n", "pair:", bench->qp);
+    seq_printf(m, "%-26s %d\n", "status:", bench->ret);
+    seq_printf(m, "%-26s %llu\n", "tx_packets:", bench->packets);
+    seq_printf(m, "%-26s %llu\n", "tx_ns:", bench->tx_ns);
+    seq_printf(m, "%-26s %llu\n", "tx_pps:",
+               bench->tx_ns ? div64_u64(bench->packets * NSEC_PER_SEC, bench->tx_ns) : 0);
+    virtio_net_bench_show_ratio(m, "tx_cycles_per_packet:", e->tx_cycles - s->tx_cycles, bench->packets);
+    virtio_net_bench_show_ratio(m, "tx_kicks_per_packet:", e->tx_kicks - s->tx_kicks, bench->packets);
+    virtio_net_bench_show_ratio(m, "tx_interrupts_per_packet:",
+                                e->tx_interrupts - s->tx_interrupts, bench->packets);
+    seq_printf(m, "%-26s %llu\n", "rx_packets:", rx_packets);
+    virtio_net_bench_show_ratio(m, "rx_cycles_per_packet:", e->rx_cycles - s->rx_cycles, rx_packets);
+    virtio_net_bench_show_ratio(m, "rx_kicks_per_packet:", e->rx_kicks - s->rx_kicks, rx_packets);
+    virtio_net_bench_show_ratio(m, "rx_interrupts_per_packet:",
+                                e->rx_interrupts - s->rx_interrupts, rx_packets);
+out:
+    mutex_unlock(&bench->lock);
+    return 0;
+}
+
+static int virtio_net_bench_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, virtio_net_bench_show, inode->i_private);
+}
+
+static ssize_t virtio_net_bench_write(struct file *file, const char __user *ubuf,
+                                      size_t count, loff_t *ppos)
+{
+    struct virtio_net_dev *vnet_dev = file_inode(file)->i_private;
+    struct net_device *dev = vnet_dev->netdev;
+    unsigned int len;
+    unsigned int qp = 0;
+    u64 packets;
+    char buf[64];
+    int ret;
+
+    if(count >= sizeof(buf))
+        return -EINVAL;
+    if(copy_from_user(buf, ubuf, count))
+        return -EFAULT;
+    buf[count] = '\0';
+
+    if(sscanf(buf, "%u %llu %u", &len, &packets, &qp) < 2)
+        return -EINVAL;
+    if(len < ETH_ZLEN || len > GSO_LEGACY_MAX_SIZE || !packets)
+        return -EINVAL;
+
+    if(!netif_running(dev) || !netif_carrier_ok(dev))
+        return -ENETDOWN;
+    if(qp >= dev->real_num_tx_queues)
+        return -EINVAL;
+
+    mutex_lock(&vnet_dev->bench.lock);
+    ret = virtio_net_bench_run(vnet_dev, len, packets, qp);
+    mutex_unlock(&vnet_dev->bench.lock);
+
+    return ret ? ret : count;
+}
+
+static const struct file_operations virtio_net_bench_fops = {
+    .owner = THIS_MODULE,
+    .open = virtio_net_bench_open,
+    .read = seq_read,
+    .write = virtio_net_bench_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+void virtio_net_bench_init(struct virtio_net_dev *vnet_dev)
+{
+    char name[48];
+
+    mutex_init(&vnet_dev->bench.lock);
+    snprintf(name, sizeof(name), "virtio-net-bench.%s", pci_name(vnet_dev->vpci_dev->pdev));
+    vnet_dev->bench.dir = debugfs_create_dir(name, NULL);
+    debugfs_create_file("bench", 0600, vnet_dev->bench.dir, vnet_dev, &virtio_net_bench_fops);
+}
+
+/*called after unregister_netdev: a run still in progress sees the queues
+ * stopped and the interface down, stops, and is waited for here */
+void virtio_net_bench_exit(struct virtio_net_dev *vnet_dev)
+{
+    debugfs_remove_recursive(vnet_dev->bench.dir);
+    vnet_dev->bench.dir = NULL;
+}
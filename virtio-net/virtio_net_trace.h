@@ -0,0 +1,142 @@
+/* virtio-net datapath tracepoints
+ *
+ * enable with e.g.
+ *   echo 1 > /sys/kernel/tracing/events/virtio_net/enable
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM virtio_net
+
+#if !defined(VIRTIO_NET_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define VIRTIO_NET_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* skb added to a TX ring */
+TRACE_EVENT(virtio_net_xmit_enqueue,
+    TP_PROTO(const struct net_device *dev, u16 qp, unsigned int len, unsigned int num_free),
+    TP_ARGS(dev, qp, len, num_free),
+    TP_STRUCT__entry(
+        __string(name, dev->name)
+        __field(u16, qp)
+        __field(unsigned int, len)
+        __field(unsigned int, num_free)
+    ),
+    TP_fast_assign(
+        __assign_str(name, dev->name);
+        __entry->qp = qp;
+        __entry->len = len;
+        __entry->num_free = num_free;
+    ),
+    TP_printk("dev=%s qp=%u len=%u num_free=%u",
+              __get_str(name), __entry->qp, __entry->len, __entry->num_free)
+);
+
+/* doorbell write to the device */
+TRACE_EVENT(virtio_net_kick,
+    TP_PROTO(const struct net_device *dev, unsigned int vq_index),
+    TP_ARGS(dev, vq_index),
+    TP_STRUCT__entry(
+        __string(name, dev->name)
+        __field(unsigned int, vq_index)
+    ),
+    TP_fast_assign(
+        __assign_str(name, dev->name);
+        __entry->vq_index = vq_index;
+    ),
+    TP_printk("dev=%s vq=%u", __get_str(name), __entry->vq_index)
+);
+
+/* TX buffers reclaimed from the used ring */
+TRACE_EVENT(virtio_net_tx_complete,
+    TP_PROTO(const struct net_device *dev, u16 qp, unsigned int packets, unsigned int bytes),
+    TP_ARGS(dev, qp, packets, bytes),
+    TP_STRUCT__entry(
+        __string(name, dev->name)
+        __field(u16, qp)
+        __field(unsigned int, packets)
+        __field(unsigned int, bytes)
+    ),
+    TP_fast_assign(
+        __assign_str(name, dev->name);
+        __entry->qp = qp;
+        __entry->packets = packets;
+        __entry->bytes = bytes;
+    ),
+    TP_printk("dev=%s qp=%u packets=%u bytes=%u",
+              __get_str(name), __entry->qp, __entry->packets, __entry->bytes)
+);
+
+/* virtqueue callback (hard IRQ) */
+TRACE_EVENT(virtio_net_interrupt,
+    TP_PROTO(const struct net_device *dev, unsigned int vq_index),
+    TP_ARGS(dev, vq_index),
+    TP_STRUCT__entry(
+        __string(name, dev->name)
+        __field(unsigned int, vq_index)
+    ),
+    TP_fast_assign(
+        __assign_str(name, dev->name);
+        __entry->vq_index = vq_index;
+    ),
+    TP_printk("dev=%s vq=%u", __get_str(name), __entry->vq_index)
+);
+
+TRACE_EVENT(virtio_net_poll_start,
+    TP_PROTO(const struct net_device *dev, u16 qp, int budget),
+    TP_ARGS(dev, qp, budget),
+    TP_STRUCT__entry(
+        __string(name, dev->name)
+        __field(u16, qp)
+        __field(int, budget)
+    ),
+    TP_fast_assign(
+        __assign_str(name, dev->name);
+        __entry->qp = qp;
+        __entry->budget = budget;
+    ),
+    TP_printk("dev=%s qp=%u budget=%d", __get_str(name), __entry->qp, __entry->budget)
+);
+
+TRACE_EVENT(virtio_net_poll_end,
+    TP_PROTO(const struct net_device *dev, u16 qp, int received),
+    TP_ARGS(dev, qp, received),
+    TP_STRUCT__entry(
+        __string(name, dev->name)
+        __field(u16, qp)
+        __field(int, received)
+    ),
+    TP_fast_assign(
+        __assign_str(name, dev->name);
+        __entry->qp = qp;
+        __entry->received = received;
+    ),
+    TP_printk("dev=%s qp=%u received=%d", __get_str(name), __entry->qp, __entry->received)
+);
+
+/* RX buffers posted back to the ring */
+TRACE_EVENT(virtio_net_rx_refill,
+    TP_PROTO(const struct net_device *dev, u16 qp, unsigned int count, unsigned int num_free),
+    TP_ARGS(dev, qp, count, num_free),
+    TP_STRUCT__entry(
+        __string(name, dev->name)
+        __field(u16, qp)
+        __field(unsigned int, count)
+        __field(unsigned int, num_free)
+    ),
+    TP_fast_assign(
+        __assign_str(name, dev->name);
+        __entry->qp = qp;
+        __entry->count = count;
+        __entry->num_free = num_free;
+    ),
+    TP_printk("dev=%s qp=%u count=%u num_free=%u",
+              __get_str(name), __entry->qp, __entry->count, __entry->num_free)
+);
+
+#endif /* VIRTIO_NET_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE virtio_net_trace
+#include <trace/define_trace.h>
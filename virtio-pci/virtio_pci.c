@@ -9,7 +9,15 @@
 #include <linux/dma-mapping.h> 
 #include <linux/virtio.h> 
 #include <linux/virtio_ids.h> 
+#include <linux/debugfs.h> 
+#include <linux/seq_file.h> 
+#include <linux/delay.h> 
+#include <linux/iopoll.h> 
+#include <linux/cpu.h> 
+#include <linux/workqueue.h> 
 #include "virtio_net.h"
+#include "virtio_vsock.h"
+#include "virtio_console.h"
 #include "virtio_pci.h"
 
 static void virtio_pci_get(struct virtio_device *vdev, unsigned offset, void *buf, unsigned int len);
@@ -21,29 +29,57 @@ static void virtio_pci_reset(struct virtio_device *vdev);
 static u64 virtio_pci_get_features(struct virtio_device *vdev);
 static void virtio_pci_set_features(struct virtio_device *vdev, u64 features);
 static int virtio_pci_finalize_features(struct virtio_device *vdev);
-static struct virtqueue *virtio_pci_setup_vq(struct virtio_device *vdev, unsigned int index, vq_callback_t *callback);
+static struct virtqueue *virtio_pci_setup_vq(struct virtio_device *vdev, unsigned int index, vq_callback_t *callback, bool ctx, u16 msix_vec);
+static int virtio_pci_activate_vq(struct virtio_pci_dev *vpci_dev, struct virtqueue *vq, u16 msix_vec);
+static int virtio_pci_disable_vq_and_reset(struct virtqueue *vq);
+static int virtio_pci_enable_vq_after_reset(struct virtqueue *vq);
 static void virtio_pci_del_vq(struct virtqueue *vq);
 static void virtio_pci_del_vqs(struct virtio_device *vdev);
 static int virtio_pci_find_vqs(struct virtio_device *vdev, unsigned nvqs, struct virtqueue *vqs[], vq_callback_t *callbacks[], const char *const names[], const bool *ctx, struct irq_affinity *desc);
 static bool virtio_pci_notify(struct virtqueue *vq);
+static bool virtio_pci_notify_with_data(struct virtqueue *vq);
 static int virtio_pci_map_common_cfg(struct virtio_pci_dev *vpci_dev, u8 pos);
 static int virtio_pci_map_notify_cfg(struct virtio_pci_dev *vpci_dev, u8 pos);
 static int virtio_pci_map_isr_cfg(struct virtio_pci_dev *vpci_dev, u8 pos);
 static int virtio_pci_map_device_cfg(struct virtio_pci_dev *vpci_dev, u8 pos);
 static irqreturn_t virtio_pci_interrupt(int irq, void *data);
+static irqreturn_t virtio_pci_config_interrupt(int irq, void *data);
+static irqreturn_t virtio_pci_vq_interrupt(int irq, void *data);
 static int virtio_pci_find_caps(struct virtio_pci_dev *vpci_dev);
+static void virtio_pci_unmap_caps(struct virtio_pci_dev *vpci_dev);
 static int virtio_pci_setup_interrupts(struct virtio_pci_dev *vpci_dev);
 static void virtio_pci_cleanup_interrupts(struct virtio_pci_dev *vpci_dev);
+static u64 virtio_pci_driver_features(struct virtio_pci_dev *vpci_dev);
 static int virtio_pci_enable_device(struct virtio_pci_dev *vpci_dev);
+static void virtio_pci_set_driver_ok(struct virtio_pci_dev *vpci_dev);
+static int virtio_pci_queue_count(struct virtio_pci_dev *vpci_dev);
+static void virtio_pci_queue_info(struct virtio_pci_dev *vpci_dev, unsigned int index, vq_callback_t **callback, const char **name, bool *ctx);
+static int virtio_pci_init_driver(struct virtio_pci_dev *vpci_dev);
+static void virtio_pci_exit_driver(struct virtio_pci_dev *vpci_dev);
 static int virtio_pci_probe(struct pci_dev *pdev, const struct pci_device_id *id);
 static void virtio_pci_remove(struct pci_dev *pdev);
+static int virtio_pci_freeze(struct device *dev);
+static int virtio_pci_restore(struct device *dev);
 
 static const struct pci_device_id virtio_pci_id_table[] = {
     {PCI_DEVICE(PCI_VENDOR_ID_VIRTIO, PCI_DEVICE_ID_VIRTIO_NET)}, 
+    {PCI_DEVICE(PCI_VENDOR_ID_VIRTIO, PCI_DEVICE_ID_VIRTIO_VSOCK)}, 
+    {PCI_DEVICE(PCI_VENDOR_ID_VIRTIO, PCI_DEVICE_ID_VIRTIO_CONSOLE)}, 
     {0}
 };
 MODULE_DEVICE_TABLE(pci, virtio_pci_id_table); 
 
+/*queue callbacks and names per device type, indexed by queue number;
+ * virtio-net and virtio-console have a variable queue count and compute
+ * them instead */ 
+static vq_callback_t *virtio_vsock_vq_callbacks[] = { 
+    virtio_vsock_rx_callback, virtio_vsock_tx_callback, virtio_vsock_event_callback 
+}; 
+static const char * const virtio_vsock_vq_names[] = { "rx", "tx", "event" }; 
+
+/*<debugfs>/virtio-drivers, one subdirectory per probed device */ 
+static struct dentry *virtio_pci_debugfs_root; 
+
 static void virtio_pci_get(struct virtio_device *vdev, unsigned offset, 
                            void *buf, unsigned int len)
 {
@@ -167,73 +203,54 @@ static int virtio_pci_finalize_features(struct virtio_device* vdev)
     return 0; 
 }
 
-/*
-static struct virtqueue *virtio_pci_setup_vq(struct virtio_device *vdev, unsigned int index,
-                                             void (*callback)(struct virtqueue *vq),
-                                             const char *name, bool ctx)
+/*vq->priv points at the queue's virtio_pci_vq_info, set up once in setup_vq */
+static bool virtio_pci_notify(struct virtqueue *vq)
 {
-    struct virtio_pci_dev *vpci_dev = vdev->priv; 
-    struct virtio_pci_common_cfg *cfg = vpci_dev->common_cfg; 
-    struct virtqueue *vq;
-    u64 addr; 
-    u16 msix_vector = VIRTIO_MSI_NO_VECTOR; 
-
-    iowrite16(index, &cfg->queue_select); 
-    if(ioread16(&cfg->queue_size) == 0)
-    {
-        dev_err(&vpci_dev->pdev->dev, "Queue %u has size 0\n", index); 
-        return ERR_PTR(-EINVAL); 
-    }
-
-    vq = vring_create_virtqueue(index, ioread16(&cfg->queue_size), 16,
-                                vdev, true, ctx, callback, name); 
+    struct virtio_pci_vq_info *info = vq->priv;
 
-    if(!vq)
-    {
-        dev_err(&vpci_dev->pdev->dev, "Failed to create virtqueue %u", index); 
-        return ERR_PTR(-ENOMEM); 
-    }
-
-    // write physical addr of virtqueue sections to approate common configurations fields 
-    addr = virt_to_phys(vq->desc); 
-    iowrite64(addr, &cfg->queue_desc); 
-    addr = virt_to_phys(vq->avail); 
-    iowrite64(addr, &cfg->queue_driver);
-    addr = virt_to_phys(vq->used); 
-    iowrite64(addr, &cfg->queue_device); 
-
-    iowrite16(msix_vector, &cfg->queue_msix_vector);
-    iowrite16(VIRTIO_VIRTQUEUE_ENABLE, &cfg->queue_enable); 
-    
-    /*read and write back notification offset for constistency
-    iowrite16(ioread16(&cfg->queue_notify_off), &cfg->queue_notify_off); 
-
-    return vq; 
+    iowrite16(vq->index, info->notify_addr);
+    info->kicks++;
+    return true;
 }
-*/
-
-
 
-static bool virtio_pci_notify(struct virtqueue *vq)
+/*VIRTIO_F_NOTIFICATION_DATA: the doorbell also carries the next avail
+ * index (split) or offset and wrap counter (packed), so the device can
+ * start fetching descriptors without reading the avail ring first */
+static bool virtio_pci_notify_with_data(struct virtqueue *vq)
 {
+    struct virtio_pci_vq_info *info = vq->priv;
+
+    iowrite32(vring_notification_data(vq), info->notify_addr);
+    info->kicks++;
     return true;
 }
 
 static struct virtqueue *virtio_pci_setup_vq(struct virtio_device *vdev,
                                              unsigned int index,
-                                             vq_callback_t *callback)
+                                             vq_callback_t *callback,
+                                             bool ctx,
+                                             u16 msix_vec)
 {
     struct virtio_pci_dev *vpci_dev = vdev->priv;
+    struct virtio_pci_common_cfg __iomem *cfg = vpci_dev->common_cfg;
     struct virtqueue *vq;
     u16 qsize;
+    u16 notify_off;
+    int ret;
+    bool (*notify)(struct virtqueue *vq) = virtio_pci_notify;
+
+    if(virtio_has_feature(vdev, VIRTIO_F_NOTIFICATION_DATA))
+        notify = virtio_pci_notify_with_data;
     
+    mutex_lock(&vpci_dev->cfg_lock);
     iowrite16(index, &vpci_dev->common_cfg->queue_select);
     
     qsize = ioread16(&vpci_dev->common_cfg->queue_size);
     
     if (qsize == 0) {
         dev_err(&vpci_dev->pdev->dev, "Queue %u has size 0\n", index);
-        return ERR_PTR(-EINVAL);  // Return error pointer for invalid argument
+        ret = -EINVAL;  // Invalid argument, returned as an error pointer
+        goto err_unlock;
     }
     
     vq = vring_create_virtqueue(
@@ -242,20 +259,154 @@ static struct virtqueue *virtio_pci_setup_vq(struct virtio_device *vdev,
         16,                       // unsigned int vring_align - Alignment requirement (16 bytes)
         vdev,                     // struct virtio_device *vdev - VirtIO device pointer
         true,                     // bool weak_barriers - Use weaker memory barriers for performance
-        false,                    // bool may_reduce_num - Allow queue size reduction
-        NULL,                     // void *context - Optional context pointer (usually NULL)
-        virtio_pci_notify,        // bool (*notify)(struct virtqueue *) - Notification function
+        true,                     // bool may_reduce_num - Fall back to a smaller ring if memory is short
+        ctx,                      // bool context - Per-buffer context passed with each buffer
+        notify,                   // bool (*notify)(struct virtqueue *) - Notification function
         callback,                 // void (*callback)(struct virtqueue *) - RX callback function
         "virtio-pci-vq");         // const char *name - Queue name for debugging
     
     if (!vq) {
         dev_err(&vpci_dev->pdev->dev, "Failed to create virtqueue %u\n", index);
-        return ERR_PTR(-ENOMEM);  // Return error pointer for out of memory
+        ret = -ENOMEM;  // Out of memory, returned as an error pointer
+        goto err_unlock;
     }
-    
-    iowrite16(VIRTIO_VIRTQUEUE_ENABLE, &vpci_dev->common_cfg->queue_enable);
-    
+
+    /*ring resize may grow the queue back up to what the device offers */
+    vq->num_max = qsize;
+
+    /*cache the notify address so virtio_pci_notify never touches common_cfg */
+    notify_off = le16_to_cpu(ioread16(&cfg->queue_notify_off));
+    vpci_dev->vq_info[index].notify_addr = vpci_dev->notify_base +
+                                           notify_off * vpci_dev->notify_off_multiplier;
+    vq->priv = &vpci_dev->vq_info[index];
+
+    ret = virtio_pci_activate_vq(vpci_dev, vq, msix_vec);
+    mutex_unlock(&vpci_dev->cfg_lock);
+    if(ret)
+    {
+        vring_del_virtqueue(vq);
+        return ERR_PTR(ret);
+    }
+
     return vq;
+
+err_unlock:
+    mutex_unlock(&vpci_dev->cfg_lock);
+    return ERR_PTR(ret);
+}
+
+/*program size, ring addresses and MSI-X vector of the selected queue and
+ * enable it; used at setup and again after a queue reset. Caller holds
+ * cfg_lock with the queue selected */
+static int virtio_pci_activate_vq(struct virtio_pci_dev *vpci_dev, struct virtqueue *vq, u16 msix_vec)
+{
+    struct virtio_pci_common_cfg __iomem *cfg = vpci_dev->common_cfg;
+    dma_addr_t addr;
+
+    /*tell the device where the ring lives */
+    iowrite16(virtqueue_get_vring_size(vq), &cfg->queue_size);
+    addr = virtqueue_get_desc_addr(vq);
+    iowrite32(lower_32_bits(addr), &cfg->queue_desc_lo);
+    iowrite32(upper_32_bits(addr), &cfg->queue_desc_hi);
+    addr = virtqueue_get_avail_addr(vq);
+    iowrite32(lower_32_bits(addr), &cfg->queue_avail_lo);
+    iowrite32(upper_32_bits(addr), &cfg->queue_avail_hi);
+    addr = virtqueue_get_used_addr(vq);
+    iowrite32(lower_32_bits(addr), &cfg->queue_used_lo);
+    iowrite32(upper_32_bits(addr), &cfg->queue_used_hi);
+
+    /*route the queue's interrupts to its own MSI-X vector */
+    vpci_dev->vq_info[vq->index].msix_vector = msix_vec;
+    if(msix_vec != VIRTIO_MSI_NO_VECTOR)
+    {
+        iowrite16(msix_vec, &cfg->queue_msix_vector);
+        if(ioread16(&cfg->queue_msix_vector) == VIRTIO_MSI_NO_VECTOR)
+        {
+            dev_err(&vpci_dev->pdev->dev, "Device rejected MSI-X vector %u for queue %u\n",
+                    msix_vec, vq->index);
+            return -EBUSY;
+        }
+    }
+
+    iowrite16(VIRTIO_VIRTQUEUE_ENABLE, &cfg->queue_enable);
+    return 0;
+}
+
+/*VIRTIO_F_RING_RESET: stop a single queue so its ring can be replaced,
+ * the other queues and the device status are left alone. Reached through
+ * virtqueue_resize()/virtqueue_reset() */
+static int virtio_pci_disable_vq_and_reset(struct virtqueue *vq)
+{
+    struct virtio_pci_dev *vpci_dev = vq->vdev->priv;
+    struct virtio_pci_vq_info *info = vq->priv;
+    void __iomem *queue_reset = (void __iomem *)vpci_dev->common_cfg + VIRTIO_PCI_COMMON_Q_RESET;
+    u16 val;
+    int ret;
+
+    /*restoring from PM freeze: the whole device was reset, every queue is
+     * already stopped and only the ring itself needs reinitializing */
+    if(vpci_dev->frozen)
+    {
+        vq->reset = true;
+        return 0;
+    }
+
+    if(!virtio_has_feature(vq->vdev, VIRTIO_F_RING_RESET))
+        return -ENOENT;
+
+    mutex_lock(&vpci_dev->cfg_lock);
+    iowrite16(vq->index, &vpci_dev->common_cfg->queue_select);
+    iowrite16(1, queue_reset);
+
+    /*the device reports 1 once the queue is reset, until it is enabled again.
+     * all ones means the device is gone (surprise removal) */
+    ret = read_poll_timeout(ioread16, val, val == 1 || val == 0xffff,
+                            VIRTIO_PCI_Q_RESET_POLL_US, VIRTIO_PCI_Q_RESET_TIMEOUT_US,
+                            false, queue_reset);
+    if(!ret && val != 0xffff)
+        ret = read_poll_timeout(ioread16, val, !val || val == 0xffff,
+                                VIRTIO_PCI_Q_RESET_POLL_US, VIRTIO_PCI_Q_RESET_TIMEOUT_US,
+                                false, &vpci_dev->common_cfg->queue_enable);
+    mutex_unlock(&vpci_dev->cfg_lock);
+
+    if(ret || val == 0xffff)
+    {
+        dev_err(&vpci_dev->pdev->dev, "Queue %u reset %s\n", vq->index,
+                ret ? "timed out" : "failed, device removed");
+        /*the ring state is unknown now, stop anyone from using it */
+        __virtqueue_break(vq);
+        return ret ? ret : -ENODEV;
+    }
+
+    /*a callback already running on another CPU must be done with the ring */
+    if(info->msix_vector != VIRTIO_MSI_NO_VECTOR)
+        synchronize_irq(pci_irq_vector(vpci_dev->pdev, info->msix_vector));
+
+    vq->reset = true;
+    return 0;
+}
+
+static int virtio_pci_enable_vq_after_reset(struct virtqueue *vq)
+{
+    struct virtio_pci_dev *vpci_dev = vq->vdev->priv;
+    struct virtio_pci_vq_info *info = vq->priv;
+    int ret;
+
+    if(!vq->reset)
+        return -EBUSY;
+
+    mutex_lock(&vpci_dev->cfg_lock);
+    iowrite16(vq->index, &vpci_dev->common_cfg->queue_select);
+    if(ioread16(&vpci_dev->common_cfg->queue_enable))
+        ret = -EBUSY;
+    else
+        ret = virtio_pci_activate_vq(vpci_dev, vq, info->msix_vector);
+    mutex_unlock(&vpci_dev->cfg_lock);
+    if(ret)
+        return ret;
+
+    vq->reset = false;
+    return 0;
 }
 
 /*
@@ -275,6 +426,57 @@ static void virtio_pci_del_vqs(struct virtio_device *vdev)
     }
 }
 */ 
+/*CPU whose node a queue's ring should live on, -1 for no preference */ 
+static int virtio_pci_queue_cpu(struct virtio_pci_dev *vpci_dev, unsigned int index)
+{
+    if(vpci_dev->virtio_dev.id.device == PCI_DEVICE_ID_VIRTIO_NET)
+        return virtio_net_vq_cpu(vpci_dev, index); 
+    return -1; 
+}
+
+struct virtio_pci_setup_vq_args {
+    struct virtio_device *vdev; 
+    unsigned int index; 
+    vq_callback_t *callback; 
+    bool ctx; 
+    u16 msix_vec; 
+    struct virtqueue *vq; 
+}; 
+
+static long virtio_pci_setup_vq_fn(void *data)
+{
+    struct virtio_pci_setup_vq_args *args = data; 
+
+    args->vq = virtio_pci_setup_vq(args->vdev, args->index, args->callback, args->ctx, args->msix_vec); 
+    return 0; 
+}
+
+/*without the DMA API vring_create_virtqueue() allocates the ring on the
+ * node of the CPU it runs on, so run it on the queue's CPU (the way the
+ * PCI core probes on the device's node). The DMA API allocates on the
+ * device's node whatever we do */ 
+static struct virtqueue *virtio_pci_setup_vq_on_cpu(struct virtio_device *vdev, unsigned int index, 
+                                                    vq_callback_t *callback, bool ctx, 
+                                                    u16 msix_vec, int cpu)
+{
+    struct virtio_pci_setup_vq_args args = {
+        .vdev = vdev, 
+        .index = index, 
+        .callback = callback, 
+        .ctx = ctx, 
+        .msix_vec = msix_vec, 
+    }; 
+
+    cpus_read_lock(); 
+    if(cpu >= 0 && cpu_online(cpu) && cpu_to_node(cpu) != numa_node_id())
+        work_on_cpu(cpu, virtio_pci_setup_vq_fn, &args); 
+    else
+        virtio_pci_setup_vq_fn(&args); 
+    cpus_read_unlock(); 
+
+    return args.vq; 
+}
+
 static int virtio_pci_find_vqs(struct virtio_device *vdev, unsigned nvqs, 
                                struct virtqueue *vqs[], vq_callback_t *callbacks[], 
                                const char *const names[], const bool *ctx, 
@@ -282,26 +484,56 @@ static int virtio_pci_find_vqs(struct virtio_device *vdev, unsigned nvqs,
 {
     struct virtio_pci_dev *vpci_dev = vdev->priv; 
     unsigned x; 
+    int err; 
 
     for(x = 0; x < nvqs; x++)
     {
-        vqs[x] = virtio_pci_setup_vq(vdev, x, callbacks[x]); 
+        /*with MSI-X every queue that has a callback gets a vector of its own */ 
+        bool own_vec = vpci_dev->msix_enabled && callbacks[x]; 
+        u16 msix_vec = own_vec ? VIRTIO_PCI_VQ_VECTOR(x) : VIRTIO_MSI_NO_VECTOR; 
+
+        vqs[x] = virtio_pci_setup_vq_on_cpu(vdev, x, callbacks[x], ctx ? ctx[x] : false, msix_vec, 
+                                            virtio_pci_queue_cpu(vpci_dev, x)); 
         if(IS_ERR(vqs[x]))
         {
-            int err = PTR_ERR(vqs[x]);
-            virtio_pci_del_vqs(vdev); 
-            return err;
+            err = PTR_ERR(vqs[x]);
+            vqs[x] = NULL; 
+            goto err_del_vqs; 
+        }
+
+        if(!own_vec)
+            continue; 
+
+        err = request_irq(pci_irq_vector(vpci_dev->pdev, msix_vec), virtio_pci_vq_interrupt, 
+                          0, names[x], vqs[x]); 
+        if(err)
+        {
+            dev_err(&vpci_dev->pdev->dev, "Failed to request IRQ for queue %u: %d\n", x, err); 
+            /*del_vqs would try to free the IRQ we never got */ 
+            vring_del_virtqueue(vqs[x]); 
+            vqs[x] = NULL; 
+            goto err_del_vqs; 
         }
     }
     return 0; 
+
+err_del_vqs:
+    virtio_pci_del_vqs(vdev); 
+    return err;
 }
 
  
 static void virtio_pci_del_vq(struct virtqueue *vq)
 {
+    struct virtio_pci_dev *vpci_dev;
+
     if (!vq)
         return;
 
+    vpci_dev = vq->vdev->priv;
+    if (vpci_dev->msix_enabled && vq->callback)
+        free_irq(pci_irq_vector(vpci_dev->pdev, VIRTIO_PCI_VQ_VECTOR(vq->index)), vq);
+
     /* vring_del_virtqueue handles freeing the queue */ 
     vring_del_virtqueue(vq);
 }
@@ -327,6 +559,8 @@ static const struct virtio_config_ops virtio_pci_config_ops = {
     .finalize_features = virtio_pci_finalize_features, 
   //  .find_vqs = virtio_pci_find_vqs, 
     .del_vqs = virtio_pci_del_vqs, 
+    .disable_vq_and_reset = virtio_pci_disable_vq_and_reset, 
+    .enable_vq_after_reset = virtio_pci_enable_vq_after_reset, 
 }; 
 
 static int virtio_pci_map_common_cfg(struct virtio_pci_dev *vpci_dev, u8 pos)
@@ -502,21 +736,14 @@ static int virtio_pci_map_notify_cfg(struct virtio_pci_dev *vpci_dev, u8 pos)
         return -ENOMEM; 
     }
 
-    /*allocate for notify capablilty structure */ 
-    if(vpci_dev->notify_cap)
+    /*only the multiplier is needed past probe, no copy of the capability */ 
+    if(vpci_dev->notify_cap_base)
     {
         dev_warn(&pdev->dev, "Overwriting existing notify cfg capablilty\n"); 
-        kfree(vpci_dev->notify_cap); 
+        iounmap(vpci_dev->notify_cap_base); 
     }
 
-    vpci_dev->notify_cap = kmalloc(sizeof(*vpci_dev->notify_cap), GFP_KERNEL); 
-    if(!vpci_dev->notify_cap)
-    {
-        iounmap(bar_base); 
-        return -ENOMEM; 
-    }
-
-    *vpci_dev->notify_cap = notify_cap;
+    vpci_dev->notify_off_multiplier = notify_cap.notify_off_multiplier;
 
     notify_base = bar_base + notify_cap.cap.offset; 
     vpci_dev->notify_cap_base = bar_base;
@@ -527,8 +754,6 @@ static int virtio_pci_map_notify_cfg(struct virtio_pci_dev *vpci_dev, u8 pos)
     {
         dev_err(&pdev->dev, "Notify cfg region at BAR %d offset 0x%x is invalid\n",
                 notify_cap.cap.bar, notify_cap.cap.offset);
-        kfree(vpci_dev->notify_cap);
-        vpci_dev->notify_cap = NULL;
         vpci_dev->notify_cap_base = NULL;
         vpci_dev->notify_base =  NULL;
         iounmap(bar_base);
@@ -626,10 +851,37 @@ static int virtio_pci_map_isr_cfg(struct virtio_pci_dev *vpci_dev, u8 pos)
     return 0;
 }
 
+static void virtio_pci_config_changed(struct virtio_pci_dev *vpci_dev)
+{
+    /*config space is re-read from a work item, keep hard IRQ cheap */ 
+    if(vpci_dev->virtio_dev.id.device == PCI_DEVICE_ID_VIRTIO_NET)
+        virtio_net_config_changed(vpci_dev); 
+}
+
+/*MSI-X config vector, no ISR read needed */ 
+static irqreturn_t virtio_pci_config_interrupt(int irq, void *data)
+{
+    virtio_pci_config_changed(data); 
+    return IRQ_HANDLED; 
+}
+
+/*MSI-X per-queue vector */ 
+static irqreturn_t virtio_pci_vq_interrupt(int irq, void *data)
+{
+    struct virtqueue *vq = data; 
+    irqreturn_t ret = vring_interrupt(irq, vq); 
+
+    if(ret == IRQ_HANDLED)
+        ((struct virtio_pci_vq_info *)vq->priv)->interrupts++; 
+    return ret; 
+}
+
+/*shared INTx/MSI handler used when MSI-X is unavailable */ 
 static irqreturn_t virtio_pci_interrupt(int irq, void *data)
 {
     struct virtio_pci_dev *vpci_dev = data; 
     u32 isr_status; 
+    int x; 
 
     isr_status = ioread32(vpci_dev->isr_data); 
 
@@ -638,15 +890,12 @@ static irqreturn_t virtio_pci_interrupt(int irq, void *data)
     {
         dev_dbg(&vpci_dev->pdev->dev, "Queue interrput triggered\n"); 
 
-        /*if device is a network card *i/ 
-
-        /*
-        if(vpci_dev->virtio_dev.id.device == PCI_DEVICE_ID_VIRTIO_NET)
+        /*single shared vector, let every queue check its used ring */ 
+        for(x = 0; x < vpci_dev->num_queues; x++)
         {
-            struct virtio_net_dev *vnet_dev = vpci_dev->virtio_dev.priv; 
-            virtio_net_receive(vpci_dev);  
+            if(vpci_dev->vqs[x] && vring_interrupt(irq, vpci_dev->vqs[x]) == IRQ_HANDLED)
+                vpci_dev->vq_info[x].interrupts++; 
         }
-        */ 
     }
 
     /*configuration interrput */ 
@@ -655,9 +904,8 @@ static irqreturn_t virtio_pci_interrupt(int irq, void *data)
         u8 device_status = ioread8(&vpci_dev->common_cfg->device_status); 
         dev_dbg(&vpci_dev->pdev->dev, "configuration interrput triggered, status : 0x%x\n", 
                 device_status); 
-        /* TODO: 
-         * handle configuration change 
-         */ 
+
+        virtio_pci_config_changed(vpci_dev); 
     }
 
     /*handle device-specific interrput (if any)*/ 
@@ -665,8 +913,6 @@ static irqreturn_t virtio_pci_interrupt(int irq, void *data)
     {
         dev_dbg(&vpci_dev->pdev->dev, "Device-specific interrput status: 0x%x\n", 
                 isr_status & ~0x3);  
-        /* TODO: 
-         * handle device-specific interrput */ 
     }
 
     iowrite32(isr_status, vpci_dev->isr_data); 
@@ -871,11 +1117,65 @@ read_error:
 
 }
 
+/*undo virtio_pci_find_caps, unmaps whatever BARs were mapped so far. the
+ * offset pointers point into the mappings, only the *_base ones are unmapped */ 
+static void virtio_pci_unmap_caps(struct virtio_pci_dev *vpci_dev)
+{
+    if(vpci_dev->device_cfg_base)
+        iounmap(vpci_dev->device_cfg_base); 
+    vpci_dev->device_cfg_base = NULL; 
+    vpci_dev->device_cfg = NULL; 
+
+    if(vpci_dev->isr_bar_base)
+        iounmap(vpci_dev->isr_bar_base); 
+    vpci_dev->isr_bar_base = NULL; 
+    vpci_dev->isr_data = NULL; 
+
+    if(vpci_dev->notify_cap_base)
+        iounmap(vpci_dev->notify_cap_base); 
+    vpci_dev->notify_cap_base = NULL; 
+    vpci_dev->notify_base = NULL; 
+
+    if(vpci_dev->common_cfg_base)
+        iounmap(vpci_dev->common_cfg_base); 
+    vpci_dev->common_cfg_base = NULL; 
+    vpci_dev->common_cfg = NULL; 
+}
+
 static int virtio_pci_setup_interrupts(struct virtio_pci_dev *vpci_dev)
 {
     struct pci_dev *pdev = vpci_dev->pdev; 
+    int nvec = VIRTIO_PCI_VQ_VECTOR(vpci_dev->num_queues); 
     int ret; 
 
+    /*prefer one MSI-X vector for config plus one per queue. the vectors are
+     * not kernel-managed so their affinity can be moved from userspace */ 
+    ret = pci_alloc_irq_vectors(pdev, nvec, nvec, PCI_IRQ_MSIX); 
+    if(ret > 0)
+    {
+        ret = request_irq(pci_irq_vector(pdev, VIRTIO_PCI_CONFIG_VECTOR), 
+                          virtio_pci_config_interrupt, 0, "virtio-pci-config", vpci_dev); 
+        if(ret)
+        {
+            dev_err(&pdev->dev, "Failed to request config IRQ %d\n", ret); 
+            pci_free_irq_vectors(pdev); 
+            return ret; 
+        }
+
+        iowrite16(VIRTIO_PCI_CONFIG_VECTOR, &vpci_dev->common_cfg->msix_config); 
+        if(ioread16(&vpci_dev->common_cfg->msix_config) == VIRTIO_MSI_NO_VECTOR)
+        {
+            dev_err(&pdev->dev, "Device rejected MSI-X config vector\n"); 
+            free_irq(pci_irq_vector(pdev, VIRTIO_PCI_CONFIG_VECTOR), vpci_dev); 
+            pci_free_irq_vectors(pdev); 
+            return -EBUSY; 
+        }
+
+        vpci_dev->msix_enabled = true; 
+        return 0; 
+    }
+    dev_info(&pdev->dev, "MSI-X unavailable, using a single shared vector\n"); 
+
     /*allocate IRQ vector */ 
     ret = pci_alloc_irq_vectors(pdev, VIRTIO_PCI_MIN_VECTORS, VIRTIO_PCI_MAX_VECTORS, 
                                 PCI_IRQ_MSI | PCI_IRQ_LEGACY);
@@ -902,17 +1202,174 @@ static void virtio_pci_cleanup_interrupts(struct virtio_pci_dev *vpci_dev)
 {
     struct pci_dev *pdev = vpci_dev->pdev; 
 
-    /*unregister interrput handler */ 
-    free_irq(pci_irq_vector(pdev, 0), vpci_dev); 
+    /*unregister interrput handler (config vector under MSI-X) */ 
+    free_irq(pci_irq_vector(pdev, VIRTIO_PCI_CONFIG_VECTOR), vpci_dev); 
     pci_free_irq_vectors(pdev); 
+    vpci_dev->msix_enabled = false; 
+}
+
+/*Linux IRQ number of a queue's MSI-X vector, -ENOENT without one */ 
+int virtio_pci_vq_irq(struct virtio_pci_dev *vpci_dev, unsigned int index)
+{
+    if(!vpci_dev->msix_enabled || index >= vpci_dev->num_queues || 
+       !vpci_dev->vqs[index] || !vpci_dev->vqs[index]->callback)
+        return -ENOENT; 
+
+    return pci_irq_vector(vpci_dev->pdev, VIRTIO_PCI_VQ_VECTOR(index)); 
+}
+
+/*write 0 to device_status and wait for the device to read back 0, only then
+ * has it stopped touching the rings and may they be freed or reinitialized.
+ * all ones means the device is gone (surprise removal) */
+int virtio_pci_reset_device(struct virtio_pci_dev *vpci_dev)
+{
+    u8 status;
+    int ret;
+
+    iowrite8(VIRTIO_CONFIG_S_RESET, &vpci_dev->common_cfg->device_status);
+    ret = read_poll_timeout(ioread8, status, !status || status == 0xff,
+                            VIRTIO_PCI_RESET_POLL_US, VIRTIO_PCI_RESET_TIMEOUT_US,
+                            false, &vpci_dev->common_cfg->device_status);
+    if(ret || status)
+    {
+        dev_err(&vpci_dev->pdev->dev, "Device reset %s\n",
+                ret ? "timed out" : "failed, device removed");
+        return -EIO;
+    }
+    return 0;
+}
+
+/*memory held by the split rings of all queues, descriptors plus avail and
+ * used rings as vring_create_virtqueue lays them out */
+unsigned long virtio_pci_ring_bytes(struct virtio_pci_dev *vpci_dev)
+{
+    unsigned long bytes = 0;
+    unsigned int x;
+
+    for(x = 0; x < vpci_dev->num_queues; x++)
+    {
+        if(vpci_dev->vqs[x])
+            bytes += PAGE_ALIGN(vring_size(virtqueue_get_vring_size(vpci_dev->vqs[x]), 16));
+    }
+    return bytes;
+}
+
+
+/*debugfs virtqueue inspector:
+ *   <debugfs>/virtio-drivers/<pci name>/device      status, features, vectors
+ *   <debugfs>/virtio-drivers/<pci name>/vq<N>/state ring indices and counters
+ * everything is read straight from the rings, nothing is cached */ 
+
+static int virtio_pci_device_show(struct seq_file *m, void *unused)
+{
+    struct virtio_pci_dev *vpci_dev = m->private; 
+
+    seq_printf(m, "device_id:       0x%04x\n", vpci_dev->virtio_dev.id.device); 
+    seq_printf(m, "device_status:   0x%02x\n", ioread8(&vpci_dev->common_cfg->device_status)); 
+    seq_printf(m, "device_features: 0x%016llx\n", vpci_dev->device_features); 
+    seq_printf(m, "guest_features:  0x%016llx\n", vpci_dev->guest_features); 
+    seq_printf(m, "num_queues:      %d\n", vpci_dev->num_queues); 
+    seq_printf(m, "msix:            %s\n", vpci_dev->msix_enabled ? "per-queue" : "shared"); 
+    return 0; 
+}
+DEFINE_SHOW_ATTRIBUTE(virtio_pci_device); 
+
+static int virtio_pci_vq_state_show(struct seq_file *m, void *unused)
+{
+    struct virtqueue *vq = m->private; 
+    struct virtio_pci_vq_info *info = vq->priv; 
+    const struct vring *vring = virtqueue_get_vring(vq); 
+    bool event_idx = virtio_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX); 
+    u16 avail_flags = virtio16_to_cpu(vq->vdev, READ_ONCE(vring->avail->flags)); 
+    u16 used_flags = virtio16_to_cpu(vq->vdev, READ_ONCE(vring->used->flags)); 
+
+    seq_printf(m, "name:         %s\n", vq->name); 
+    seq_printf(m, "index:        %u\n", vq->index); 
+    seq_printf(m, "size:         %u\n", vring->num); 
+    seq_printf(m, "num_free:     %u\n", vq->num_free); 
+    seq_printf(m, "avail_idx:    %u\n", virtio16_to_cpu(vq->vdev, READ_ONCE(vring->avail->idx))); 
+    seq_printf(m, "used_idx:     %u\n", virtio16_to_cpu(vq->vdev, READ_ONCE(vring->used->idx))); 
+    /*the split ring always reserves the used_event slot and virtio_ring
+     * stores the driver's last seen used index there whenever callbacks
+     * are enabled, with or without EVENT_IDX */ 
+    seq_printf(m, "last_used:    %u\n", 
+               virtio16_to_cpu(vq->vdev, READ_ONCE(vring_used_event(vring)))); 
+    seq_printf(m, "callbacks:    %s\n", 
+               avail_flags & VRING_AVAIL_F_NO_INTERRUPT ? "disabled" : "enabled"); 
+    seq_printf(m, "notify:       %s\n", 
+               used_flags & VRING_USED_F_NO_NOTIFY ? "suppressed" : "enabled"); 
+    seq_printf(m, "event_idx:    %s\n", event_idx ? "yes" : "no"); 
+    if(event_idx)
+    {
+        /*the device only writes avail_event once negotiated, and then goes
+         * by last_used above instead of the callbacks flag */ 
+        seq_printf(m, "avail_event:  %u\n", 
+                   virtio16_to_cpu(vq->vdev, READ_ONCE(vring_avail_event(vring)))); 
+    }
+    seq_printf(m, "broken:       %s\n", virtqueue_is_broken(vq) ? "yes" : "no"); 
+    seq_printf(m, "kicks:        %llu\n", READ_ONCE(info->kicks)); 
+    seq_printf(m, "interrupts:   %llu\n", READ_ONCE(info->interrupts)); 
+    return 0; 
+}
+DEFINE_SHOW_ATTRIBUTE(virtio_pci_vq_state); 
+
+static void virtio_pci_debugfs_init(struct virtio_pci_dev *vpci_dev)
+{
+    char name[16]; 
+    int x; 
+
+    debugfs_create_file("device", 0400, vpci_dev->debugfs_dir, vpci_dev, 
+                        &virtio_pci_device_fops); 
+
+    for(x = 0; x < vpci_dev->num_queues; x++)
+    {
+        struct dentry *dir; 
+
+        snprintf(name, sizeof(name), "vq%d", x); 
+        dir = debugfs_create_dir(name, vpci_dev->debugfs_dir); 
+        debugfs_create_file("state", 0400, dir, vpci_dev->vqs[x], &virtio_pci_vq_state_fops); 
+    }
 }
 
+/*transport features implemented by virtio-pci itself rather than by
+ * virtio_ring, kept across vring_transport_features() */ 
+#define VIRTIO_PCI_TRANSPORT_FEATURES   BIT_ULL(VIRTIO_F_RING_RESET)
+
+/*features the driver for this device type is willing to accept */ 
+static u64 virtio_pci_driver_features(struct virtio_pci_dev *vpci_dev)
+{
+    /*ACCESS_PLATFORM: the device sits behind an IOMMU (or needs bounce
+     * buffers), virtio_ring then uses the DMA API on the PCI device for
+     * rings and buffers instead of guest physical addresses */
+    u64 features = BIT_ULL(VIRTIO_F_VERSION_1) | BIT_ULL(VIRTIO_F_ACCESS_PLATFORM) | 
+                   BIT_ULL(VIRTIO_F_RING_RESET) | BIT_ULL(VIRTIO_F_NOTIFICATION_DATA); 
+
+    switch(vpci_dev->virtio_dev.id.device)
+    {
+        case PCI_DEVICE_ID_VIRTIO_NET:
+            features |= VIRTIO_NET_DRIVER_FEATURES; 
+            break; 
+
+        case PCI_DEVICE_ID_VIRTIO_VSOCK:
+            features |= VIRTIO_VSOCK_DRIVER_FEATURES; 
+            break; 
+
+        case PCI_DEVICE_ID_VIRTIO_CONSOLE:
+            features |= VIRTIO_CONSOLE_DRIVER_FEATURES; 
+            break; 
+
+        default:
+            break; 
+    }
+
+    return features; 
+}
 
 static int virtio_pci_enable_device(struct virtio_pci_dev *vpci_dev)
 {
     struct virtio_device *vdev = &vpci_dev->virtio_dev;
     u8 status;
-    u32 device_features, guest_features;
+    int ret;
 
     /* acknowledge device */
     status = ioread8(&vpci_dev->common_cfg->device_status);
@@ -924,40 +1381,127 @@ static int virtio_pci_enable_device(struct virtio_pci_dev *vpci_dev)
     iowrite8(status | VIRTIO_CONFIG_S_DRIVER,
              &vpci_dev->common_cfg->device_status);
 
-    /* read device features */
-    device_features = ioread32(&vpci_dev->common_cfg->device_feature);
+    /* read device features (all 64 bits, VERSION_1 is bit 32) */
+    vpci_dev->device_features = virtio_pci_get_features(vdev);
 
-    /* select features we want */
-    guest_features = device_features & (1ULL<< VIRTIO_F_VERSION_1);
-    vdev->features = guest_features;
+    /* select features we want; vring_transport_features() then drops the
+     * ring features (IN_ORDER, ...) this kernel's virtio_ring cannot drive.
+     * It also drops transport bits the ring knows nothing about, put back
+     * the ones implemented here (RING_RESET: the queue_reset handshake) */
+    vdev->features = vpci_dev->device_features & virtio_pci_driver_features(vpci_dev);
+    vring_transport_features(vdev);
+    vdev->features |= vpci_dev->device_features & VIRTIO_PCI_TRANSPORT_FEATURES;
+    vpci_dev->guest_features = vdev->features;
 
     /* write accepted features to guest_feature */
-    iowrite32(guest_features, &vpci_dev->common_cfg->guest_feature);
+    virtio_pci_set_features(vdev, vpci_dev->guest_features);
 
     /* features OK */
-    status = ioread8(&vpci_dev->common_cfg->device_status);
-    iowrite8(status | VIRTIO_CONFIG_S_FEATURES_OK,
-             &vpci_dev->common_cfg->device_status);
-
-    /* check features OK */
-    status = ioread8(&vpci_dev->common_cfg->device_status);
-    if (!(status & VIRTIO_CONFIG_S_FEATURES_OK)) {
+    ret = virtio_pci_finalize_features(vdev);
+    if (ret) {
         dev_err(&vpci_dev->pdev->dev, "Failed to negotiate features\n");
-        return -EINVAL;
+        return ret;
+    }
+
+    return 0;
+}
+
+/*number of queues for this device type, depends on negotiated features */ 
+static int virtio_pci_queue_count(struct virtio_pci_dev *vpci_dev)
+{
+    switch(vpci_dev->virtio_dev.id.device)
+    {
+        case PCI_DEVICE_ID_VIRTIO_NET:
+            return virtio_net_num_queues(vpci_dev); 
+
+        case PCI_DEVICE_ID_VIRTIO_VSOCK:
+            return VIRTIO_VSOCK_VQ_MAX; 
+
+        case PCI_DEVICE_ID_VIRTIO_CONSOLE:
+            return virtio_console_num_queues(vpci_dev); 
+
+        default:
+            return -ENODEV; 
+    }
+}
+
+/*callback and name of queue index, names must outlive the queue (IRQ names) */ 
+static void virtio_pci_queue_info(struct virtio_pci_dev *vpci_dev, unsigned int index, 
+                                  vq_callback_t **callback, const char **name, bool *ctx)
+{
+    *ctx = false; 
+
+    switch(vpci_dev->virtio_dev.id.device)
+    {
+        case PCI_DEVICE_ID_VIRTIO_NET:
+            virtio_net_vq_info(vpci_dev, index, callback, name, ctx); 
+            break; 
+
+        case PCI_DEVICE_ID_VIRTIO_VSOCK:
+            *callback = virtio_vsock_vq_callbacks[index]; 
+            *name = virtio_vsock_vq_names[index]; 
+            break; 
+
+        case PCI_DEVICE_ID_VIRTIO_CONSOLE:
+            virtio_console_vq_info(index, callback, name); 
+            break; 
+    }
+}
+
+/*bring up the device-type driver once the queues exist */ 
+static int virtio_pci_init_driver(struct virtio_pci_dev *vpci_dev)
+{
+    switch(vpci_dev->virtio_dev.id.device)
+    {
+        case PCI_DEVICE_ID_VIRTIO_NET:
+            return virtio_net_init(vpci_dev); 
+        case PCI_DEVICE_ID_VIRTIO_VSOCK:
+            return virtio_vsock_init(vpci_dev); 
+        case PCI_DEVICE_ID_VIRTIO_CONSOLE:
+            return virtio_console_init(vpci_dev); 
+        default:
+            return -ENODEV; 
+    }
+}
+
+static void virtio_pci_exit_driver(struct virtio_pci_dev *vpci_dev)
+{
+    if(!vpci_dev->drv_priv)
+        return; 
+
+    switch(vpci_dev->virtio_dev.id.device)
+    {
+        case PCI_DEVICE_ID_VIRTIO_NET:
+            virtio_net_exit(vpci_dev->drv_priv); 
+            break; 
+        case PCI_DEVICE_ID_VIRTIO_VSOCK:
+            virtio_vsock_exit(vpci_dev->drv_priv); 
+            break; 
+        case PCI_DEVICE_ID_VIRTIO_CONSOLE:
+            virtio_console_exit(vpci_dev->drv_priv); 
+            break; 
+        default:
+            break; 
     }
+}
+
+/*last step of initialization, device may use the queues after this */ 
+static void virtio_pci_set_driver_ok(struct virtio_pci_dev *vpci_dev)
+{
+    u8 status = ioread8(&vpci_dev->common_cfg->device_status);
 
-    /* set driver OK */
     iowrite8(status | VIRTIO_CONFIG_S_DRIVER_OK,
              &vpci_dev->common_cfg->device_status);
-
-    return 0;
 }
 
 static int virtio_pci_probe(struct pci_dev *pdev, const struct pci_device_id *id)
 {
     struct virtio_pci_dev *vpci_dev; 
-    struct virtio_net_dev *vnet_dev = NULL;
+    vq_callback_t **callbacks = NULL; 
+    const char **names = NULL; 
+    bool *ctx = NULL; 
     int ret; 
+    int x; 
 
     vpci_dev = kzalloc(sizeof(struct virtio_pci_dev), GFP_KERNEL); 
     if(!vpci_dev)
@@ -972,6 +1516,13 @@ static int virtio_pci_probe(struct pci_dev *pdev, const struct pci_device_id *id
     vpci_dev->virtio_dev.id.vendor = PCI_VENDOR_ID_VIRTIO; 
     vpci_dev->virtio_dev.config = &virtio_pci_config_ops;
     vpci_dev->virtio_dev.priv = vpci_dev; 
+    /*the virtio_device is never registered on the virtio bus (nothing
+     * binds to it, and registering would reset the device), so set up what
+     * virtio_ring needs from it here: vring_create_virtqueue() adds every
+     * ring to vqs under vqs_list_lock */ 
+    INIT_LIST_HEAD(&vpci_dev->virtio_dev.vqs); 
+    spin_lock_init(&vpci_dev->virtio_dev.vqs_list_lock); 
+    mutex_init(&vpci_dev->cfg_lock); 
 
     ret = pci_enable_device(pdev); 
     if(ret)
@@ -988,54 +1539,72 @@ static int virtio_pci_probe(struct pci_dev *pdev, const struct pci_device_id *id
     }
 
 
-    
-/* Set DMA mask: try 64-bit first, fallback to 32-bit */
-#ifdef pci_set_dma_mask
-    ret = pci_set_dma_mask(pdev, DMA_BIT_MASK(64));
-    if (ret) 
+
+    /*rings and buffers go through the DMA API (and any vIOMMU) when
+     * ACCESS_PLATFORM is negotiated, try 64-bit first, fallback to 32-bit */
+    ret = dma_set_mask_and_coherent(&pdev->dev, DMA_BIT_MASK(64));
+    if(ret)
     {
-        ret = pci_set_dma_mask(pdev, DMA_BIT_MASK(32));
-        if (ret) 
+        ret = dma_set_mask_and_coherent(&pdev->dev, DMA_BIT_MASK(32));
+        if(ret)
         {
             dev_err(&pdev->dev, "Failed to set DMA mask\n");
             goto err_release_regions;
         }
     }
-
-/* Set consistent DMA mask */
-#ifdef pci_set_consistent_dma_mask
-    ret = pci_set_consistent_dma_mask(pdev, DMA_BIT_MASK(64));
-    if (ret)
-    {
-        dev_err(&pdev->dev, "Failed to set consistent DMA mask\n");
-        goto err_release_regions;
-    }
-#endif
-
-#else
-    dev_warn(&pdev->dev, "DMA API not available, skipping DMA mask setup\n");
-#endif
     
     /*map VIRTIO capablilties */ 
     ret = virtio_pci_find_caps(vpci_dev); 
     if(ret)
     {
         dev_err(&pdev->dev, "Failed to map Virtio capablilties\n"); 
-        goto err_release_regions; 
+        goto err_cleanup_caps; 
+    }
+
+    /*negotiate features before creating queues, ring layout depends on them */ 
+    ret = virtio_pci_enable_device(vpci_dev);
+    if(ret)
+    {
+        dev_err(&pdev->dev, "Failed to enable VIRTIO device\n"); 
+        goto err_cleanup_device;  
     }
 
-    /*set up interrputs for VIRTIO device */ 
+    /*set up virtqueues, count depends on device type and negotiated features */
+    ret = virtio_pci_queue_count(vpci_dev); 
+    if(ret < 0)
+        goto err_cleanup_device; 
+    vpci_dev->num_queues = ret; 
+
+    vpci_dev->vqs = kcalloc(vpci_dev->num_queues, sizeof(*vpci_dev->vqs), GFP_KERNEL); 
+    vpci_dev->vq_info = kcalloc(vpci_dev->num_queues, sizeof(*vpci_dev->vq_info), GFP_KERNEL); 
+    callbacks = kcalloc(vpci_dev->num_queues, sizeof(*callbacks), GFP_KERNEL); 
+    names = kcalloc(vpci_dev->num_queues, sizeof(*names), GFP_KERNEL); 
+    ctx = kcalloc(vpci_dev->num_queues, sizeof(*ctx), GFP_KERNEL); 
+    if(!vpci_dev->vqs || !vpci_dev->vq_info || !callbacks || !names || !ctx)
+    {
+        ret = -ENOMEM; 
+        goto err_free_vqs; 
+    }
+
+    for(x = 0; x < vpci_dev->num_queues; x++)
+        virtio_pci_queue_info(vpci_dev, x, &callbacks[x], &names[x], &ctx[x]); 
+
+    /*set up interrputs for VIRTIO device, sized by the queue count */ 
     ret = virtio_pci_setup_interrupts(vpci_dev);
     if(ret)
     {
         dev_err(&pdev->dev, "Failed to set up interrputs on VIRTIO device\n"); 
-        goto err_cleanup_caps; 
+        goto err_free_vqs; 
     }
 
-    /*set up 3 virtqueues (RX, TX, CTRL) */
-    ret = virtio_pci_find_vqs(&vpci_dev->virtio_dev, 3, vpci_dev->vqs, 
-                              (vq_callback_t *[]){virtio_net_receive, NULL, NULL}, 
-                              (const char*[]){"rx", "tx", "ctrl"}, NULL, NULL);
+    ret = virtio_pci_find_vqs(&vpci_dev->virtio_dev, vpci_dev->num_queues, vpci_dev->vqs, 
+                              callbacks, names, ctx, NULL);
+    kfree(callbacks); 
+    kfree(names); 
+    kfree(ctx); 
+    callbacks = NULL; 
+    names = NULL; 
+    ctx = NULL; 
 
     if(ret)
     {
@@ -1043,32 +1612,27 @@ static int virtio_pci_probe(struct pci_dev *pdev, const struct pci_device_id *id
         goto err_cleanup_interrupts; 
     }
 
-    /*enable virtio device by setting status bits */ 
-    ret = virtio_pci_enable_device(vpci_dev);
+    vpci_dev->debugfs_dir = debugfs_create_dir(pci_name(pdev), virtio_pci_debugfs_root); 
+    virtio_pci_debugfs_init(vpci_dev); 
+
+    /*hand the queues to the virtio-net / virtio-vsock driver */ 
+    ret = virtio_pci_init_driver(vpci_dev); 
     if(ret)
     {
-        dev_err(&pdev->dev, "Failed to enable VIRTIO device\n"); 
-        goto err_cleanup_vqs;  
+        dev_err(&pdev->dev, "Failed to register VirtIO device\n"); 
+        goto err_cleanup_vqs; 
     }
 
-    /*check if device is virtio-net device (ID 0x100)*/ 
-    if(id->device == PCI_DEVICE_ID_VIRTIO_NET)
-    {
-        ret = virtio_net_init(vpci_dev); 
-        if(ret)
-        {
-            dev_err(&pdev->dev, "Failed to register VirtIO device\n"); 
-            goto err_cleanup_device; 
-        }
-        vnet_dev = vpci_dev->virtio_dev.priv; 
-    }
+    virtio_pci_set_driver_ok(vpci_dev); 
 
-    ret = register_virtio_device(&vpci_dev->virtio_dev); 
-    if(ret)
-    {
-        dev_err(&pdev->dev, "Failed to register VIRTIO device\n"); 
-        goto err_cleanup_net; 
-    }
+    /*virtio-net and virtio-console talk to the host over their control
+     * queues and vsock kicks its posted buffers, only allowed after DRIVER_OK */ 
+    if(id->device == PCI_DEVICE_ID_VIRTIO_NET)
+        virtio_net_ready(vpci_dev->drv_priv); 
+    else if(id->device == PCI_DEVICE_ID_VIRTIO_VSOCK)
+        virtio_vsock_ready(vpci_dev->drv_priv); 
+    else if(id->device == PCI_DEVICE_ID_VIRTIO_CONSOLE)
+        virtio_console_ready(vpci_dev->drv_priv); 
 
     /*store vpci_dev as driver data for PCI device */ 
     pci_set_drvdata(pdev, vpci_dev);
@@ -1077,30 +1641,25 @@ static int virtio_pci_probe(struct pci_dev *pdev, const struct pci_device_id *id
 
     return 0; 
 
-err_cleanup_net:
-    if (vnet_dev)
-        virtio_net_exit(vnet_dev);
-
-err_cleanup_device:
-    iowrite8(0, &vpci_dev->common_cfg->device_status);
-
 err_cleanup_vqs:
+    debugfs_remove_recursive(vpci_dev->debugfs_dir);
     virtio_pci_del_vqs(&vpci_dev->virtio_dev);
 
 err_cleanup_interrupts:
     virtio_pci_cleanup_interrupts(vpci_dev);
 
+err_free_vqs:
+    kfree(callbacks);
+    kfree(names);
+    kfree(ctx);
+    kfree(vpci_dev->vq_info);
+    kfree(vpci_dev->vqs);
+
+err_cleanup_device:
+    iowrite8(0, &vpci_dev->common_cfg->device_status);
+
 err_cleanup_caps:
-    if (vpci_dev->device_cfg)
-        iounmap(vpci_dev->device_cfg);
-    if (vpci_dev->isr_data)
-        iounmap(vpci_dev->isr_data);
-    if (vpci_dev->notify_cap) {
-        iounmap((void __iomem *)(unsigned long)vpci_dev->notify_cap->cap.offset);
-        kfree(vpci_dev->notify_cap);
-    }
-    if (vpci_dev->common_cfg)
-        iounmap(vpci_dev->common_cfg);
+    virtio_pci_unmap_caps(vpci_dev);
 
 err_release_regions:
     pci_release_regions(pdev);
@@ -1116,72 +1675,198 @@ err_free_dev:
 static void virtio_pci_remove(struct pci_dev *pdev)
 {
     struct virtio_pci_dev *vpci_dev = pci_get_drvdata(pdev); 
-    struct virtio_net_dev *vnet_dev = vpci_dev->virtio_dev.priv;
 
-    /* unregister virtio device */
-    unregister_virtio_device(&vpci_dev->virtio_dev); 
+    /* clean up device-type specific state */
+    virtio_pci_exit_driver(vpci_dev); 
 
-    /* clean up virtio-net specific device */
-    if (vpci_dev->virtio_dev.id.device == PCI_DEVICE_ID_VIRTIO_NET && vnet_dev)
-        virtio_net_exit(vnet_dev); 
+    debugfs_remove_recursive(vpci_dev->debugfs_dir);
+    vpci_dev->debugfs_dir = NULL;
 
     /* reset the device */
     if (vpci_dev->common_cfg)
-        iowrite8(VIRTIO_CONFIG_S_RESET, &vpci_dev->common_cfg->device_status);
+        virtio_pci_reset_device(vpci_dev);
 
     /* delete virtqueues */
     virtio_pci_del_vqs(&vpci_dev->virtio_dev); 
+    kfree(vpci_dev->vq_info);
+    kfree(vpci_dev->vqs);
+    vpci_dev->vq_info = NULL;
+    vpci_dev->vqs = NULL;
 
     /* cleanup interrupts */
     virtio_pci_cleanup_interrupts(vpci_dev);
 
-    /* unmap device config */
-    if (vpci_dev->device_cfg) {
-        iounmap(vpci_dev->device_cfg); 
-        vpci_dev->device_cfg = NULL;
-        vpci_dev->device_cfg_base = NULL;
-    }
+    /* unmap capability regions */
+    virtio_pci_unmap_caps(vpci_dev);
 
-    /* unmap ISR */
-    if (vpci_dev->isr_data) {
-        iounmap(vpci_dev->isr_data); 
-        vpci_dev->isr_data = NULL;
-        vpci_dev->isr_bar_base = NULL;
+    /* release PCI resources */
+    pci_release_regions(pdev); 
+    pci_disable_device(pdev); 
+
+    /* finally free the virtio_pci_dev struct */
+    kfree(vpci_dev); 
+}
+
+/*PM freeze/restore (suspend, hibernation, snapshots and migration).
+ * virtio-net keeps its netdev, pools and rings: the device status is reset,
+ * the same features are renegotiated and the rings are reinitialized in
+ * place. vsock and console have no such path yet and go through their
+ * exit/init, which drains and reallocates their buffers */
+
+/*buffers still on a ring after the driver's exit, there should be none */
+static void virtio_pci_recycle_leftover(struct virtqueue *vq, void *buf)
+{
+    WARN_ONCE(1, "virtio-pci: buffer left on queue %u across restore\n", vq->index);
+}
+
+static int virtio_pci_freeze(struct device *dev)
+{
+    struct virtio_pci_dev *vpci_dev = dev_get_drvdata(dev);
+
+    switch(vpci_dev->virtio_dev.id.device)
+    {
+        case PCI_DEVICE_ID_VIRTIO_NET:
+            if(vpci_dev->drv_priv)
+                virtio_net_freeze(vpci_dev->drv_priv);
+            break;
+        default:
+            virtio_pci_exit_driver(vpci_dev);
+            break;
     }
 
-    /* unmap notify capability */
-    if (vpci_dev->notify_cap) {
-        if (vpci_dev->notify_cap_base)
-            iounmap(vpci_dev->notify_cap_base); 
-        kfree(vpci_dev->notify_cap);
-        vpci_dev->notify_cap = NULL;
-        vpci_dev->notify_cap_base = NULL;
-        vpci_dev->notify_base = NULL;
+    /*no DMA into the rings from here on, MSI-X state is saved by the PCI core.
+     * a device that does not finish the reset is caught again by restore */
+    virtio_pci_reset_device(vpci_dev);
+    vpci_dev->frozen = true;
+
+    pci_disable_device(to_pci_dev(dev));
+    return 0;
+}
+
+static int virtio_pci_restore(struct device *dev)
+{
+    struct pci_dev *pdev = to_pci_dev(dev);
+    struct virtio_pci_dev *vpci_dev = dev_get_drvdata(dev);
+    u64 features = vpci_dev->guest_features;
+    int ret;
+    int x;
+
+    ret = pci_enable_device(pdev);
+    if(ret)
+        return ret;
+
+    /*the queue layout and ring formats depend on the features, the device
+     * has to offer everything it did at probe */
+    ret = virtio_pci_reset_device(vpci_dev);
+    if(!ret)
+        ret = virtio_pci_enable_device(vpci_dev);
+    if(!ret && vpci_dev->guest_features != features)
+    {
+        dev_err(dev, "Features changed across restore: %llx -> %llx\n", features,
+                vpci_dev->guest_features);
+        ret = -EIO;
     }
+    if(ret)
+        goto err_fail;
+
+    if(vpci_dev->msix_enabled)
+        iowrite16(VIRTIO_PCI_CONFIG_VECTOR, &vpci_dev->common_cfg->msix_config);
 
-    /* unmap common config */
-    if (vpci_dev->common_cfg) {
-        iounmap(vpci_dev->common_cfg); 
-        vpci_dev->common_cfg = NULL;
-        vpci_dev->common_cfg_base = NULL;
+    switch(vpci_dev->virtio_dev.id.device)
+    {
+        case PCI_DEVICE_ID_VIRTIO_NET:
+            ret = vpci_dev->drv_priv ? virtio_net_restore(vpci_dev->drv_priv) : -ENODEV;
+            break;
+        default:
+            for(x = 0; x < vpci_dev->num_queues && !ret; x++)
+                ret = virtqueue_reset(vpci_dev->vqs[x], virtio_pci_recycle_leftover);
+            if(!ret)
+                ret = virtio_pci_init_driver(vpci_dev);
+            break;
+    }
+    vpci_dev->frozen = false;
+    if(ret)
+    {
+        dev_err(dev, "Failed to restore virtqueues: %d\n", ret);
+        goto err_fail;
     }
 
-    /* release PCI resources */
-    pci_release_regions(pdev); 
-    pci_disable_device(pdev); 
+    virtio_pci_set_driver_ok(vpci_dev);
 
-    /* finally free the virtio_pci_dev struct */
-    kfree(vpci_dev); 
+    switch(vpci_dev->virtio_dev.id.device)
+    {
+        case PCI_DEVICE_ID_VIRTIO_NET:
+            virtio_net_resume(vpci_dev->drv_priv);
+            break;
+        case PCI_DEVICE_ID_VIRTIO_VSOCK:
+            virtio_vsock_ready(vpci_dev->drv_priv);
+            break;
+        case PCI_DEVICE_ID_VIRTIO_CONSOLE:
+            virtio_console_ready(vpci_dev->drv_priv);
+            break;
+        default:
+            break;
+    }
+    return 0;
+
+err_fail:
+    iowrite8(VIRTIO_CONFIG_S_FAILED, &vpci_dev->common_cfg->device_status);
+    return ret;
 }
 
+static const struct dev_pm_ops virtio_pci_pm_ops = {
+    SYSTEM_SLEEP_PM_OPS(virtio_pci_freeze, virtio_pci_restore)
+};
+
 static struct pci_driver virtio_pci_driver = {
     .name = "virtio-pci", 
     .id_table = virtio_pci_id_table, 
     .probe  = virtio_pci_probe, 
     .remove = virtio_pci_remove, 
+    .driver.pm = pm_sleep_ptr(&virtio_pci_pm_ops), 
 };
 
-module_pci_driver(virtio_pci_driver);
+static int __init virtio_pci_module_init(void)
+{
+    int ret; 
+
+    virtio_pci_debugfs_root = debugfs_create_dir("virtio-drivers", NULL); 
+
+    /*char device region and class for virtio-console ports */ 
+    ret = virtio_console_register(); 
+    if(ret)
+        goto err_remove_debugfs; 
+
+    /*CPU hotplug state for virtio-net XPS maps */ 
+    ret = virtio_net_register(); 
+    if(ret)
+        goto err_console_unregister; 
+
+    ret = pci_register_driver(&virtio_pci_driver); 
+    if(ret)
+        goto err_net_unregister; 
+
+    return 0; 
+
+err_net_unregister:
+    virtio_net_unregister(); 
+err_console_unregister:
+    virtio_console_unregister(); 
+err_remove_debugfs:
+    debugfs_remove_recursive(virtio_pci_debugfs_root); 
+    return ret; 
+}
+
+static void __exit virtio_pci_module_exit(void)
+{
+    pci_unregister_driver(&virtio_pci_driver); 
+    virtio_net_unregister(); 
+    virtio_console_unregister(); 
+    debugfs_remove_recursive(virtio_pci_debugfs_root); 
+}
+
+module_init(virtio_pci_module_init);
+module_exit(virtio_pci_module_exit);
 MODULE_LICENSE("GPL"); 
 MODULE_DESCRIPTION("VirtIO PCI driver for VirtIO 1.2 devices");
 MODULE_AUTHOR("Chrinoic M");
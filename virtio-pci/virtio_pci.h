@@ -17,16 +17,16 @@
 #define VIRTIO_PCI_MIN_VECTORS          1 
 #define VIRTIO_PCI_MAX_VECTORS          1 
 
+/* MSI-X layout: vector 0 for config changes, vector index+1 for queue index */
+#define VIRTIO_PCI_CONFIG_VECTOR        0
+#define VIRTIO_PCI_VQ_VECTOR(index)     ((index) + 1)
+
 /* Feature selector values */
 #define VIRTIO_FSEL_0_31                0x0   /* Select feature bits 0..31 */
 #define VIRTIO_FSEL_32_63               0x1   /* Select feature bits 32..63 */
 #define VIRTIO_FSEL_64_95               0x2   /* Select feature bits 64..95 (if device supports) */
 #define VIRTIO_FSEL_96_127              0x3   /* Select feature bits 96..127 */
 
-#define VIRTIO_NET_QUEUE_RX             0
-#define VIRTIO_NET_QUEUE_TX             1
-#define VIRTIO_NET_QUEUE_CTRL           2
-
 #define VIRTIO_VIRTQUEUE_ENABLE         1 
 #define VIRTIO_VIRTQUEUE_DISABLE        0
 
@@ -40,6 +40,44 @@
 #define VIRTIO_CONFIG_S_RESET       0x00 
 #endif
 
+/* modern-only device: 0x1040 + VIRTIO_ID_VSOCK */
+#ifndef PCI_DEVICE_ID_VIRTIO_VSOCK
+#define PCI_DEVICE_ID_VIRTIO_VSOCK 0x1053
+#endif
+
+/* modern-only device: 0x1040 + VIRTIO_ID_CONSOLE */
+#ifndef PCI_DEVICE_ID_VIRTIO_CONSOLE
+#define PCI_DEVICE_ID_VIRTIO_CONSOLE 0x1043
+#endif
+
+/* common_cfg fields past struct virtio_pci_common_cfg (virtio 1.2) */
+#ifndef VIRTIO_PCI_COMMON_Q_RESET
+#define VIRTIO_PCI_COMMON_Q_NDATA       56  /* le16 queue_notify_data */
+#define VIRTIO_PCI_COMMON_Q_RESET       58  /* le16 queue_reset */
+#endif
+
+#ifndef VIRTIO_F_RING_RESET
+#define VIRTIO_F_RING_RESET             40
+#endif
+
+/* how long a per-queue reset may take before the queue is given up on */
+#define VIRTIO_PCI_Q_RESET_POLL_US      1000
+#define VIRTIO_PCI_Q_RESET_TIMEOUT_US   (1000 * USEC_PER_MSEC)
+
+/* same for a whole-device reset (device_status written to 0) */
+#define VIRTIO_PCI_RESET_POLL_US        1000
+#define VIRTIO_PCI_RESET_TIMEOUT_US     (1000 * USEC_PER_MSEC)
+
+/* transport-side per-queue state, reachable from vq->priv. Everything the
+ * data path needs is cached here at setup so kicks and interrupts never
+ * touch common_cfg; one cacheline per queue keeps the counters of queues
+ * driven from different CPUs apart */
+struct virtio_pci_vq_info {
+    void __iomem *notify_addr;      /* cached BAR address for this queue's doorbell */ 
+    u16 msix_vector;                /* reprogrammed after a queue reset */ 
+    u64 kicks;                      /* doorbell writes */ 
+    u64 interrupts;                 /* vring_interrupt() calls that found work */ 
+} ____cacheline_aligned_in_smp;
 
 /* Driver-specific structure */
 struct virtio_pci_dev {
@@ -51,7 +89,7 @@ struct virtio_pci_dev {
     struct virtio_pci_common_cfg __iomem *common_cfg;
     void __iomem *common_cfg_base; 
 
-    struct virtio_pci_notify_cap *notify_cap;
+    u32 notify_off_multiplier;      /* from the notify capability */
     void __iomem *notify_cap_base; 
     void __iomem *notify_base; 
 
@@ -62,13 +100,25 @@ struct virtio_pci_dev {
     void __iomem *device_cfg_base; 
 
     struct virtqueue **vqs; 
+    struct virtio_pci_vq_info *vq_info;     /* num_queues entries */ 
     int num_queues;
+    bool msix_enabled;  /* per-queue vectors, otherwise one shared vector */ 
+    bool frozen;        /* device reset by PM freeze, queues wait for restore */ 
+
+    void *drv_priv;     /* device-type state (e.g. struct virtio_net_dev) */ 
+
+    struct dentry *debugfs_dir;     /* <debugfs>/virtio-drivers/<pci name> */ 
 
-    spinlock_t vq_lock; 
+    /* queue_select picks which queue the per-queue common_cfg registers
+     * refer to; every select-then-access sequence holds cfg_lock */
+    struct mutex cfg_lock; 
 };
 
 /* Driver functions */
 int virtio_pci_init(struct virtio_pci_dev *vpci_dev);
 void virtio_pci_exit(struct virtio_pci_dev *vpci_dev);
+int virtio_pci_vq_irq(struct virtio_pci_dev *vpci_dev, unsigned int index);
+int virtio_pci_reset_device(struct virtio_pci_dev *vpci_dev);
+unsigned long virtio_pci_ring_bytes(struct virtio_pci_dev *vpci_dev);
 
 #endif // VIRTIO_PCI_H
@@ -0,0 +1,596 @@
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/interrupt.h>
+#include <linux/virtio.h>
+#include <linux/virtio_config.h>
+#include <linux/virtio_vsock.h>
+#include <linux/scatterlist.h>
+#include <linux/skbuff.h>
+#include <net/sock.h>
+#include <net/af_vsock.h>
+#include "virtio_vsock.h"
+
+/*the vsock core has no notion of devices, only one guest->host transport
+ * can be registered, so the device is a singleton like upstream's */
+static struct virtio_vsock_dev __rcu *the_vsock_dev;
+static DEFINE_MUTEX(the_vsock_lock);
+
+static struct virtio_transport virtio_vsock_transport;
+
+static u32 virtio_vsock_get_local_cid(void)
+{
+    struct virtio_vsock_dev *vsock_dev;
+    u32 cid = VMADDR_CID_ANY;
+
+    rcu_read_lock();
+    vsock_dev = rcu_dereference(the_vsock_dev);
+    if(vsock_dev)
+        cid = vsock_dev->guest_cid;
+    rcu_read_unlock();
+
+    return cid;
+}
+
+static void virtio_vsock_update_guest_cid(struct virtio_vsock_dev *vsock_dev)
+{
+    struct virtio_vsock_config __iomem *cfg = vsock_dev->vpci_dev->device_cfg;
+
+    /*guest_cid is 64 bit in config space but only the low 32 bits are used */
+    vsock_dev->guest_cid = le32_to_cpu(ioread32((void __iomem *)&cfg->guest_cid));
+}
+
+/*TX */
+
+/*reclaim packets the device has consumed, returns true if anything was freed */
+static bool virtio_vsock_free_old_xmit(struct virtio_vsock_dev *vsock_dev)
+{
+    struct virtqueue *vq = vsock_dev->vqs[VIRTIO_VSOCK_VQ_TX];
+    struct sk_buff *skb;
+    unsigned int len;
+    bool freed = false;
+
+    while((skb = virtqueue_get_buf(vq, &len)) != NULL)
+    {
+        consume_skb(skb);
+        freed = true;
+    }
+    return freed;
+}
+
+/*post everything waiting in send_queue, one kick for the whole batch */
+static void virtio_vsock_tx_work(struct work_struct *work)
+{
+    struct virtio_vsock_dev *vsock_dev = container_of(work, struct virtio_vsock_dev, tx_work);
+    struct virtqueue *vq = vsock_dev->vqs[VIRTIO_VSOCK_VQ_TX];
+    bool added = false;
+
+    mutex_lock(&vsock_dev->tx_lock);
+
+    if(!vsock_dev->tx_run)
+        goto out;
+
+    virtqueue_disable_cb(vq);
+    virtio_vsock_free_old_xmit(vsock_dev);
+
+    for(;;)
+    {
+        struct scatterlist hdr, buf, *sgs[2];
+        struct sk_buff *skb;
+        int out_sg = 0;
+        int ret;
+
+        skb = skb_dequeue(&vsock_dev->send_queue);
+        if(!skb)
+            break;
+
+        sg_init_one(&hdr, virtio_vsock_hdr(skb), sizeof(*virtio_vsock_hdr(skb)));
+        sgs[out_sg++] = &hdr;
+        if(skb->len > 0)
+        {
+            sg_init_one(&buf, skb->data, skb->len);
+            sgs[out_sg++] = &buf;
+        }
+
+        ret = virtqueue_add_sgs(vq, sgs, out_sg, 0, skb, GFP_KERNEL);
+        if(ret < 0)
+        {
+            /*ring full, retry from the TX callback once the device catches up */
+            skb_queue_head(&vsock_dev->send_queue, skb);
+            break;
+        }
+
+        virtio_transport_deliver_tap_pkt(skb);
+        added = true;
+    }
+
+    if(added)
+        virtqueue_kick(vq);
+
+    /*re-arm the TX callback so completions (and a full ring) wake us up */
+    if(unlikely(!virtqueue_enable_cb(vq)))
+        queue_work(vsock_dev->wq, &vsock_dev->tx_work);
+
+out:
+    mutex_unlock(&vsock_dev->tx_lock);
+}
+
+static int virtio_vsock_send_pkt(struct sk_buff *skb)
+{
+    struct virtio_vsock_dev *vsock_dev;
+    int len = skb->len;
+
+    rcu_read_lock();
+    vsock_dev = rcu_dereference(the_vsock_dev);
+    if(!vsock_dev)
+    {
+        kfree_skb(skb);
+        len = -ENODEV;
+        goto out;
+    }
+
+    if(le64_to_cpu(virtio_vsock_hdr(skb)->dst_cid) == vsock_dev->guest_cid)
+    {
+        kfree_skb(skb);
+        len = -ENODEV;
+        goto out;
+    }
+
+    skb_queue_tail(&vsock_dev->send_queue, skb);
+    queue_work(vsock_dev->wq, &vsock_dev->tx_work);
+
+out:
+    rcu_read_unlock();
+    return len;
+}
+
+static int virtio_vsock_cancel_pkt(struct vsock_sock *vsk)
+{
+    struct virtio_vsock_dev *vsock_dev;
+    int ret = -ENODEV;
+
+    rcu_read_lock();
+    vsock_dev = rcu_dereference(the_vsock_dev);
+    if(vsock_dev)
+        ret = virtio_transport_purge_skbs(vsk, &vsock_dev->send_queue);
+    rcu_read_unlock();
+
+    return ret < 0 ? ret : 0;
+}
+
+void virtio_vsock_tx_callback(struct virtqueue *vq)
+{
+    struct virtio_pci_dev *vpci_dev = vq->vdev->priv;
+    struct virtio_vsock_dev *vsock_dev = vpci_dev->drv_priv;
+
+    if(!vsock_dev)
+        return;
+
+    virtqueue_disable_cb(vq);
+    queue_work(vsock_dev->wq, &vsock_dev->tx_work);
+}
+
+/*RX */
+
+static int virtio_vsock_add_rx_buf(struct virtio_vsock_dev *vsock_dev, void *buf, gfp_t gfp)
+{
+    struct scatterlist sg[1];
+
+    sg_init_one(sg, buf, VIRTIO_VSOCK_RX_BUF_LEN);
+    return virtqueue_add_inbuf(vsock_dev->vqs[VIRTIO_VSOCK_VQ_RX], sg, 1, buf, gfp);
+}
+
+/*allocate the RX pool and post every buffer, called once at init. The
+ * device is only told about them in virtio_vsock_ready() */
+static int virtio_vsock_fill_rx(struct virtio_vsock_dev *vsock_dev)
+{
+    struct virtqueue *vq = vsock_dev->vqs[VIRTIO_VSOCK_VQ_RX];
+    unsigned int x;
+    int ret;
+
+    vsock_dev->rx_pool_size = virtqueue_get_vring_size(vq);
+    vsock_dev->rx_pool = kcalloc(vsock_dev->rx_pool_size, sizeof(*vsock_dev->rx_pool), GFP_KERNEL);
+    if(!vsock_dev->rx_pool)
+        return -ENOMEM;
+
+    for(x = 0; x < vsock_dev->rx_pool_size; x++)
+    {
+        vsock_dev->rx_pool[x] = kmalloc(VIRTIO_VSOCK_RX_BUF_LEN, GFP_KERNEL);
+        if(!vsock_dev->rx_pool[x])
+            return -ENOMEM;
+
+        ret = virtio_vsock_add_rx_buf(vsock_dev, vsock_dev->rx_pool[x], GFP_KERNEL);
+        if(ret)
+            return ret;
+    }
+
+    return 0;
+}
+
+static void virtio_vsock_free_rx(struct virtio_vsock_dev *vsock_dev)
+{
+    unsigned int x;
+
+    if(!vsock_dev->rx_pool)
+        return;
+
+    /*device is reset by now, buffers still in the ring are ours again */
+    while(virtqueue_detach_unused_buf(vsock_dev->vqs[VIRTIO_VSOCK_VQ_RX]))
+        ;
+
+    for(x = 0; x < vsock_dev->rx_pool_size; x++)
+        kfree(vsock_dev->rx_pool[x]);
+    kfree(vsock_dev->rx_pool);
+    vsock_dev->rx_pool = NULL;
+}
+
+/*copy one received packet out of a pool buffer into an skb sized for it */
+static struct sk_buff *virtio_vsock_rx_copy(void *buf, unsigned int len)
+{
+    struct virtio_vsock_hdr *hdr = buf;
+    unsigned int payload_len;
+    struct sk_buff *skb;
+
+    if(len < sizeof(*hdr))
+        return NULL;
+
+    payload_len = le32_to_cpu(hdr->len);
+    if(payload_len > len - sizeof(*hdr))
+        return NULL;
+
+    skb = virtio_vsock_alloc_skb(VIRTIO_VSOCK_SKB_HEADROOM + payload_len, GFP_KERNEL);
+    if(!skb)
+        return NULL;
+
+    memcpy(virtio_vsock_hdr(skb), hdr, sizeof(*hdr));
+    if(payload_len)
+        skb_put_data(skb, buf + sizeof(*hdr), payload_len);
+
+    return skb;
+}
+
+static void virtio_vsock_rx_work(struct work_struct *work)
+{
+    struct virtio_vsock_dev *vsock_dev = container_of(work, struct virtio_vsock_dev, rx_work);
+    struct virtqueue *vq = vsock_dev->vqs[VIRTIO_VSOCK_VQ_RX];
+    bool reposted = false;
+
+    mutex_lock(&vsock_dev->rx_lock);
+
+    if(!vsock_dev->rx_run)
+        goto out;
+
+    do {
+        struct sk_buff *skb;
+        unsigned int len;
+        void *buf;
+
+        virtqueue_disable_cb(vq);
+        while((buf = virtqueue_get_buf(vq, &len)) != NULL)
+        {
+            skb = virtio_vsock_rx_copy(buf, len);
+
+            /*buffer goes straight back to the device, the skb owns a copy */
+            if(virtio_vsock_add_rx_buf(vsock_dev, buf, GFP_KERNEL) == 0)
+                reposted = true;
+
+            if(!skb)
+                continue;
+
+            virtio_transport_deliver_tap_pkt(skb);
+            virtio_transport_recv_pkt(&virtio_vsock_transport, skb);
+        }
+    } while(!virtqueue_enable_cb(vq));
+
+    if(reposted)
+        virtqueue_kick(vq);
+
+out:
+    mutex_unlock(&vsock_dev->rx_lock);
+}
+
+void virtio_vsock_rx_callback(struct virtqueue *vq)
+{
+    struct virtio_pci_dev *vpci_dev = vq->vdev->priv;
+    struct virtio_vsock_dev *vsock_dev = vpci_dev->drv_priv;
+
+    if(!vsock_dev)
+        return;
+
+    virtqueue_disable_cb(vq);
+    queue_work(vsock_dev->wq, &vsock_dev->rx_work);
+}
+
+/*event queue */
+
+static int virtio_vsock_add_event(struct virtio_vsock_dev *vsock_dev,
+                                  struct virtio_vsock_event *event)
+{
+    struct scatterlist sg[1];
+
+    sg_init_one(sg, event, sizeof(*event));
+    return virtqueue_add_inbuf(vsock_dev->vqs[VIRTIO_VSOCK_VQ_EVENT], sg, 1, event, GFP_KERNEL);
+}
+
+static void virtio_vsock_fill_events(struct virtio_vsock_dev *vsock_dev)
+{
+    int x;
+
+    for(x = 0; x < VIRTIO_VSOCK_EVENT_BUFS; x++)
+        virtio_vsock_add_event(vsock_dev, &vsock_dev->event_list[x]);
+}
+
+static void virtio_vsock_reset_sock(struct sock *sk)
+{
+    /*called under vsock_table_lock from vsock_for_each_connected_socket */
+    sk->sk_state = TCP_CLOSE;
+    sk->sk_err = ECONNRESET;
+    sk_error_report(sk);
+}
+
+static void virtio_vsock_event_work(struct work_struct *work)
+{
+    struct virtio_vsock_dev *vsock_dev = container_of(work, struct virtio_vsock_dev, event_work);
+    struct virtqueue *vq = vsock_dev->vqs[VIRTIO_VSOCK_VQ_EVENT];
+
+    mutex_lock(&vsock_dev->event_lock);
+
+    if(!vsock_dev->event_run)
+        goto out;
+
+    do {
+        struct virtio_vsock_event *event;
+        unsigned int len;
+
+        virtqueue_disable_cb(vq);
+        while((event = virtqueue_get_buf(vq, &len)) != NULL)
+        {
+            if(len == sizeof(*event) &&
+               le32_to_cpu(event->id) == VIRTIO_VSOCK_EVENT_TRANSPORT_RESET)
+            {
+                /*migrated to a new host, our cid may have changed and
+                 * every connection is gone */
+                virtio_vsock_update_guest_cid(vsock_dev);
+                vsock_for_each_connected_socket(&virtio_vsock_transport.transport,
+                                                virtio_vsock_reset_sock);
+            }
+
+            virtio_vsock_add_event(vsock_dev, event);
+        }
+    } while(!virtqueue_enable_cb(vq));
+
+    virtqueue_kick(vq);
+
+out:
+    mutex_unlock(&vsock_dev->event_lock);
+}
+
+void virtio_vsock_event_callback(struct virtqueue *vq)
+{
+    struct virtio_pci_dev *vpci_dev = vq->vdev->priv;
+    struct virtio_vsock_dev *vsock_dev = vpci_dev->drv_priv;
+
+    if(!vsock_dev)
+        return;
+
+    queue_work(vsock_dev->wq, &vsock_dev->event_work);
+}
+
+static bool virtio_vsock_seqpacket_allow(u32 remote_cid)
+{
+    struct virtio_vsock_dev *vsock_dev;
+    bool allow = false;
+
+    rcu_read_lock();
+    vsock_dev = rcu_dereference(the_vsock_dev);
+    if(vsock_dev)
+        allow = vsock_dev->vpci_dev->guest_features & BIT_ULL(VIRTIO_VSOCK_F_SEQPACKET);
+    rcu_read_unlock();
+
+    return allow;
+}
+
+/*credit based flow control (buf_alloc/fwd_cnt) is implemented by the
+ * virtio_transport_* helpers, the driver only moves packets */
+static struct virtio_transport virtio_vsock_transport = {
+    .transport = {
+        .module                   = THIS_MODULE,
+
+        .get_local_cid            = virtio_vsock_get_local_cid,
+
+        .init                     = virtio_transport_do_socket_init,
+        .destruct                 = virtio_transport_destruct,
+        .release                  = virtio_transport_release,
+        .connect                  = virtio_transport_connect,
+        .shutdown                 = virtio_transport_shutdown,
+        .cancel_pkt               = virtio_vsock_cancel_pkt,
+
+        .dgram_bind               = virtio_transport_dgram_bind,
+        .dgram_dequeue            = virtio_transport_dgram_dequeue,
+        .dgram_enqueue            = virtio_transport_dgram_enqueue,
+        .dgram_allow              = virtio_transport_dgram_allow,
+
+        .stream_dequeue           = virtio_transport_stream_dequeue,
+        .stream_enqueue           = virtio_transport_stream_enqueue,
+        .stream_has_data          = virtio_transport_stream_has_data,
+        .stream_has_space         = virtio_transport_stream_has_space,
+        .stream_rcvhiwat          = virtio_transport_stream_rcvhiwat,
+        .stream_is_active         = virtio_transport_stream_is_active,
+        .stream_allow             = virtio_transport_stream_allow,
+
+        .seqpacket_dequeue        = virtio_transport_seqpacket_dequeue,
+        .seqpacket_enqueue        = virtio_transport_seqpacket_enqueue,
+        .seqpacket_allow          = virtio_vsock_seqpacket_allow,
+        .seqpacket_has_data       = virtio_transport_seqpacket_has_data,
+
+        .notify_poll_in           = virtio_transport_notify_poll_in,
+        .notify_poll_out          = virtio_transport_notify_poll_out,
+        .notify_recv_init         = virtio_transport_notify_recv_init,
+        .notify_recv_pre_block    = virtio_transport_notify_recv_pre_block,
+        .notify_recv_pre_dequeue  = virtio_transport_notify_recv_pre_dequeue,
+        .notify_recv_post_dequeue = virtio_transport_notify_recv_post_dequeue,
+        .notify_send_init         = virtio_transport_notify_send_init,
+        .notify_send_pre_block    = virtio_transport_notify_send_pre_block,
+        .notify_send_pre_enqueue  = virtio_transport_notify_send_pre_enqueue,
+        .notify_send_post_enqueue = virtio_transport_notify_send_post_enqueue,
+        .notify_buffer_size       = virtio_transport_notify_buffer_size,
+    },
+
+    .send_pkt = virtio_vsock_send_pkt,
+};
+
+/*initialize virtio-vsock device */
+int virtio_vsock_init(struct virtio_pci_dev *vpci_dev)
+{
+    struct virtio_vsock_dev *vsock_dev;
+    int ret;
+    int x;
+
+    mutex_lock(&the_vsock_lock);
+    if(rcu_dereference_protected(the_vsock_dev, lockdep_is_held(&the_vsock_lock)))
+    {
+        dev_err(&vpci_dev->pdev->dev, "Only one virtio-vsock device is supported\n");
+        ret = -EBUSY;
+        goto err_unlock;
+    }
+
+    vsock_dev = kzalloc(sizeof(*vsock_dev), GFP_KERNEL);
+    if(!vsock_dev)
+    {
+        ret = -ENOMEM;
+        goto err_unlock;
+    }
+
+    vsock_dev->vpci_dev = vpci_dev;
+    for(x = 0; x < VIRTIO_VSOCK_VQ_MAX; x++)
+        vsock_dev->vqs[x] = vpci_dev->vqs[x];
+
+    vsock_dev->wq = alloc_workqueue("virtio_vsock", 0, 0);
+    if(!vsock_dev->wq)
+    {
+        ret = -ENOMEM;
+        goto err_free_dev;
+    }
+
+    skb_queue_head_init(&vsock_dev->send_queue);
+    mutex_init(&vsock_dev->tx_lock);
+    mutex_init(&vsock_dev->rx_lock);
+    mutex_init(&vsock_dev->event_lock);
+    INIT_WORK(&vsock_dev->tx_work, virtio_vsock_tx_work);
+    INIT_WORK(&vsock_dev->rx_work, virtio_vsock_rx_work);
+    INIT_WORK(&vsock_dev->event_work, virtio_vsock_event_work);
+
+    virtio_vsock_update_guest_cid(vsock_dev);
+
+    ret = virtio_vsock_fill_rx(vsock_dev);
+    if(ret)
+    {
+        dev_err(&vpci_dev->pdev->dev, "Failed to fill RX pool: %d\n", ret);
+        goto err_free_rx;
+    }
+    virtio_vsock_fill_events(vsock_dev);
+
+    vsock_dev->tx_run = true;
+    vsock_dev->rx_run = true;
+    vsock_dev->event_run = true;
+
+    vpci_dev->drv_priv = vsock_dev;
+
+    rcu_assign_pointer(the_vsock_dev, vsock_dev);
+    mutex_unlock(&the_vsock_lock);
+
+    return 0;
+
+err_free_rx:
+    virtio_vsock_free_rx(vsock_dev);
+    destroy_workqueue(vsock_dev->wq);
+err_free_dev:
+    kfree(vsock_dev);
+err_unlock:
+    mutex_unlock(&the_vsock_lock);
+    return ret;
+}
+
+/*called once DRIVER_OK is set: the device may only be notified and
+ * sockets may only use the transport after this */
+void virtio_vsock_ready(struct virtio_vsock_dev *vsock_dev)
+{
+    struct virtio_pci_dev *vpci_dev = vsock_dev->vpci_dev;
+    int ret;
+
+    mutex_lock(&vsock_dev->rx_lock);
+    virtqueue_kick(vsock_dev->vqs[VIRTIO_VSOCK_VQ_RX]);
+    mutex_unlock(&vsock_dev->rx_lock);
+
+    mutex_lock(&vsock_dev->event_lock);
+    virtqueue_kick(vsock_dev->vqs[VIRTIO_VSOCK_VQ_EVENT]);
+    mutex_unlock(&vsock_dev->event_lock);
+
+    mutex_lock(&the_vsock_lock);
+    ret = vsock_core_register(&virtio_vsock_transport.transport, VSOCK_TRANSPORT_F_G2H);
+    if(ret)
+        dev_err(&vpci_dev->pdev->dev, "Failed to register vsock transport: %d\n", ret);
+    else
+        vsock_dev->registered = true;
+    mutex_unlock(&the_vsock_lock);
+
+    if(!ret)
+        dev_info(&vpci_dev->pdev->dev, "virtio-vsock initialized, guest CID %u\n", vsock_dev->guest_cid);
+}
+
+/*cleanup virtio-vsock device */
+void virtio_vsock_exit(struct virtio_vsock_dev *vsock_dev)
+{
+    struct virtio_pci_dev *vpci_dev = vsock_dev->vpci_dev;
+    struct sk_buff *skb;
+    u16 vec;
+    int x;
+
+    mutex_lock(&the_vsock_lock);
+
+    /*stop new packets from the vsock core before tearing anything down */
+    rcu_assign_pointer(the_vsock_dev, NULL);
+    synchronize_rcu();
+    if(vsock_dev->registered)
+    {
+        vsock_core_unregister(&virtio_vsock_transport.transport);
+        vsock_for_each_connected_socket(&virtio_vsock_transport.transport, virtio_vsock_reset_sock);
+        vsock_dev->registered = false;
+    }
+
+    mutex_lock(&vsock_dev->rx_lock);
+    vsock_dev->rx_run = false;
+    mutex_unlock(&vsock_dev->rx_lock);
+
+    mutex_lock(&vsock_dev->tx_lock);
+    vsock_dev->tx_run = false;
+    mutex_unlock(&vsock_dev->tx_lock);
+
+    mutex_lock(&vsock_dev->event_lock);
+    vsock_dev->event_run = false;
+    mutex_unlock(&vsock_dev->event_lock);
+
+    vpci_dev->drv_priv = NULL;
+
+    /*reset before reclaiming buffers so the device can't still be using them,
+     * then wait out callbacks that read drv_priv before it was cleared: they
+     * may still queue work, the workqueue has to outlive them */
+    virtio_pci_reset_device(vpci_dev);
+    for(x = 0; x < VIRTIO_VSOCK_VQ_MAX; x++)
+    {
+        vec = vpci_dev->vq_info[vsock_dev->vqs[x]->index].msix_vector;
+        synchronize_irq(pci_irq_vector(vpci_dev->pdev,
+                        vec != VIRTIO_MSI_NO_VECTOR ? vec : VIRTIO_PCI_CONFIG_VECTOR));
+    }
+    destroy_workqueue(vsock_dev->wq);
+
+    skb_queue_purge(&vsock_dev->send_queue);
+    while((skb = virtqueue_detach_unused_buf(vsock_dev->vqs[VIRTIO_VSOCK_VQ_TX])) != NULL)
+        kfree_skb(skb);
+    while(virtqueue_detach_unused_buf(vsock_dev->vqs[VIRTIO_VSOCK_VQ_EVENT]))
+        ;
+    virtio_vsock_free_rx(vsock_dev);
+
+    kfree(vsock_dev);
+
+    mutex_unlock(&the_vsock_lock);
+}
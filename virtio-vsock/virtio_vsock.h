@@ -0,0 +1,65 @@
+
+#ifndef VIRTIO_VSOCK_DRIVER_H
+#define VIRTIO_VSOCK_DRIVER_H
+
+#include <linux/virtio.h>
+#include <linux/virtio_vsock.h>    // provides struct virtio_vsock_hdr, skb helpers, etc.
+#include <linux/workqueue.h>
+#include <linux/mutex.h>
+#include <linux/skbuff.h>
+#include "virtio_pci.h"
+
+/* features the virtio-vsock driver is willing to accept */
+#define VIRTIO_VSOCK_DRIVER_FEATURES    BIT_ULL(VIRTIO_VSOCK_F_SEQPACKET)
+
+/* RX buffers: header plus one default-sized payload, copied out on receive
+ * and re-posted so the ring is filled exactly once at init */
+#define VIRTIO_VSOCK_RX_BUF_LEN         (sizeof(struct virtio_vsock_hdr) + \
+                                         VIRTIO_VSOCK_DEFAULT_RX_BUF_SIZE)
+
+/* queue layout from the virtio spec */
+enum {
+    VIRTIO_VSOCK_VQ_RX = 0,
+    VIRTIO_VSOCK_VQ_TX,
+    VIRTIO_VSOCK_VQ_EVENT,
+    VIRTIO_VSOCK_VQ_MAX,
+};
+
+#define VIRTIO_VSOCK_EVENT_BUFS         8
+
+struct virtio_vsock_dev {
+    struct virtio_pci_dev *vpci_dev;
+    struct virtqueue *vqs[VIRTIO_VSOCK_VQ_MAX];
+    struct workqueue_struct *wq;
+
+    u32 guest_cid;
+    /* transport registered with the vsock core, done after DRIVER_OK */
+    bool registered;
+
+    /* TX: packets from the vsock core wait here until tx_work posts them */
+    struct sk_buff_head send_queue;
+    struct work_struct tx_work;
+    struct mutex tx_lock;
+    bool tx_run;
+
+    /* RX: fixed pool of buffers posted once and recycled after each copy */
+    void **rx_pool;
+    unsigned int rx_pool_size;
+    struct work_struct rx_work;
+    struct mutex rx_lock;
+    bool rx_run;
+
+    /* event queue (transport reset) */
+    struct virtio_vsock_event event_list[VIRTIO_VSOCK_EVENT_BUFS];
+    struct work_struct event_work;
+    struct mutex event_lock;
+    bool event_run;
+};
+
+int virtio_vsock_init(struct virtio_pci_dev *vpci_dev);
+void virtio_vsock_ready(struct virtio_vsock_dev *vsock_dev);
+void virtio_vsock_exit(struct virtio_vsock_dev *vsock_dev);
+void virtio_vsock_rx_callback(struct virtqueue *vq);
+void virtio_vsock_tx_callback(struct virtqueue *vq);
+void virtio_vsock_event_callback(struct virtqueue *vq);
+#endif /* VIRTIO_VSOCK_DRIVER_H */